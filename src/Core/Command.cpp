@@ -102,32 +102,20 @@ CmdArgs::CmdArgs(const char *text, int length, bool expandCvars)
 // Hashtable operations
 static inline size_t hash_value(const cmd_t &cmd)
 {
-	StringIHash hasher;
-	return hasher(cmd.name);
+	return StringTable::Hash(cmd.name);
 }
 static inline bool operator==(const cmd_t &a, const cmd_t &b)
 {
-	return !stricmp(a.name, b.name);
+	return StringTable::Canonical(a.name) == StringTable::Canonical(b.name);
 }
 
 // Hash table of all commands
 static HashTable<cmd_t> cmdTable;
 
-// Compare functor used in Cmd::Find
-struct CmdCompare {
-	bool operator()(const char *str, const cmd_t &cmd)
-	{
-		return stricmp(str, cmd.name) == 0;
-	}
-};
-
 cmd_t *Cmd::Find(const char *name)
 {
-	HashTable<cmd_t>::iterator iter = cmdTable.find(name, StringIHash(), CmdCompare());
-	if (iter == cmdTable.end())
-		return NULL;
-	else
-		return &*iter;
+	// Commands are registered in the string table entry of their name
+	return static_cast<cmd_t *>(StringTable::FindObject(name, StringTable::OBJECT_COMMAND));
 }
 
 void Cmd::Complete(completionCallback_t callback)
@@ -138,9 +126,10 @@ void Cmd::Complete(completionCallback_t callback)
 
 void Cmd::Register(const char *name, commandFunc_t command, completionFunc_t complete)
 {
+	MemTagScope scope(MEMTAG_CVAR);
 	cmd_t *cmd = new cmd_t;
 
-	cmd->name = CopyString(name);
+	cmd->name = StringTable::Intern(name);
 	cmd->command = command;
 	cmd->complete = complete;
 
@@ -148,6 +137,8 @@ void Cmd::Register(const char *name, commandFunc_t command, completionFunc_t com
 
 	if (!success)
 		Warning("Command %s already exists", name);
+	else
+		StringTable::SetObject(cmd->name, StringTable::OBJECT_COMMAND, cmd);
 }
 
 void Cmd::UnRegister(const char *name)
@@ -157,7 +148,7 @@ void Cmd::UnRegister(const char *name)
 		return;
 
 	cmdTable.erase(cmdTable.iterator_to(*cmd));
-	FreeString(cmd->name);
+	StringTable::SetObject(cmd->name, StringTable::OBJECT_COMMAND, NULL);
 }
 
 void Cmd::RunArgs(CmdArgs *args)
@@ -390,8 +381,10 @@ static void Set_f(CmdArgs *args)
 	}
 
 	// Set the cvar
-	if (!var)
+	if (!var) {
+		MemTagScope scope(MEMTAG_CVAR);
 		var = new Cvar(args->Argv(1), CVAR_USER, "", "");
+	}
 	var->Set(args->Args(2), false);
 }
 
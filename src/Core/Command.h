@@ -65,7 +65,7 @@ typedef void (*completionFunc_t)(CmdArgs *args, int argNum, completionCallback_t
 
 // Console command descriptor
 struct cmd_t: public HashTable<cmd_t>::Hook {
-	const char *name;
+	const char *name; // Interned in the string table
 	commandFunc_t command;
 	completionFunc_t complete;
 };
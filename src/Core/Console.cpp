@@ -78,7 +78,9 @@ void ConsoleField::RunCommand()
 
 	Msg(CONSOLE_PROMPT "%s", buffer);
 
-	// If it starts with a / then it's a command, if not then it's chat.
+	// If it starts with a / then it's a command, if not then it's chat. Only
+	// the job is charged to the console, not the command itself.
+	MemTagScope scope(MEMTAG_CONSOLE);
 	if (buffer[0] == '/')
 		ThreadPool::AddJob(tr1::bind(Cmd::ExecuteString, strwrap(buffer + 1)));
 	else {
@@ -130,6 +132,7 @@ void PrintCvarMatches(const char *str)
 
 void ConsoleField::Autocomplete()
 {
+	MemTagScope scope(MEMTAG_CONSOLE);
 	CmdArgs args;
 	int argNum;
 
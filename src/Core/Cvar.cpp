@@ -35,6 +35,7 @@ void Cvar::SetInternal(const char *newString, float newFloat, int newInt, bool f
 	intVal = newInt;
 	floatVal = newFloat;
 	if (strcmp(stringVal, newString)) {
+		MemTagScope scope(MEMTAG_CVAR);
 		FreeString(stringVal);
 		stringVal = CopyString(newString);
 	}
@@ -53,10 +54,9 @@ void Cvar::Delete()
 	}
 
 	cvarTable.erase(cvarTable.iterator_to(*realVar));
+	StringTable::SetObject(realVar->name, StringTable::OBJECT_CVAR, NULL);
 
-	FreeString(realVar->name);
-	FreeString(realVar->description);
-	FreeString(realVar->initialValue);
+	// The name, description and initial value are interned and never freed
 	FreeString(realVar->stringVal);
 
 	// This is a user created cvar so it must have been dynamically allocated
@@ -80,6 +80,8 @@ void Cvar::Init(const char *name, int flags, const char *initialValue,
                 const char *description, float min, float max,
                 cvarHook_t getHook, cvarHook_t setHook, bool copy)
 {
+	MemTagScope scope(MEMTAG_CVAR);
+
 	// Check if a cvar with the same name already exists
 	realVar = Cvar::Find(name);
 	if (realVar) {
@@ -95,10 +97,8 @@ void Cvar::Init(const char *name, int flags, const char *initialValue,
 		realVar->max = max;
 		realVar->getHook = getHook;
 		realVar->setHook = setHook;
-		FreeString(realVar->description);
-		realVar->description = CopyString(description);
-		FreeString(realVar->initialValue);
-		realVar->initialValue = CopyString(initialValue);
+		realVar->description = StringTable::Intern(description);
+		realVar->initialValue = StringTable::Intern(initialValue);
 
 		// Force back to the initial value if read-only
 		if (flags & CVAR_ROM)
@@ -119,10 +119,10 @@ void Cvar::Init(const char *name, int flags, const char *initialValue,
 
 	// Copy info
 	realVar = this;
-	this->name = CopyString(name);
+	this->name = StringTable::Intern(name);
 	this->flags = flags;
-	this->initialValue = CopyString(initialValue);
-	this->description = CopyString(description);
+	this->initialValue = StringTable::Intern(initialValue);
+	this->description = StringTable::Intern(description);
 	this->min = min;
 	this->max = max;
 	this->getHook = getHook;
@@ -133,6 +133,7 @@ void Cvar::Init(const char *name, int flags, const char *initialValue,
 	Reset();
 	SetModified();
 
-	// Add to hash table
+	// Add to hash table, and register it for lookups by name
 	cvarTable.insert_equal(*this);
+	StringTable::SetObject(this->name, StringTable::OBJECT_CVAR, this);
 }
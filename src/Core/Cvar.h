@@ -157,7 +157,7 @@ public:
 	static void Complete(completionCallback_t callback);
 
 private:
-	// Name of the variable
+	// Name of the variable, interned in the string table
 	const char *name;
 
 	// If there is another var with the same name, then this will point to it,
@@ -169,8 +169,8 @@ private:
 	const char *stringVal;
 
 	int flags;
-	const char *initialValue;
-	const char *description;
+	const char *initialValue; // Interned
+	const char *description; // Interned
 	float min, max;
 	cvarHook_t getHook, setHook;
 
@@ -182,25 +182,16 @@ private:
 	void Init(const char *name, int flags, const char *initialValue,
 	          const char *description, float min, float max,
 	          cvarHook_t getHook, cvarHook_t setHook, bool copy = IS_MODULE);
-
-	// Compare functor used in Cvar::Find
-	struct CvarCompare {
-		bool operator()(const char *str, const Cvar &cvar)
-		{
-			return stricmp(str, cvar.Name()) == 0;
-		}
-	};
 };
 
 // Hashtable operations
 inline size_t hash_value(const Cvar &cvar)
 {
-	StringIHash hasher;
-	return hasher(cvar.Name());
+	return StringTable::Hash(cvar.Name());
 }
 inline bool operator==(const Cvar &a, const Cvar &b)
 {
-	return !stricmp(a.Name(), b.Name());
+	return StringTable::Canonical(a.Name()) == StringTable::Canonical(b.Name());
 }
 
 // Hash table of all cvars
@@ -208,11 +199,8 @@ extern EXPORT HashTable<Cvar> cvarTable;
 
 inline Cvar *Cvar::Find(const char *name)
 {
-	HashTable<Cvar>::iterator iter = cvarTable.find(name, StringIHash(), CvarCompare());
-	if (iter == cvarTable.end())
-		return NULL;
-	else
-		return &*iter;
+	// Cvars are registered in the string table entry of their name
+	return static_cast<Cvar *>(StringTable::FindObject(name, StringTable::OBJECT_CVAR));
 }
 
 template<typename Func> inline void Cvar::FindFlag(int flag, const Func &func)
@@ -5,33 +5,18 @@
 #ifdef _WIN32
 #define USE_WIN32_AIO
 #else
-#define USE_NO_AIO
+// Requests are handled by AsyncIO, which uses io_uring when available and
+// falls back to blocking I/O threads otherwise
+#define USE_ASYNCIO
 #endif
 
-// Generic asynchronous operation descriptor
 #ifdef USE_WIN32_AIO
+
+// Generic asynchronous operation descriptor
 struct fsAsync_t: public OVERLAPPED {
 	// Whether this is a read or write operation
 	bool write;
 };
-#else
-struct fsAsync_t: public LFQueue<fsAsync_t>::Hook {
-	// Whether this is a read or write operation
-	bool write;
-
-	// Number of bytes to read/write
-	int length;
-
-	// Offset from which to read/write
-	fsOffset_t offset;
-
-	// Source/destination buffer
-	void *buffer;
-
-	// File to read/write to
-	OSFile *file;
-};
-#endif
 
 // Read operation descriptor
 struct fsAsyncRead_t: public fsAsync_t, UseMemPool<fsAsyncRead_t> {
@@ -45,15 +30,8 @@ struct fsAsyncWrite_t: public fsAsync_t, UseMemPool<fsAsyncWrite_t> {
 	tr1::function<void()> callback;
 };
 
-// Queue of operations for the async thread
-#ifdef USE_WIN32_AIO
+// Completion port for all operations
 static HANDLE completionPort = CreateIoCompletionPort(NULL, NULL, 0, 0);
-#else
-static LFQueue<fsAsync_t> asyncQueue;
-static Mutex asyncLock;
-static Semaphore asyncQueueSem;
-static bool stopAsync = false;
-#endif
 
 // Semaphore to wait for async thread exit
 static Semaphore asyncThreadExit;
@@ -63,16 +41,8 @@ static void AsyncThread();
 static inline void AsyncInit()
 {
 	Thread::SpawnThread(AsyncThread);
-
-	// Use a second thread if we don't have real aio, so we can issue 2
-	// operations at once, to allow the kernel to reorder operations.
-#ifdef USE_NO_AIO
-	Thread::SpawnThread(AsyncThread);
-#endif
 }
 
-#ifdef USE_WIN32_AIO
-
 // Thread which recieves all asynchronous I/O completion notices, and executes
 // the callbacks.
 static void AsyncThread()
@@ -188,60 +158,16 @@ static inline void AsyncRequestWrite(OSFile *file, const void *data, int length,
 
 #else
 
-// Thread which recieves all asynchronous I/O requests, and executes them using
-// blocking I/O. 2 threads are used to allow more I/O to be processed at once.
-static void AsyncThread()
+static inline void AsyncInit()
 {
-	while (true) {
-		// Wait for a request
-		asyncQueueSem.Wait();
-
-		// Pop request off the queue
-		asyncLock.Lock();
-		fsAsync_t *async = asyncQueue.Pop();
-		asyncLock.Unlock();
-
-		// NULL request means exit
-		if (!async) {
-			asyncThreadExit.Post();
-			return;
-		}
-
-		// Ignore all reads if we are shutting down
-		if (stopAsync && !async->write) {
-			delete async;
-			continue;
-		}
-
-		// Execute the request and run the callback
-		if (async->write) {
-			fsAsyncWrite_t *realAsync = static_cast<fsAsyncWrite_t *>(async);
-			if (async->file->mode == FS_APPEND)
-				async->file->OSFile::Write(async->buffer, async->length);
-			else
-				async->file->OSFile::WriteEx(async->buffer, async->length, async->offset);
-			if (realAsync->callback)
-				realAsync->callback();
-		} else {
-			fsAsyncRead_t *realAsync = static_cast<fsAsyncRead_t *>(async);
-			int result = async->file->OSFile::ReadEx(async->buffer, async->length, async->offset);
-			if (realAsync->callback)
-				realAsync->callback(result);
-		}
-
-		// Free the structure
-		delete async;
-	}
+	if (Filesystem::AsyncIO::Init())
+		Printf("Using io_uring for asynchronous I/O");
 }
 
-// Shut down the async thread
+// Shut down the async backend once all pending requests have completed
 static inline void AsyncShutdown()
 {
-	// Wait for the async threads to finish working
-	stopAsync = true;
-	asyncQueueSem.Post(2);
-	asyncThreadExit.Wait();
-	asyncThreadExit.Wait();
+	Filesystem::AsyncIO::Shutdown();
 }
 
 static inline void AsyncPrepareFile(OSFile *)
@@ -250,38 +176,28 @@ static inline void AsyncPrepareFile(OSFile *)
 
 static inline void AsyncRequestRead(OSFile *file, void *buffer, int length, fsOffset_t offset, const tr1::function<void(int)> &callback)
 {
-	// Build request
-	fsAsyncRead_t *async = new fsAsyncRead_t;
-	async->write = false;
-	async->file = file;
-	async->buffer = buffer;
-	async->length = length;
-	async->offset = offset;
-	async->callback.swap(const_cast<tr1::function<void(int)> &>(callback));
-
-	// Add request to the end of the queue
-	asyncQueue.Push(*async);
-
-	// Signal the async thread that there is a new request
-	asyncQueueSem.Post();
+	tr1::function<void(int)> func;
+	func.swap(const_cast<tr1::function<void(int)> &>(callback));
+	Filesystem::AsyncIO::Read(file->fd, buffer, length, offset, [func](std::error_code err, size_t result) {
+		if (func)
+			func(err ? 0 : result);
+	});
 }
 
 static inline void AsyncRequestWrite(OSFile *file, const void *data, int length, fsOffset_t offset, const tr1::function<void()> &callback)
 {
-	// Build request
-	fsAsyncWrite_t *async = new fsAsyncWrite_t;
-	async->write = true;
-	async->file = file;
-	async->buffer = const_cast<void *>(data);
-	async->length = length;
-	async->offset = offset;
-	async->callback.swap(const_cast<tr1::function<void()> &>(callback));
-
-	// Add request to the end of the queue
-	asyncQueue.Push(*async);
-
-	// Signal the async thread that there is a new request
-	asyncQueueSem.Post();
+	// Files opened for appending use O_APPEND, so the offset is ignored
+	tr1::function<void()> func;
+	func.swap(const_cast<tr1::function<void()> &>(callback));
+	Filesystem::AsyncIO::Write(file->fd, data, length, offset, [func](std::error_code err, size_t) {
+		if (err)
+			Warning("Error writing to file: %s", err.message().c_str());
+
+		// We also run the callback in the error case, because other code
+		// might be waiting for it.
+		if (func)
+			func();
+	});
 }
 
 #endif
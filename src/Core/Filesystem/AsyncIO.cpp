@@ -0,0 +1,663 @@
+//@@COPYRIGHT@@
+
+// Current I/O class of each thread. The deadline is stored as a tick count so
+// that it can be a thread_local.
+static thread_local Filesystem::ioPriority_t currentPriority = Filesystem::IO_PRIORITY_NORMAL;
+static thread_local Filesystem::ioDeadline_t::rep currentDeadline = std::numeric_limits<Filesystem::ioDeadline_t::rep>::max();
+
+Filesystem::ioClass_t Filesystem::SetIOClass(const ioClass_t& cls)
+{
+	ioClass_t prev = GetIOClass();
+	currentPriority = cls.priority;
+	currentDeadline = cls.deadline.time_since_epoch().count();
+	return prev;
+}
+
+Filesystem::ioClass_t Filesystem::GetIOClass()
+{
+	return ioClass_t(currentPriority, ioDeadline_t(ioDeadline_t::duration(currentDeadline)));
+}
+
+#ifndef _WIN32
+
+#include <sys/uio.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+namespace Filesystem {
+namespace AsyncIO {
+
+// Number of threads executing requests when io_uring isn't available. Using
+// 2 threads allows the kernel to reorder operations.
+#define NUM_IO_THREADS 2
+
+// Number of entries in the io_uring submission queue, which is also the
+// maximum number of requests in flight at once
+#define URING_ENTRIES 256
+
+// Maximum number of prefetch requests in flight at once. With io_uring this
+// bounds the number of reads a critical request can be queued behind in the
+// device. The thread backend always keeps one thread free for other requests.
+#define MAX_PREFETCH_IN_FLIGHT 8
+
+// Limits on merging the ranges of a batch into a single read
+#define MAX_COALESCE_RANGES 64
+#define MAX_COALESCE_SIZE (1 << 20)
+
+// Batch of reads with a single completion callback
+struct batch_t: public UseMemPool<batch_t> {
+	// Number of requests which haven't completed yet
+	std::atomic<int> remaining;
+
+	// Total bytes read, and the first error which occured
+	std::atomic<size_t> bytes;
+	std::atomic<int> error;
+
+	threadpool::task *parent;
+	callback_t callback;
+};
+
+// Request descriptor, which is linked into a pending queue until it is
+// dispatched
+typedef intrusive::set_base_hook<intrusive::link_mode<intrusive::normal_link>> queueHook_t;
+struct request_t: public UseMemPool<request_t>, public queueHook_t {
+	bool write;
+	int fd;
+	fsOffset_t offset;
+
+	// Buffers to transfer, iov points to either inlineIov or iovs
+	struct iovec *iov;
+	int iovCount;
+	struct iovec inlineIov;
+	std::vector<struct iovec> iovs;
+
+	// Batch this request is part of, or NULL for a single request which
+	// completes its parent task directly
+	batch_t *batch;
+	threadpool::task *parent;
+	callback_t callback;
+
+	// Ranges of the batch covered by this request. If they overlap they are
+	// read into a bounce buffer and copied out.
+	std::vector<readRange_t> ranges;
+	char *bounce;
+
+	// Scheduling class, and the order the request was submitted in
+	ioPriority_t priority;
+	ioDeadline_t deadline;
+	uint64_t sequence;
+};
+
+// Requests of a class are ordered by deadline, then by submission order
+struct requestOrder_t {
+	bool operator()(const request_t &a, const request_t &b) const
+	{
+		return a.deadline < b.deadline || (a.deadline == b.deadline && a.sequence < b.sequence);
+	}
+};
+typedef intrusive::rbtree<request_t, intrusive::base_hook<queueHook_t>, intrusive::compare<requestOrder_t>, intrusive::constant_time_size<false>> requestQueue_t;
+
+// Requests waiting to be dispatched to the backend, and limits on those in
+// flight. Requests are only dispatched when the backend can start them, so
+// that the order is decided here rather than by the kernel.
+struct scheduler_t {
+	std::mutex lock;
+	requestQueue_t pending[NUM_IO_PRIORITIES];
+	uint64_t nextSequence;
+
+	unsigned inFlight;
+	unsigned prefetchInFlight;
+	unsigned maxInFlight;
+	unsigned maxPrefetch;
+
+	// Set when shutting down, the backend stops once nothing is left
+	bool stopping;
+};
+static scheduler_t sched;
+
+// Whether the backend is running, and whether it uses io_uring
+static bool initialized = false;
+static bool useUring = false;
+
+// Notify the parent task that a request has completed, running the callback
+// as its continuation
+static void Complete(threadpool::task *parent, callback_t&& callback, std::error_code err, size_t result)
+{
+	if (callback)
+		threadpool::child_finished(parent, std::bind(std::move(callback), err, result));
+	else
+		threadpool::child_finished(parent);
+}
+
+// Handle the completion of a request, and of its batch if this was the last
+// request of it
+static void Finish(request_t *req, std::error_code err, size_t result)
+{
+	batch_t *batch = req->batch;
+	if (!batch) {
+		Complete(req->parent, std::move(req->callback), err, result);
+		delete req;
+		return;
+	}
+
+	// Work out how much of each range was read, which is less than its
+	// length if the read ended early
+	size_t bytes = 0;
+	fsOffset_t end = req->offset + result;
+	for (const readRange_t &i: req->ranges) {
+		size_t length = i.offset >= end ? 0 : std::min<size_t>(i.length, end - i.offset);
+		if (req->bounce && length)
+			memcpy(i.buffer, req->bounce + (i.offset - req->offset), length);
+		bytes += length;
+	}
+	if (req->bounce)
+		MemFree(req->bounce);
+	delete req;
+
+	batch->bytes.fetch_add(bytes, std::memory_order_relaxed);
+	int expected = 0;
+	if (err)
+		batch->error.compare_exchange_strong(expected, err.value(), std::memory_order_relaxed);
+	if (batch->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+		int error = batch->error.load(std::memory_order_relaxed);
+		Complete(batch->parent, std::move(batch->callback), error ? std::error_code(error, std::system_category()) : std::error_code(), batch->bytes.load(std::memory_order_relaxed));
+		delete batch;
+	}
+}
+
+// Allocate a request for a single buffer
+static request_t *NewRequest(bool write, int fd, void *buffer, size_t length, fsOffset_t offset, const ioClass_t &cls)
+{
+	request_t *req = new request_t;
+	req->write = write;
+	req->fd = fd;
+	req->offset = offset;
+	req->inlineIov.iov_base = buffer;
+	req->inlineIov.iov_len = length;
+	req->iov = &req->inlineIov;
+	req->iovCount = 1;
+	req->batch = NULL;
+	req->parent = NULL;
+	req->bounce = NULL;
+	req->priority = cls.priority;
+	req->deadline = cls.deadline;
+	return req;
+}
+
+static void InitScheduler(unsigned maxInFlight, unsigned maxPrefetch)
+{
+	sched.nextSequence = 0;
+	sched.inFlight = 0;
+	sched.prefetchInFlight = 0;
+	sched.maxInFlight = maxInFlight;
+	sched.maxPrefetch = maxPrefetch;
+	sched.stopping = false;
+}
+
+// Add requests to the pending queues, the lock must be held
+static void Enqueue(request_t *const *reqs, size_t count)
+{
+	for (size_t i = 0; i < count; i++) {
+		reqs[i]->sequence = sched.nextSequence++;
+		sched.pending[reqs[i]->priority].insert_unique(*reqs[i]);
+	}
+}
+
+static bool NothingPending()
+{
+	for (requestQueue_t &i: sched.pending) {
+		if (!i.empty())
+			return false;
+	}
+	return true;
+}
+
+// Take the next request to dispatch, or NULL if none can be started yet. The
+// lock must be held.
+static request_t *Dequeue()
+{
+	if (sched.inFlight >= sched.maxInFlight || NothingPending())
+		return NULL;
+
+	// Requests which are past their deadline go first, even if their class
+	// is at its limit. Only the first request of each queue needs checking
+	// since they are sorted by deadline.
+	request_t *req = NULL;
+	ioDeadline_t now = std::chrono::steady_clock::now();
+	for (requestQueue_t &i: sched.pending) {
+		if (!i.empty() && i.begin()->deadline <= now) {
+			req = &*i.begin();
+			break;
+		}
+	}
+	for (int i = 0; !req && i < NUM_IO_PRIORITIES; i++) {
+		if (sched.pending[i].empty())
+			continue;
+		if (i == IO_PRIORITY_PREFETCH && sched.prefetchInFlight >= sched.maxPrefetch)
+			break;
+		req = &*sched.pending[i].begin();
+	}
+	if (!req)
+		return NULL;
+
+	sched.pending[req->priority].erase(sched.pending[req->priority].iterator_to(*req));
+	sched.inFlight++;
+	if (req->priority == IO_PRIORITY_PREFETCH)
+		sched.prefetchInFlight++;
+	return req;
+}
+
+// Account for dispatched requests which have completed, the lock must be held
+static void Retire(unsigned count, unsigned prefetchCount)
+{
+	sched.inFlight -= count;
+	sched.prefetchInFlight -= prefetchCount;
+}
+
+// Thread backend, which executes requests using blocking I/O
+static std::condition_variable threadQueueCond;
+static std::vector<std::thread> ioThreads;
+
+static void IOThread()
+{
+	std::unique_lock<std::mutex> locked(sched.lock);
+	while (true) {
+		request_t *req;
+		threadQueueCond.wait(locked, [&req] {
+			req = Dequeue();
+			return req || (sched.stopping && NothingPending());
+		});
+
+		// Only exit once all requests have been executed, and wake the
+		// other threads so that they exit too
+		if (!req) {
+			threadQueueCond.notify_all();
+			return;
+		}
+		bool prefetch = req->priority == IO_PRIORITY_PREFETCH;
+		locked.unlock();
+
+		ssize_t result;
+		if (req->write)
+			result = pwritev(req->fd, req->iov, req->iovCount, req->offset);
+		else
+			result = preadv(req->fd, req->iov, req->iovCount, req->offset);
+		if (result < 0)
+			Finish(req, std::error_code(errno, std::system_category()), 0);
+		else
+			Finish(req, std::error_code(), result);
+
+		locked.lock();
+		Retire(1, prefetch);
+	}
+}
+
+static void ThreadSubmit(request_t *const *reqs, size_t count)
+{
+	{
+		std::lock_guard<std::mutex> locked(sched.lock);
+		Enqueue(reqs, count);
+	}
+	if (count == 1)
+		threadQueueCond.notify_one();
+	else
+		threadQueueCond.notify_all();
+}
+
+#ifdef __linux__
+
+// io_uring backend. Requests are dispatched to the ring by the submitting
+// thread, or by the reaper thread once earlier requests have completed. The
+// reaper collects completions and hands the callbacks to the thread pool.
+struct ring_t {
+	int fd;
+
+	// Submission queue, the tail is shared with the kernel
+	std::atomic<unsigned> *sqTail;
+	unsigned sqMask;
+	unsigned sqEntries;
+	unsigned *sqArray;
+	io_uring_sqe *sqes;
+
+	// Completion queue, the head and tail are shared with the kernel
+	std::atomic<unsigned> *cqHead;
+	std::atomic<unsigned> *cqTail;
+	unsigned cqMask;
+	io_uring_cqe *cqes;
+
+	// Mappings of the rings
+	void *sqRing;
+	void *cqRing;
+	size_t sqRingSize;
+	size_t cqRingSize;
+	size_t sqesSize;
+
+	std::thread reaper;
+};
+static ring_t ring;
+
+static inline int UringSetup(unsigned entries, io_uring_params *params)
+{
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+static inline int UringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+// Get a pointer into one of the ring mappings
+template<typename T> static inline T *RingPtr(void *base, uint32_t offset)
+{
+	return reinterpret_cast<T *>(static_cast<char *>(base) + offset);
+}
+
+static void UringUnmap()
+{
+	if (ring.sqes && ring.sqes != MAP_FAILED)
+		munmap(ring.sqes, ring.sqesSize);
+	if (ring.cqRing && ring.cqRing != MAP_FAILED && ring.cqRing != ring.sqRing)
+		munmap(ring.cqRing, ring.cqRingSize);
+	if (ring.sqRing && ring.sqRing != MAP_FAILED)
+		munmap(ring.sqRing, ring.sqRingSize);
+	close(ring.fd);
+	ring.sqes = NULL;
+	ring.sqRing = ring.cqRing = NULL;
+}
+
+// Queue an entry in the submission queue, returns it
+static io_uring_sqe *UringQueue(unsigned queued)
+{
+	unsigned index = (ring.sqTail->load(std::memory_order_relaxed) + queued) & ring.sqMask;
+	io_uring_sqe *sqe = &ring.sqes[index];
+	memset(sqe, 0, sizeof(io_uring_sqe));
+	ring.sqArray[index] = index;
+	return sqe;
+}
+
+// Submit queued entries to the kernel
+static void UringEnterQueued(unsigned queued)
+{
+	unsigned tail = ring.sqTail->load(std::memory_order_relaxed);
+	ring.sqTail->store(tail + queued, std::memory_order_release);
+	while (queued) {
+		int submitted = UringEnter(ring.fd, queued, 0, 0);
+		if (submitted >= 0)
+			queued -= submitted;
+		else if (errno != EINTR && errno != EAGAIN)
+			Error("Failed to submit asynchronous I/O: %s", strerror(errno));
+	}
+}
+
+// Dispatch as many pending requests as the limits allow, with a single system
+// call. The kernel consumes all entries during io_uring_enter, and there are
+// never more requests in flight than entries, so all entries up to that limit
+// are free here. The scheduler lock must be held.
+static void UringDispatch()
+{
+	unsigned queued = 0;
+	while (request_t *req = Dequeue()) {
+		io_uring_sqe *sqe = UringQueue(queued++);
+		sqe->opcode = req->write ? IORING_OP_WRITEV : IORING_OP_READV;
+		sqe->fd = req->fd;
+		sqe->addr = reinterpret_cast<uintptr_t>(req->iov);
+		sqe->len = req->iovCount;
+		sqe->off = req->offset;
+		sqe->user_data = reinterpret_cast<uintptr_t>(req);
+	}
+	if (queued)
+		UringEnterQueued(queued);
+}
+
+static void UringSubmit(request_t *const *reqs, size_t count)
+{
+	std::lock_guard<std::mutex> locked(sched.lock);
+	Enqueue(reqs, count);
+	UringDispatch();
+}
+
+static void ReaperThread()
+{
+	while (true) {
+		if (UringEnter(ring.fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+			Error("Failed to wait for asynchronous I/O: %s", strerror(errno));
+
+		// Handle all available completions. The wakeup request sent on
+		// shutdown has no request attached.
+		unsigned completed = 0;
+		unsigned prefetchCompleted = 0;
+		unsigned head = ring.cqHead->load(std::memory_order_relaxed);
+		unsigned tail = ring.cqTail->load(std::memory_order_acquire);
+		for (; head != tail; head++) {
+			io_uring_cqe *cqe = &ring.cqes[head & ring.cqMask];
+			request_t *req = reinterpret_cast<request_t *>(static_cast<uintptr_t>(cqe->user_data));
+			int result = cqe->res;
+			if (!req)
+				continue;
+			completed++;
+			if (req->priority == IO_PRIORITY_PREFETCH)
+				prefetchCompleted++;
+			if (result < 0)
+				Finish(req, std::error_code(-result, std::system_category()), 0);
+			else
+				Finish(req, std::error_code(), result);
+		}
+		ring.cqHead->store(head, std::memory_order_release);
+
+		// Fill the slots which were freed, and exit once everything has
+		// completed after a shutdown
+		std::lock_guard<std::mutex> locked(sched.lock);
+		Retire(completed, prefetchCompleted);
+		UringDispatch();
+		if (sched.stopping && !sched.inFlight && NothingPending())
+			return;
+	}
+}
+
+static bool UringInit()
+{
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	ring.fd = UringSetup(URING_ENTRIES, &params);
+	if (ring.fd < 0)
+		return false;
+
+	// Map the rings, which may share a single mapping
+	ring.sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring.cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	ring.sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+	bool singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+	if (singleMap)
+		ring.sqRingSize = ring.cqRingSize = std::max(ring.sqRingSize, ring.cqRingSize);
+	ring.sqRing = mmap(NULL, ring.sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+	if (singleMap)
+		ring.cqRing = ring.sqRing;
+	else
+		ring.cqRing = mmap(NULL, ring.cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+	ring.sqes = static_cast<io_uring_sqe *>(mmap(NULL, ring.sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES));
+	if (ring.sqRing == MAP_FAILED || ring.cqRing == MAP_FAILED || ring.sqes == MAP_FAILED) {
+		UringUnmap();
+		return false;
+	}
+
+	ring.sqTail = RingPtr<std::atomic<unsigned>>(ring.sqRing, params.sq_off.tail);
+	ring.sqMask = *RingPtr<unsigned>(ring.sqRing, params.sq_off.ring_mask);
+	ring.sqEntries = params.sq_entries;
+	ring.sqArray = RingPtr<unsigned>(ring.sqRing, params.sq_off.array);
+	ring.cqHead = RingPtr<std::atomic<unsigned>>(ring.cqRing, params.cq_off.head);
+	ring.cqTail = RingPtr<std::atomic<unsigned>>(ring.cqRing, params.cq_off.tail);
+	ring.cqMask = *RingPtr<unsigned>(ring.cqRing, params.cq_off.ring_mask);
+	ring.cqes = RingPtr<io_uring_cqe>(ring.cqRing, params.cq_off.cqes);
+
+	InitScheduler(ring.sqEntries, MAX_PREFETCH_IN_FLIGHT);
+	ring.reaper = std::thread(ReaperThread);
+	return true;
+}
+
+static void UringShutdown()
+{
+	// Wake up the reaper so that it sees the flag even if nothing is in
+	// flight. The completion queue has room for more entries than the
+	// submission queue, so this can't overflow it.
+	{
+		std::lock_guard<std::mutex> locked(sched.lock);
+		sched.stopping = true;
+		UringQueue(0)->opcode = IORING_OP_NOP;
+		UringEnterQueued(1);
+	}
+	ring.reaper.join();
+	UringUnmap();
+}
+
+#endif
+
+bool Init(bool allowUring)
+{
+	Assert(!initialized);
+	initialized = true;
+
+#ifdef __linux__
+	useUring = allowUring && UringInit();
+	if (useUring)
+		return true;
+#else
+	static_cast<void>(allowUring);
+#endif
+
+	InitScheduler(NUM_IO_THREADS, NUM_IO_THREADS - 1);
+	for (int i = 0; i < NUM_IO_THREADS; i++)
+		ioThreads.emplace_back(IOThread);
+	return false;
+}
+
+void Shutdown()
+{
+	if (!initialized)
+		return;
+	initialized = false;
+
+#ifdef __linux__
+	if (useUring) {
+		UringShutdown();
+		return;
+	}
+#endif
+
+	{
+		std::lock_guard<std::mutex> locked(sched.lock);
+		sched.stopping = true;
+	}
+	threadQueueCond.notify_all();
+	for (std::thread &i: ioThreads)
+		i.join();
+	ioThreads.clear();
+}
+
+bool UsingUring()
+{
+	return useUring;
+}
+
+static void Submit(request_t *const *reqs, size_t count)
+{
+#ifdef __linux__
+	if (useUring) {
+		UringSubmit(reqs, count);
+		return;
+	}
+#endif
+	ThreadSubmit(reqs, count);
+}
+
+void Read(int fd, void *buffer, size_t length, fsOffset_t offset, callback_t&& callback, const ioClass_t &cls)
+{
+	Assert(initialized);
+	MemTagScope scope(MEMTAG_FILESYSTEM);
+	request_t *req = NewRequest(false, fd, buffer, length, offset, cls);
+	req->parent = threadpool::add_child();
+	req->callback = std::move(callback);
+	Submit(&req, 1);
+}
+
+void Write(int fd, const void *data, size_t length, fsOffset_t offset, callback_t&& callback, const ioClass_t &cls)
+{
+	Assert(initialized);
+	MemTagScope scope(MEMTAG_FILESYSTEM);
+	request_t *req = NewRequest(true, fd, const_cast<void *>(data), length, offset, cls);
+	req->parent = threadpool::add_child();
+	req->callback = std::move(callback);
+	Submit(&req, 1);
+}
+
+void ReadBatch(int fd, const readRange_t *ranges, size_t count, callback_t&& callback, const ioClass_t &cls)
+{
+	Assert(initialized);
+	MemTagScope scope(MEMTAG_FILESYSTEM);
+	threadpool::task *parent = threadpool::add_child();
+	if (!count) {
+		Complete(parent, std::move(callback), std::error_code(), 0);
+		return;
+	}
+
+	// Sort the ranges by offset, and merge those which are adjacent or
+	// overlapping into a single request
+	std::vector<readRange_t> sorted(ranges, ranges + count);
+	std::stable_sort(sorted.begin(), sorted.end(), [](const readRange_t &a, const readRange_t &b) {
+		return a.offset < b.offset;
+	});
+	std::vector<request_t *> reqs;
+	batch_t *batch = new batch_t;
+	for (size_t i = 0; i < count;) {
+		fsOffset_t start = sorted[i].offset;
+		fsOffset_t end = start + sorted[i].length;
+		bool overlap = false;
+		size_t j = i + 1;
+		for (; j < count && j - i < MAX_COALESCE_RANGES && sorted[j].offset <= end; j++) {
+			fsOffset_t rangeEnd = sorted[j].offset + sorted[j].length;
+			if (rangeEnd - start > MAX_COALESCE_SIZE && rangeEnd > end)
+				break;
+			if (sorted[j].offset < end)
+				overlap = true;
+			end = std::max(end, rangeEnd);
+		}
+
+		request_t *req;
+		if (overlap) {
+			// Read into a bounce buffer, since iovecs can't overlap. It is
+			// page aligned so that it can be used with O_DIRECT.
+			req = NewRequest(false, fd, NULL, end - start, start, cls);
+			req->bounce = static_cast<char *>(MemAllocAligned(end - start, 4096));
+			req->inlineIov.iov_base = req->bounce;
+		} else if (j - i == 1)
+			req = NewRequest(false, fd, sorted[i].buffer, sorted[i].length, start, cls);
+		else {
+			// Scatter the read directly into the buffers
+			req = NewRequest(false, fd, NULL, 0, start, cls);
+			for (size_t k = i; k < j; k++) {
+				struct iovec iov;
+				iov.iov_base = sorted[k].buffer;
+				iov.iov_len = sorted[k].length;
+				req->iovs.push_back(iov);
+			}
+			req->iov = req->iovs.data();
+			req->iovCount = req->iovs.size();
+		}
+		req->batch = batch;
+		req->ranges.assign(sorted.begin() + i, sorted.begin() + j);
+		reqs.push_back(req);
+		i = j;
+	}
+
+	batch->remaining.store(reqs.size(), std::memory_order_relaxed);
+	batch->bytes.store(0, std::memory_order_relaxed);
+	batch->error.store(0, std::memory_order_relaxed);
+	batch->parent = parent;
+	batch->callback = std::move(callback);
+	Submit(reqs.data(), reqs.size());
+}
+
+}
+}
+
+#endif
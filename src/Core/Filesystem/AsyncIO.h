@@ -0,0 +1,44 @@
+//@@COPYRIGHT@@
+
+// Asynchronous I/O on file descriptors, used to implement File::AsyncRead and
+// File::AsyncWrite on POSIX systems. On Linux requests are submitted to an
+// io_uring, which keeps many of them in flight at once. When io_uring isn't
+// available they are executed with blocking I/O by a few threads instead.
+// Either way requests wait in a queue until they are dispatched, in order of
+// priority class and deadline.
+
+#ifndef _WIN32
+
+namespace Filesystem {
+namespace AsyncIO {
+
+// Completion callback, given the error and the number of bytes transferred
+typedef std::function<void(std::error_code, size_t)> callback_t;
+
+// Start the I/O backend, using io_uring if allowed and supported by the
+// kernel. Returns whether io_uring is being used.
+EXPORT bool Init(bool allowUring = true);
+
+// Wait for all pending requests to complete and stop the backend
+EXPORT void Shutdown();
+
+// Check whether requests are submitted to io_uring
+EXPORT bool UsingUring();
+
+// Submit a read or write at the given offset of a file descriptor. This acts
+// as a child of the current task in the thread pool, and the callback is run
+// as a task once the operation has completed. The buffer must remain valid
+// until then. By default the current I/O class of the thread is used.
+EXPORT void Read(int fd, void *buffer, size_t length, fsOffset_t offset, callback_t&& callback, const ioClass_t &cls = GetIOClass());
+EXPORT void Write(int fd, const void *data, size_t length, fsOffset_t offset, callback_t&& callback, const ioClass_t &cls = GetIOClass());
+
+// Submit a batch of reads with a single callback, which is given the first
+// error and the total number of bytes read into all of the ranges. Ranges
+// which are adjacent or overlapping are merged into a single read, and all
+// of the reads are submitted at once.
+EXPORT void ReadBatch(int fd, const readRange_t *ranges, size_t count, callback_t&& callback, const ioClass_t &cls = GetIOClass());
+
+}
+}
+
+#endif
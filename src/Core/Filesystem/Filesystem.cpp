@@ -98,21 +98,28 @@ const char *Filesystem::GetError()
 void Filesystem::Shutdown()
 {
 	AsyncShutdown();
+	std::lock_guard<thread::adaptive_shared_mutex> locked(pathListLock);
 	pathList.clear_and_dispose(DeleteFunctor<FSPath>());
 }
 
 void Filesystem::AddPath(const char *path)
 {
+	MemTagScope scope(MEMTAG_FILESYSTEM);
+	std::lock_guard<thread::adaptive_shared_mutex> locked(pathListLock);
 	pathList.push_front(*new FSPath(path));
 }
 
 File *Filesystem::OpenFile(const char *path, fsMode_t mode, bool fullPath)
 {
+	// File objects and their buffers are charged to the filesystem
+	MemTagScope scope(MEMTAG_FILESYSTEM);
+
 	if (fullPath) {
 		// Just open the given path directly
 		return OSFile::Open(path, mode);
 	} else if (mode == FS_READ) {
 		// Loop through every search path, and try opening the file on each
+		thread::shared_lock_guard<thread::adaptive_shared_mutex> locked(pathListLock);
 		foreach (FSPath &p, pathList) {
 			File *f = p.OpenFile(path, mode);
 			if (f)
@@ -122,6 +129,7 @@ File *Filesystem::OpenFile(const char *path, fsMode_t mode, bool fullPath)
 		return NULL;
 	} else {
 		// Open it on the write path
+		thread::shared_lock_guard<thread::adaptive_shared_mutex> locked(pathListLock);
 		return writePath.OpenFile(path, mode);
 	}
 }
@@ -133,6 +141,7 @@ bool FileExists(const char *path, bool fullPath)
 		return OSFileExists(path);
 	} else {
 		// Loop through every search path, and try looking for the file on each
+		thread::shared_lock_guard<thread::adaptive_shared_mutex> locked(pathListLock);
 		foreach (FSPath &p, pathList) {
 			if (p.FileExists(path))
 				return true;
@@ -178,7 +187,10 @@ bool Filesystem::MoveFile(const char *from, const char *to, bool fullPath)
 	char buffer[MAX_PATH];
 	char buffer2[MAX_PATH];
 	if (!fullPath) {
-		strlcpy(buffer, writePath.path, MAX_PATH);
+		{
+			thread::shared_lock_guard<thread::adaptive_shared_mutex> locked(pathListLock);
+			strlcpy(buffer, writePath.path, MAX_PATH);
+		}
 		strlcat(buffer, from, MAX_PATH);
 		from = buffer;
 
@@ -211,7 +223,10 @@ bool Filesystem::RemoveFile(const char *path, bool fullPath)
 	// Get the full path
 	char buffer[MAX_PATH];
 	if (!fullPath) {
-		strlcpy(buffer, writePath.path, MAX_PATH);
+		{
+			thread::shared_lock_guard<thread::adaptive_shared_mutex> locked(pathListLock);
+			strlcpy(buffer, writePath.path, MAX_PATH);
+		}
 		strlcat(buffer, path, MAX_PATH);
 		path = buffer;
 	}
@@ -230,7 +245,10 @@ void Filesystem::CreatePath(const char *path, bool fullPath)
 
 	// Get the full path
 	if (!fullPath) {
-		strlcpy(buffer, writePath.path, sizeof(buffer));
+		{
+			thread::shared_lock_guard<thread::adaptive_shared_mutex> locked(pathListLock);
+			strlcpy(buffer, writePath.path, sizeof(buffer));
+		}
 		strlcat(buffer, path, sizeof(buffer));
 	} else
 		strlcpy(buffer, path, sizeof(buffer));
@@ -258,12 +276,15 @@ void Filesystem::CreatePath(const char *path, bool fullPath)
 
 void Filesystem::ListFiles(StringList &fileList, const char *path, const char *extension, fsSearch_t searchType, bool fullPath)
 {
+	MemTagScope scope(MEMTAG_FILESYSTEM);
+
 	// Allow NULL extension
 	if (!extension)
 		extension = "";
 
 	// Loop through every search path, and list files in each
 	if (!fullPath) {
+		thread::shared_lock_guard<thread::adaptive_shared_mutex> locked(pathListLock);
 		foreach (FSPath &p, pathList)
 			p.ListFiles(path, extension, searchType, fileList);
 	} else
@@ -305,6 +326,7 @@ static void AsyncReadFileCallback(File *file, const tr1::function<void(void *, i
 
 bool Filesystem::AsyncReadFile(const char *path, bool nulTerminate, const tr1::function<void(void *, int)> &callback, bool fullPath)
 {
+	MemTagScope scope(MEMTAG_FILESYSTEM);
 	File *file = Filesystem::OpenFile(path, FS_READ, fullPath);
 	if (!file)
 		return false;
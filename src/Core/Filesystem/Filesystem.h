@@ -7,6 +7,64 @@ namespace Filesystem {
 // File offset type. Using 64bit to allow large files.
 typedef int64_t fsOffset_t;
 
+// Range of a file to read into a buffer, for scatter reads
+struct readRange_t {
+	void* buffer;
+	size_t length;
+	fsOffset_t offset;
+};
+
+// Priority classes of asynchronous requests, in the order they are dispatched.
+// Critical requests hold up the game until they complete, normal requests are
+// needed soon, and prefetch requests load data which may be needed later.
+// Only a few prefetch requests are in flight at once, so that a flood of them
+// can't delay more urgent requests by much.
+enum ioPriority_t {
+	IO_PRIORITY_CRITICAL,
+	IO_PRIORITY_NORMAL,
+	IO_PRIORITY_PREFETCH,
+	NUM_IO_PRIORITIES
+};
+
+// Time by which an asynchronous request should complete. Requests of the same
+// class are dispatched in order of deadline, and those without one come last.
+// A request whose deadline has passed is dispatched before all others.
+typedef std::chrono::steady_clock::time_point ioDeadline_t;
+
+// Scheduling class of an asynchronous request
+struct ioClass_t {
+	ioPriority_t priority;
+	ioDeadline_t deadline;
+
+	ioClass_t(ioPriority_t priority = IO_PRIORITY_NORMAL, ioDeadline_t deadline = ioDeadline_t::max())
+		: priority(priority), deadline(deadline) {}
+
+	// Deadline relative to the current time
+	template<typename Rep, typename Period>
+	ioClass_t(ioPriority_t priority, std::chrono::duration<Rep, Period> timeout)
+		: priority(priority), deadline(std::chrono::steady_clock::now() + timeout) {}
+};
+
+// Set the class of asynchronous requests submitted by this thread, returns the
+// previous one. The default class is normal priority with no deadline.
+EXPORT ioClass_t SetIOClass(const ioClass_t& cls);
+EXPORT ioClass_t GetIOClass();
+
+// Set the class of asynchronous requests submitted by this thread until the
+// end of the scope
+class IOClassScope: boost::noncopyable {
+public:
+	explicit IOClassScope(const ioClass_t& cls)
+		: prev(SetIOClass(cls)) {}
+	~IOClassScope()
+	{
+		SetIOClass(prev);
+	}
+
+private:
+	ioClass_t prev;
+};
+
 // Generic file interface, all operations are unbuffered (direct to OS, not direct to disk)
 // Access from multiple threads is safe since there is no current file position
 class File: boost::noncopyable {
@@ -40,6 +98,7 @@ public:
 	// Asynchronous versions of the above functions. These act as a child of the current task
 	// in the context of the thread pool, and can be waited on the same way as a normal task.
 	// For writes, the input data must remain available for the entire duration of the write
+	// Requests are scheduled using the current I/O class of the thread
 	virtual void AsyncRead(void* buffer, size_t length, fsOffset_t pos, std::function<void(std::error_code, size_t)>&& callback) = 0;
 	virtual void AsyncWrite(const void* data, size_t length, fsOffset_t pos, std::function<void(std::error_code, size_t)>&& callback) = 0;
 
@@ -65,6 +124,73 @@ public:
 		AsyncWrite(data, length, pos, std::bind(std::forward<T>(obj), std::forward<Args>(args)...));
 	}
 
+	// Read several ranges of the file with a single callback, which is given
+	// the first error and the total number of bytes read. Implementations
+	// merge adjacent and overlapping ranges into larger reads, and submit them
+	// as a batch. By default each range is read separately.
+	virtual void AsyncReadv(const readRange_t* ranges, size_t count, std::function<void(std::error_code, size_t)>&& callback)
+	{
+		struct state_t {
+			std::atomic<size_t> remaining;
+			std::atomic<size_t> bytes;
+			std::atomic<int> error;
+			std::function<void(std::error_code, size_t)> callback;
+		};
+		if (!count) {
+			threadpool::child_finished(threadpool::add_child(), std::move(callback), std::error_code(), 0);
+			return;
+		}
+		std::shared_ptr<state_t> state = std::make_shared<state_t>();
+		state->remaining = count;
+		state->bytes = 0;
+		state->error = 0;
+		state->callback = std::move(callback);
+		for (size_t i = 0; i < count; i++) {
+			AsyncRead(ranges[i].buffer, ranges[i].length, ranges[i].offset, std::function<void(std::error_code, size_t)>([state](std::error_code err, size_t bytes) {
+				int expected = 0;
+				if (err)
+					state->error.compare_exchange_strong(expected, err.value());
+				state->bytes += bytes;
+				if (--state->remaining == 0) {
+					int error = state->error.load();
+					state->callback(error ? std::error_code(error, std::system_category()) : std::error_code(), state->bytes.load());
+				}
+			}));
+		}
+	}
+
+	// Same as the above, but accepting any function type for the callback
+	template<typename T>
+	inline void AsyncReadv(const readRange_t* ranges, size_t count, T&& obj)
+	{
+		AsyncReadv(ranges, count, std::function<void(std::error_code, size_t)>(std::forward<T>(obj)));
+	}
+	template<typename T>
+	inline void AsyncReadv(const std::vector<readRange_t>& ranges, T&& obj)
+	{
+		AsyncReadv(ranges.data(), ranges.size(), std::function<void(std::error_code, size_t)>(std::forward<T>(obj)));
+	}
+
+	// Same as the above, but using the given I/O class for this request
+	template<typename... Args>
+	inline void AsyncRead(const ioClass_t& cls, Args&&... args)
+	{
+		IOClassScope scope(cls);
+		AsyncRead(std::forward<Args>(args)...);
+	}
+	template<typename... Args>
+	inline void AsyncWrite(const ioClass_t& cls, Args&&... args)
+	{
+		IOClassScope scope(cls);
+		AsyncWrite(std::forward<Args>(args)...);
+	}
+	template<typename... Args>
+	inline void AsyncReadv(const ioClass_t& cls, Args&&... args)
+	{
+		IOClassScope scope(cls);
+		AsyncReadv(std::forward<Args>(args)...);
+	}
+
 	// Map a part of the file in memory. Returns NULL on error.
 	virtual void* MemMapRead(fsOffset_t offset, size_t length) = 0; // Read-only
 	virtual void* MemMapCopy(fsOffset_t offset, size_t length) = 0; // Changes not written back on unmap
@@ -594,6 +720,7 @@ inline void AsyncReadFile(const char *path, T&& callback, Args&&... args)
 	}
 
 	// String buffer containing result
+	MemTagScope scope(MEMTAG_FILESYSTEM);
 	std::shared_ptr<std::string> result = std::make_shared<std::string>();
 	size_t length = file->Length();
 	result->resize(length);
@@ -6,9 +6,7 @@ class FSPath: public SList<FSPath>::Hook {
 public:
 	// Constructor
 	FSPath(const char *pathName)
-	{
-		strlcpy(path, pathName, sizeof(path));
-	}
+		: path(StringTable::Intern(pathName)) {}
 
 	// Open a file under this path
 	File *OpenFile(const char *file, fsMode_t mode)
@@ -40,12 +38,17 @@ public:
 		ListOSFiles(fullPath, extension, searchType, fileList);
 	}
 
-	// Actual search path, without trailing slash
-	char path[MAX_PATH];
+	// Actual search path, without trailing slash. This is interned, so paths
+	// can be compared by pointer.
+	const char *path;
 };
 
 // Linked list of search paths for reading.
 static SList<FSPath> pathList;
 
+// Lock protecting pathList. The list is read on every file access but only
+// modified when paths are added, so use a reader/writer lock.
+static thread::adaptive_shared_mutex pathListLock;
+
 // Path to which all writes are done. This is always the last path added.
 #define writePath pathList.front()
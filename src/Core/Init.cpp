@@ -99,6 +99,8 @@ static void RealMain()
 
 	// Initialize the command system
 	Cmd::Init();
+	thread::lock_profile_init();
+	Memory::InitCommands();
 
 	// Initialize the console system
 	Log::EarlyInit();
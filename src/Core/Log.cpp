@@ -2,7 +2,7 @@
 
 // Log buffer and buffer insertion point
 #define LOGBUF_SIZE 65536
-static Mutex logMutex;
+static thread::profiled_lock<std::mutex> logMutex{"logMutex"};
 static char logBuf[LOGBUF_SIZE] = "";
 static char *insert = logBuf;
 
@@ -42,7 +42,7 @@ static void LogHandler(printLevel_t level, const char *msg)
 	buffer[len] = '\0';
 
 	// Add the message to the log buffer
-	logMutex.Lock();
+	logMutex.lock();
 	if (insert + len >= logBuf + sizeof(logBuf)) {
 		memmove(logBuf, logBuf + sizeof(logBuf) / 2, sizeof(logBuf) / 2);
 		memset(logBuf + sizeof(logBuf) / 2, 0, sizeof(logBuf) / 2);
@@ -61,13 +61,13 @@ static void LogHandler(printLevel_t level, const char *msg)
 	if (crashLogFile)
 		crashLogFile->Write(buffer, len);
 	else if (level == PRINT_ERROR) {
-		logMutex.Unlock();
+		logMutex.unlock();
 		crashLogFile = Filesystem::OpenFile("crashlog.txt", FS_WRITE);
-		logMutex.Lock();
+		logMutex.lock();
 		if (crashLogFile)
 			crashLogFile->Write(logBuf, insert - logBuf);
 	}
-	logMutex.Unlock();
+	logMutex.unlock();
 }
 
 void Log::EarlyInit()
@@ -78,6 +78,7 @@ void Log::EarlyInit()
 
 void Log::Init()
 {
+	MemTagScope scope(MEMTAG_CONSOLE);
 	const char *filename;
 
 	// Open the log file and write anything that was printed before
@@ -87,9 +88,9 @@ void Log::Init()
 			Warning("Couldn't open log file %s for writing", filename);
 			return;
 		}
-		logMutex.Lock();
+		logMutex.lock();
 		logFile->Write(logBuf, insert - logBuf);
-		logMutex.Unlock();
+		logMutex.unlock();
 	}
 }
 
@@ -105,11 +106,11 @@ void Log::Shutdown()
 
 const char *Log::GetBuffer()
 {
-	logMutex.Lock();
+	logMutex.lock();
 	return logBuf;
 }
 
 void Log::ReleaseBuffer()
 {
-	logMutex.Unlock();
+	logMutex.unlock();
 }
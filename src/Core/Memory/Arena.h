@@ -1,19 +1,39 @@
 //@@COPYRIGHT@@
 
 // Fast allocators that can't free individual allocations. All allocations can
-// be freed at once though.
+// be freed at once though, or rewound to an earlier point.
 
 // Default alignment for allocations
 #define DEFAULT_MEMORY_ALIGNMENT 16
 
 // Arena allocator that allocates from a fixed block of memory. It will allocate
-// extra memory blocks dynamically if the initial block becomes full.
-template<size_t blockSize> class MemArena {
+// extra memory blocks dynamically if the initial block becomes full. Blocks
+// are kept in the order they were used, and the blocks after the current one
+// are unused blocks which were retained by Reset or Rewind.
+template<size_t blockSize> class MemArena: boost::noncopyable {
+private:
+	// Header at the begining of each block
+	struct blockHeader_t: public intrusive::slist_base_hook<intrusive::link_mode<intrusive::normal_link>> {
+		size_t size;
+		char data[0];
+	};
+	typedef intrusive::slist<blockHeader_t, intrusive::constant_time_size<false>> blockList_t;
+
 public:
-	// Constructor
-	MemArena()
+	// Position in the arena which can be returned to with Rewind
+	struct mark_t {
+		blockHeader_t *block;
+		char *offset;
+	};
+
+	// Constructor. Blocks are allocated with the given memory tag, which
+	// defaults to the current tag when the arena is created.
+	explicit MemArena(memTag_t tag = MemTag::GetCurrent())
+		: tag(tag)
 	{
+		internal_block.size = blockSize;
 		blockList.push_front(internal_block);
+		current = blockList.begin();
 		offset = internal_block.data;
 	}
 
@@ -29,10 +49,9 @@ public:
 		// Align the offset
 		offset = reinterpret_cast<char *>(PAD(reinterpret_cast<intptr_t>(offset), alignment));
 
-		// If the current block is full, get a new one.
-		blockHeader_t *block = &blockList.front();
-		if (offset + size > reinterpret_cast<char *>(block) + blockSize)
-			block = NewBlock(size, alignment);
+		// If the current block is full, move on to the next one
+		if (offset + size > reinterpret_cast<char *>(&*current) + current->size)
+			NextBlock(size, alignment);
 
 		// Increment offset and return
 		void *ptr = offset;
@@ -43,68 +62,139 @@ public:
 	// Copy a string
 	__malloc const char *CopyString(const char *string)
 	{
-		char *newString = Alloc(strlen(string) + 1, 1);
+		char *newString = static_cast<char *>(Alloc(strlen(string) + 1, 1));
 		strcpy(newString, string);
 		return newString;
 	}
 
-	// Free all allocated memory
+	// Get the current position in the arena
+	mark_t GetMark() const
+	{
+		return {&*current, offset};
+	}
+
+	// Free everything allocated since a mark was taken. The blocks used after
+	// the mark are kept for later allocations.
+	void Rewind(const mark_t &mark)
+	{
+		current = blockList.iterator_to(*mark.block);
+		offset = mark.offset;
+	}
+
+	// Free all allocated memory, but keep the blocks for later allocations
+	void Reset()
+	{
+		current = blockList.begin();
+		offset = internal_block.data;
+	}
+
+	// Free all allocated memory and release all extra blocks
 	void FreeAll()
 	{
-		while (boost::next(blockList.begin()) != blockList.end())
-			blockList.pop_front_and_dispose(MemFree);
-		offset = blockList.front().data;
+		while (std::next(blockList.begin()) != blockList.end())
+			blockList.erase_after_and_dispose(blockList.begin(), [](blockHeader_t *block) {MemFree(block);});
+		Reset();
 	}
 
-private:
-	// Header at the begining of each block
-	struct blockHeader_t: public SList<blockHeader_t>::Hook {
-		size_t size;
-		char data[0];
-	};
+	// Change the memory tag used for new blocks
+	void SetTag(memTag_t newTag)
+	{
+		tag = newTag;
+	}
 
+private:
 	// Internal block
 	struct: public blockHeader_t {
 		char data[blockSize - sizeof(blockHeader_t)];
 	} internal_block;
 
 	// Make sure blockSize is reasonable
-	StaticAssert(blockSize > sizeof(blockHeader_t));
+	static_assert(blockSize > sizeof(blockHeader_t), "Arena block size is too small");
 
-	// Linked list of blocks
-	SList<blockHeader_t> blockList;
+	// List of blocks, and the block currently being allocated from
+	blockList_t blockList;
+	typename blockList_t::iterator current;
 
 	// Allocation offset in the current block
 	char *offset;
 
-	// Allocate a new block, which needs to be big enough to include the new
-	// element.
-	blockHeader_t *NewBlock(size_t size, size_t alignment)
+	// Memory tag for extra blocks
+	memTag_t tag;
+
+	// Switch to the next block, which needs to be big enough to include the
+	// new element. A retained block is used if it is big enough, otherwise a
+	// new one is allocated.
+	void NextBlock(size_t size, size_t alignment)
 	{
 		// Calculate the block size
 		size_t newSize = std::max(blockSize, size + PAD(sizeof(blockHeader_t), alignment));
 
-		// Get a new block
-		blockHeader_t *newBlock = static_cast<blockHeader_t *>(MemAlloc(newSize));
-
-		// Update block list. We want to continue using the old block if we
-		// allocated a block for a large item.
-		if (newSize == blockSize || blockList.empty())
-			blockList.push_front(*newBlock);
-		else
-			blockList.insert_after(blockList.begin(), *newBlock);
+		auto next = std::next(current);
+		if (next == blockList.end() || next->size < newSize) {
+			MemTagScope scope(tag);
+			blockHeader_t *newBlock = static_cast<blockHeader_t *>(MemAlloc(newSize));
+			newBlock->size = newSize;
+			next = blockList.insert_after(current, *newBlock);
+		}
+		current = next;
 
 		// Align the offset
-		offset = reinterpret_cast<char *>(PAD(reinterpret_cast<intptr_t>(newBlock->data), alignment));
+		offset = reinterpret_cast<char *>(PAD(reinterpret_cast<intptr_t>(current->data), alignment));
+	}
+};
 
-		return newBlock;
+// Set of arenas used in rotation for data which lives for a fixed number of
+// frames. BeginFrame resets the oldest arena and makes it the current one, so
+// memory allocated in a frame stays valid for numFrames frames.
+template<size_t blockSize, int numFrames = 2> class MemFrameArena: boost::noncopyable {
+public:
+	// Constructor. All frames allocate their blocks with the given memory tag.
+	explicit MemFrameArena(memTag_t tag = MemTag::GetCurrent())
+		: frame(0)
+	{
+		for (MemArena<blockSize> &i: arenas)
+			i.SetTag(tag);
+	}
+
+	// Start a new frame, freeing the memory of the oldest frame
+	void BeginFrame()
+	{
+		frame = (frame + 1) % numFrames;
+		arenas[frame].Reset();
+	}
+
+	// Allocate an object in the current frame. Alignment must be a power of 2.
+	__malloc void *Alloc(size_t size, size_t alignment = DEFAULT_MEMORY_ALIGNMENT)
+	{
+		return arenas[frame].Alloc(size, alignment);
+	}
+
+	// Copy a string
+	__malloc const char *CopyString(const char *string)
+	{
+		return arenas[frame].CopyString(string);
+	}
+
+	// Get the arena for the current frame, or for an earlier frame which is
+	// still alive
+	MemArena<blockSize> &GetArena(int age = 0)
+	{
+		Assert((age >= 0 && age < numFrames));
+		return arenas[(frame + numFrames - age) % numFrames];
 	}
+
+private:
+	MemArena<blockSize> arenas[numFrames];
+	int frame;
 };
 
 // Arena allocator that allocates from a fixed block of memory. It will return
 // NULL if the block becomes full.
-template<size_t blockSize> class MemArenaFixed {
+template<size_t blockSize> class MemArenaFixed: boost::noncopyable {
 public:
+	// Position in the arena which can be returned to with Rewind
+	typedef char *mark_t;
+
 	// Constructor
 	MemArenaFixed()
 	{
@@ -130,46 +220,207 @@ public:
 	// Copy a string
 	__malloc const char *CopyString(const char *string)
 	{
-		char *newString = Alloc(strlen(string) + 1, 1);
-		strcpy(newString, string);
+		char *newString = static_cast<char *>(Alloc(strlen(string) + 1, 1));
+		if (newString)
+			strcpy(newString, string);
 		return newString;
 	}
 
+	// Get the current position in the arena, and free everything allocated
+	// since then
+	mark_t GetMark() const
+	{
+		return offset;
+	}
+	void Rewind(mark_t mark)
+	{
+		offset = mark;
+	}
+
 	// Free all allocated memory
+	void Reset()
+	{
+		offset = internal_block;
+	}
 	void FreeAll()
 	{
 		offset = internal_block;
 	}
 
 private:
-	char internal_block[blockSize];
+	alignas(DEFAULT_MEMORY_ALIGNMENT) char internal_block[blockSize];
 	char *offset;
 };
 
-// Wrap a MemArena with a mutex to allow access from multiple threads. Note that
-// FreeAll is not made thread-safe.
+// Rewind point in an arena. Everything allocated in the arena during the
+// lifetime of this object is freed when it is destroyed.
+template<typename Arena> class ArenaMark: boost::noncopyable {
+public:
+	explicit ArenaMark(Arena &arena)
+		: arena(arena), mark(arena.GetMark()) {}
+	~ArenaMark()
+	{
+		arena.Rewind(mark);
+	}
+
+private:
+	Arena &arena;
+	typename Arena::mark_t mark;
+};
+
+// Wrap a MemArena with a lock to allow access from multiple threads. Note that
+// FreeAll, Reset and Rewind are not made thread-safe.
 template<typename Arena> class MemArenaThreadWrapper: public Arena {
 public:
 	// Allocate an object, with locking
 	__malloc void *Alloc(size_t size, size_t alignment = DEFAULT_MEMORY_ALIGNMENT)
 	{
-		lock.Lock();
+		lock.lock();
 		void *ptr = Arena::Alloc(size, alignment);
-		lock.Unlock();
+		lock.unlock();
 		return ptr;
 	}
 
 	// Copy a string
 	__malloc const char *CopyString(const char *string)
 	{
-		char *newString = Alloc(strlen(string) + 1, 1);
+		char *newString = static_cast<char *>(Alloc(strlen(string) + 1, 1));
 		strcpy(newString, string);
 		return newString;
 	}
 
 private:
 	// Lock protecting the arena
-	Mutex lock;
+	thread::spinlock lock;
+};
+
+// Arena allocator which can be used by multiple threads at once without
+// locking. Allocations reserve space in the current block with an atomic
+// add, and a new block is installed with a CAS when the current one is full.
+// FreeAll is not thread-safe.
+template<size_t blockSize> class MemArenaConcurrent: boost::noncopyable {
+public:
+	// Constructor. Blocks are allocated with the given memory tag, which
+	// defaults to the current tag when the arena is created.
+	explicit MemArenaConcurrent(memTag_t tag = MemTag::GetCurrent())
+		: blockList(nullptr), tag(tag)
+	{
+		internal_block.size = sizeof(internal_block.data);
+		internal_block.offset = 0;
+		current = &internal_block;
+	}
+
+	// Destructor
+	~MemArenaConcurrent()
+	{
+		FreeAll();
+	}
+
+	// Allocate an object. Alignment must be a power of 2.
+	__malloc void *Alloc(size_t size, size_t alignment = DEFAULT_MEMORY_ALIGNMENT)
+	{
+		// Offsets are always kept aligned to DEFAULT_MEMORY_ALIGNMENT, so
+		// extra space only needs to be reserved for larger alignments.
+		size_t reserve = PAD(size, DEFAULT_MEMORY_ALIGNMENT) + std::max(alignment, size_t(DEFAULT_MEMORY_ALIGNMENT)) - DEFAULT_MEMORY_ALIGNMENT;
+
+		// Large allocations get a block of their own
+		if (reserve > blockSize / 4)
+			return Align(NewBlock(reserve, false)->data, alignment);
+
+		while (true) {
+			blockHeader_t *block = current.load(std::memory_order_acquire);
+			size_t start = block->offset.fetch_add(reserve, std::memory_order_relaxed);
+			if (start + reserve <= block->size)
+				return Align(block->data + start, alignment);
+
+			// The block is full, try to replace it with a new one which
+			// already contains this allocation. If another thread got there
+			// first, free our block and try again with theirs.
+			blockHeader_t *newBlock = NewBlock(reserve, true);
+			if (current.compare_exchange_strong(block, newBlock)) {
+				PushBlock(newBlock);
+				return Align(newBlock->data, alignment);
+			}
+			MemFree(newBlock);
+		}
+	}
+
+	// Copy a string
+	__malloc const char *CopyString(const char *string)
+	{
+		char *newString = static_cast<char *>(Alloc(strlen(string) + 1, 1));
+		strcpy(newString, string);
+		return newString;
+	}
+
+	// Free all allocated memory. No other thread may use the arena while
+	// this is running.
+	void FreeAll()
+	{
+		blockHeader_t *block = blockList.exchange(nullptr);
+		while (block) {
+			blockHeader_t *next = block->next;
+			MemFree(block);
+			block = next;
+		}
+		internal_block.offset = 0;
+		current = &internal_block;
+	}
+
+private:
+	// Header at the begining of each block. Offset is the amount of data
+	// reserved in the block, which may go past the end of the block.
+	struct blockHeader_t {
+		blockHeader_t *next;
+		size_t size;
+		std::atomic<size_t> offset;
+		alignas(DEFAULT_MEMORY_ALIGNMENT) char data[0];
+	};
+
+	// Internal block
+	struct: public blockHeader_t {
+		char data[blockSize - sizeof(blockHeader_t)];
+	} internal_block;
+
+	// Make sure blockSize is reasonable
+	static_assert(blockSize > sizeof(blockHeader_t), "Arena block size is too small");
+
+	// Block currently being allocated from
+	std::atomic<blockHeader_t *> current;
+
+	// List of all allocated blocks, used to free them
+	std::atomic<blockHeader_t *> blockList;
+
+	// Memory tag for extra blocks
+	memTag_t tag;
+
+	// Align a pointer
+	static void *Align(char *ptr, size_t alignment)
+	{
+		return reinterpret_cast<void *>(PAD(reinterpret_cast<intptr_t>(ptr), alignment));
+	}
+
+	// Allocate a new block with the first reserve bytes already in use. If
+	// the block isn't going to be installed as the current block, it is
+	// added to the block list immediately.
+	blockHeader_t *NewBlock(size_t reserve, bool install)
+	{
+		size_t newSize = install ? std::max(blockSize, sizeof(blockHeader_t) + reserve) : sizeof(blockHeader_t) + reserve;
+		MemTagScope scope(tag);
+		blockHeader_t *newBlock = static_cast<blockHeader_t *>(MemAlloc(newSize));
+		newBlock->size = newSize - sizeof(blockHeader_t);
+		new(&newBlock->offset) std::atomic<size_t>(reserve);
+		if (!install)
+			PushBlock(newBlock);
+		return newBlock;
+	}
+
+	// Add a block to the block list
+	void PushBlock(blockHeader_t *block)
+	{
+		block->next = blockList.load(std::memory_order_relaxed);
+		while (!blockList.compare_exchange_weak(block->next, block));
+	}
 };
 
 // Operator new overload that uses a MemArena. Use it like this:
@@ -188,6 +439,14 @@ template<typename Arena> inline __malloc void *operator new(size_t size, MemAren
 {
 	return arena.Alloc(size, alignment);
 }
+template<size_t blockSize> inline __malloc void *operator new(size_t size, MemArenaConcurrent<blockSize> &arena, size_t alignment = DEFAULT_MEMORY_ALIGNMENT)
+{
+	return arena.Alloc(size, alignment);
+}
+template<size_t blockSize, int numFrames> inline __malloc void *operator new(size_t size, MemFrameArena<blockSize, numFrames> &arena, size_t alignment = DEFAULT_MEMORY_ALIGNMENT)
+{
+	return arena.Alloc(size, alignment);
+}
 template<size_t blockSize> inline __malloc void *operator new[](size_t size, MemArena<blockSize> &arena, size_t alignment = DEFAULT_MEMORY_ALIGNMENT)
 {
 	return arena.Alloc(size, alignment);
@@ -200,3 +459,11 @@ template<typename Arena> inline __malloc void *operator new[](size_t size, MemAr
 {
 	return arena.Alloc(size, alignment);
 }
+template<size_t blockSize> inline __malloc void *operator new[](size_t size, MemArenaConcurrent<blockSize> &arena, size_t alignment = DEFAULT_MEMORY_ALIGNMENT)
+{
+	return arena.Alloc(size, alignment);
+}
+template<size_t blockSize, int numFrames> inline __malloc void *operator new[](size_t size, MemFrameArena<blockSize, numFrames> &arena, size_t alignment = DEFAULT_MEMORY_ALIGNMENT)
+{
+	return arena.Alloc(size, alignment);
+}
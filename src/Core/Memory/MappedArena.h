@@ -0,0 +1,257 @@
+//@@COPYRIGHT@@
+
+// Arena allocator backed by a memory-mapped file. Data sets which are
+// expensive to build, such as those derived from a map, can be allocated in
+// it once and saved, and later mapped back in without rebuilding them. The
+// file can be mapped at any address, so pointers inside the arena must be
+// stored as RelativePtr.
+
+// Pointer stored as an offset from its own address, so that it stays valid
+// when the memory containing it is mapped at a different address. It can
+// only point into the same mapping.
+template<typename T> class RelativePtr {
+public:
+	RelativePtr()
+		: offset(0) {}
+	RelativePtr(T *ptr)
+	{
+		Set(ptr);
+	}
+	RelativePtr(const RelativePtr &other)
+	{
+		Set(other.Get());
+	}
+	RelativePtr &operator=(T *ptr)
+	{
+		Set(ptr);
+		return *this;
+	}
+	RelativePtr &operator=(const RelativePtr &other)
+	{
+		Set(other.Get());
+		return *this;
+	}
+
+	T *Get() const
+	{
+		if (!offset)
+			return NULL;
+		return reinterpret_cast<T *>(reinterpret_cast<intptr_t>(this) + offset);
+	}
+	T *operator->() const
+	{
+		return Get();
+	}
+	T &operator*() const
+	{
+		return *Get();
+	}
+	T &operator[](size_t index) const
+	{
+		return Get()[index];
+	}
+	operator T *() const
+	{
+		return Get();
+	}
+
+private:
+	// Offset 0 would point to the pointer itself, so it is used for NULL
+	intptr_t offset;
+
+	void Set(T *ptr)
+	{
+		offset = ptr ? reinterpret_cast<intptr_t>(ptr) - reinterpret_cast<intptr_t>(this) : 0;
+	}
+};
+
+// Arena allocator in a mapped file with a fixed capacity. It will return NULL
+// if the arena becomes full.
+class MemArenaMapped: boost::noncopyable {
+public:
+	// Position in the arena which can be returned to with Rewind
+	typedef size_t mark_t;
+
+	MemArenaMapped()
+		: file(NULL), header(NULL), writable(false) {}
+	~MemArenaMapped()
+	{
+		Close();
+	}
+
+	// Create a new arena in a file opened for editing. The file is extended
+	// to the capacity of the arena, which can't grow afterwards.
+	void Create(Filesystem::File &newFile, size_t capacity, std::error_code &err)
+	{
+		Close();
+		capacity = PAD(std::max(capacity, sizeof(header_t)), 4096);
+		char zero = 0;
+		newFile.Write(&zero, 1, capacity - 1, err);
+		if (err)
+			return;
+		void *ptr = newFile.MemMapEdit(0, capacity);
+		if (!ptr) {
+			err = std::make_error_code(std::errc::not_enough_memory);
+			return;
+		}
+
+		file = &newFile;
+		header = static_cast<header_t *>(ptr);
+		writable = true;
+		header->magic = ARENA_MAGIC;
+		header->version = ARENA_VERSION;
+		header->capacity = capacity;
+		header->used = sizeof(header_t);
+		header->root = 0;
+	}
+	void Create(Filesystem::File &newFile, size_t capacity)
+	{
+		std::error_code err;
+		Create(newFile, capacity, err);
+		if (err)
+			throw std::system_error(err);
+	}
+
+	// Map an arena which was previously saved to a file. Nothing needs to be
+	// read or fixed up, so this takes the same time whatever the size of the
+	// data set, and pages are only loaded when they are first accessed. If
+	// edit is false the arena is read-only and can't be allocated from.
+	void Open(Filesystem::File &newFile, bool edit, std::error_code &err)
+	{
+		Close();
+		// Check that the header describes data inside the file, so that
+		// GetRoot can't point outside of the mapping
+		header_t info;
+		if (newFile.Read(&info, sizeof(info), 0, err) != sizeof(info) || err || info.magic != ARENA_MAGIC || info.version != ARENA_VERSION || info.used < sizeof(header_t) || info.used > info.capacity || (info.root && (info.root < sizeof(header_t) || info.root >= info.used)) || static_cast<Filesystem::fsOffset_t>(info.capacity) > newFile.Length()) {
+			if (!err)
+				err = std::make_error_code(std::errc::invalid_argument);
+			return;
+		}
+		void *ptr = edit ? newFile.MemMapEdit(0, info.capacity) : newFile.MemMapRead(0, info.capacity);
+		if (!ptr) {
+			err = std::make_error_code(std::errc::not_enough_memory);
+			return;
+		}
+
+		file = &newFile;
+		header = static_cast<header_t *>(ptr);
+		writable = edit;
+	}
+	void Open(Filesystem::File &newFile, bool edit = false)
+	{
+		std::error_code err;
+		Open(newFile, edit, err);
+		if (err)
+			throw std::system_error(err);
+	}
+
+	// Unmap the arena. Changes are written back to the file if it was
+	// created or opened for editing.
+	void Close()
+	{
+		if (!header)
+			return;
+		file->MemUnmap(header);
+		file = NULL;
+		header = NULL;
+	}
+	bool IsOpen() const
+	{
+		return header != NULL;
+	}
+
+	// Allocate an object. Alignment must be a power of 2. Returns NULL if the
+	// arena is full.
+	__malloc void *Alloc(size_t size, size_t alignment = DEFAULT_MEMORY_ALIGNMENT)
+	{
+		Assert(writable);
+		size_t offset = PAD(header->used, alignment);
+		if (offset + size > header->capacity)
+			return NULL;
+		header->used = offset + size;
+		return Base() + offset;
+	}
+
+	// Copy a string
+	__malloc const char *CopyString(const char *string)
+	{
+		char *newString = static_cast<char *>(Alloc(strlen(string) + 1, 1));
+		if (newString)
+			strcpy(newString, string);
+		return newString;
+	}
+
+	// Root object of the data set, which is the entry point when the arena is
+	// opened again
+	template<typename T> void SetRoot(T *root)
+	{
+		Assert(writable);
+		header->root = root ? reinterpret_cast<char *>(root) - Base() : 0;
+	}
+	template<typename T> T *GetRoot() const
+	{
+		return header->root ? reinterpret_cast<T *>(Base() + header->root) : NULL;
+	}
+
+	// Get the number of bytes used and available in the arena
+	size_t GetUsed() const
+	{
+		return header->used;
+	}
+	size_t GetCapacity() const
+	{
+		return header->capacity;
+	}
+
+	// Get the current position in the arena, and free everything allocated
+	// since then
+	mark_t GetMark() const
+	{
+		return header->used;
+	}
+	void Rewind(mark_t mark)
+	{
+		Assert(writable);
+		header->used = mark;
+	}
+
+	// Free all allocated memory
+	void Reset()
+	{
+		Assert(writable);
+		header->used = sizeof(header_t);
+		header->root = 0;
+	}
+
+private:
+	// Header at the start of the file
+	static const uint32_t ARENA_MAGIC = 0x414d454d; // "MEMA"
+	static const uint32_t ARENA_VERSION = 1;
+	struct header_t {
+		uint32_t magic;
+		uint32_t version;
+		uint64_t capacity;
+		uint64_t used;
+		uint64_t root; // Offset of the root object, 0 if none
+	};
+
+	Filesystem::File *file;
+	header_t *header;
+	bool writable;
+
+	char *Base() const
+	{
+		return reinterpret_cast<char *>(header);
+	}
+};
+
+// Operator new overloads that use a MemArenaMapped. As with the other arenas,
+// objects are never destroyed, so they should not own memory outside of it.
+inline __malloc void *operator new(size_t size, MemArenaMapped &arena, size_t alignment = DEFAULT_MEMORY_ALIGNMENT)
+{
+	return arena.Alloc(size, alignment);
+}
+inline __malloc void *operator new[](size_t size, MemArenaMapped &arena, size_t alignment = DEFAULT_MEMORY_ALIGNMENT)
+{
+	return arena.Alloc(size, alignment);
+}
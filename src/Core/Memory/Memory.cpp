@@ -36,30 +36,95 @@ void FreeString(const char *string)
 	delete[] string;
 }
 
-// General allocator size classes
-static const unsigned int sizeClasses[] = {8, 16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024};
+// General allocator size classes. Classes larger than a few KB use pools with
+// spans of several blocks.
+#define SIZE_CLASSES \
+	8, 16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, \
+	1536, 2048, 3072, 4096, 6144, 8192, 12288, 16384, 24576, 32768
+static constexpr unsigned int sizeClasses[] = {SIZE_CLASSES};
 static const int numSizeClasses = sizeof(sizeClasses) / sizeof(*sizeClasses);
+static const size_t MAX_POOL_SIZE = sizeClasses[numSizeClasses - 1];
+
+// Pool functions for each size class
+struct sizeClassPool_t {
+	void *(*alloc)();
+	void (*free)(void *ptr);
+};
+template<size_t... sizes> constexpr std::array<sizeClassPool_t, sizeof...(sizes)> MakePoolTable()
+{
+	return {{{MemPool<sizes>::Alloc, MemPool<sizes>::Free}...}};
+}
+static constexpr std::array<sizeClassPool_t, numSizeClasses> poolTable = MakePoolTable<SIZE_CLASSES>();
+
+// Compile-time integer sequence, built in log(N) steps
+template<size_t... I> struct indexSeq_t {};
+template<typename A, typename B> struct concatSeq_t;
+template<size_t... A, size_t... B> struct concatSeq_t<indexSeq_t<A...>, indexSeq_t<B...>> {
+	typedef indexSeq_t<A..., (sizeof...(A) + B)...> type;
+};
+template<size_t N> struct makeSeq_t {
+	typedef typename concatSeq_t<typename makeSeq_t<N / 2>::type, typename makeSeq_t<N - N / 2>::type>::type type;
+};
+template<> struct makeSeq_t<0> {
+	typedef indexSeq_t<> type;
+};
+template<> struct makeSeq_t<1> {
+	typedef indexSeq_t<0> type;
+};
+
+// Lookup table mapping (size + 7) / 8 to a size class
+static constexpr uint8_t SizeClassFor(size_t size, int sizeClass = 0)
+{
+	return sizeClasses[sizeClass] >= size ? sizeClass : SizeClassFor(size, sizeClass + 1);
+}
+template<size_t... I> constexpr std::array<uint8_t, sizeof...(I)> MakeSizeLookup(indexSeq_t<I...>)
+{
+	return {{SizeClassFor(I * 8)...}};
+}
+static const int SIZE_LOOKUP_LENGTH = MAX_POOL_SIZE / 8 + 1;
+static constexpr std::array<uint8_t, SIZE_LOOKUP_LENGTH> sizeLookup = MakeSizeLookup(makeSeq_t<SIZE_LOOKUP_LENGTH>::type());
+
+// Find the pool for a size
+static inline const sizeClassPool_t &FindPool(size_t size)
+{
+	return poolTable[sizeLookup[(size + 7) >> 3]];
+}
+
+// Get the object size of the size class for a size
+static inline size_t ClassSize(size_t size)
+{
+	return sizeClasses[sizeLookup[(size + 7) >> 3]];
+}
+
+// Large allocations are mapped directly with mmap where mremap is available,
+// so that MemRealloc can resize them without copying.
+#ifdef MREMAP_MAYMOVE
+#define HAVE_MREMAP
+#define MMAP_THRESHOLD (256 * 1024)
+static const size_t pageSize = sysconf(_SC_PAGESIZE);
+#endif
 
 // Whether all global constructors have been run yet
 static bool memInit = false;
 
 void Memory::Init()
 {
-	// We just set a flag now that we are sure that all MemPools have been
-	// constructed.
+	// Reserve the block address space, then set a flag now that we are sure
+	// that all MemPools have been constructed.
+	MemVirtual::Init();
 	memInit = true;
 }
 
 // Aligned system malloc
-static inline void *aligned_malloc(size_t size)
+static inline void *aligned_malloc(size_t size, size_t align = 16)
 {
 #ifdef __SSE__
-	return _mm_malloc(size, 16);
+	return _mm_malloc(size, align);
 #elif _WIN32
-	return _aligned_malloc(size, 16);
+	return _aligned_malloc(size, align);
 #else
 	void *ptr;
-	if (posix_memalign(&ptr, 16, size))
+	if (posix_memalign(&ptr, align, size))
 		return NULL;
 	else
 		return ptr;
@@ -76,113 +141,249 @@ static inline void aligned_free(void *ptr)
 #endif
 }
 
-// Find a size class for a size
-static inline int FindSizeClass(size_t size)
+// Get the usable size of an allocation made by aligned_malloc
+static inline size_t aligned_size(void *ptr)
+{
+#ifdef _WIN32
+	return _aligned_msize(ptr, 16, 0);
+#else
+	return malloc_usable_size(ptr);
+#endif
+}
+
+// Allocate memory from the system allocator and count it
+static inline void *SysAlloc(size_t size, size_t align = 16)
+{
+	memTag_t tag = MemTag::currentTag;
+	if (tag != MEMTAG_GENERAL)
+		MemTag::Charge(tag, size);
+
+	void *ptr;
+	size_t allocSize;
+#ifdef HAVE_MREMAP
+	if (size > MMAP_THRESHOLD && align <= pageSize) {
+		allocSize = PAD(size, pageSize);
+		ptr = anonymous_mmap(NULL, allocSize, PROT_READ | PROT_WRITE, 0);
+		if (ptr == MAP_FAILED)
+			ptr = NULL;
+		else
+			MemVirtual::RegisterMmap(ptr, allocSize);
+	} else
+#endif
+	{
+		ptr = aligned_malloc(size, align);
+		allocSize = ptr ? aligned_size(ptr) : 0;
+	}
+	if (!ptr) {
+		if (tag != MEMTAG_GENERAL)
+			MemTag::Charge(tag, -static_cast<int64_t>(size));
+		Error("Out of memory (Tried to allocate %d bytes)", static_cast<int>(size));
+	}
+
+	if (tag != MEMTAG_GENERAL)
+		MemTag::MarkSys(ptr, tag, size);
+	MemStats::threadStats_t &stats = MemStats::ThreadStats();
+	MemStats::Add(stats.sysAllocs);
+	MemStats::Add(stats.sysAllocBytes, allocSize);
+	return ptr;
+}
+
+// Free an allocation made by the system allocator and count it
+static inline void SysFree(void *ptr)
 {
-	const unsigned int *ptr = std::lower_bound(sizeClasses, sizeClasses + numSizeClasses, size);
-	return ptr - sizeClasses;
+	if (!ptr)
+		return;
+	if (MemTag::Used())
+		MemTag::ReleaseSys(ptr);
+	MemStats::threadStats_t &stats = MemStats::ThreadStats();
+	MemStats::Add(stats.sysFrees);
+#ifdef HAVE_MREMAP
+	if (size_t mapSize = MemVirtual::TryReleaseMmap(ptr)) {
+		MemStats::Add(stats.sysFreeBytes, mapSize);
+		munmap(ptr, mapSize);
+		return;
+	}
+#endif
+	MemStats::Add(stats.sysFreeBytes, aligned_size(ptr));
+	aligned_free(ptr);
+}
+
+// Allocate an object from a pool and charge it to the current memory tag
+static inline void *PoolAlloc(size_t size)
+{
+	memTag_t tag = MemTag::currentTag;
+	if (__builtin_expect(tag == MEMTAG_GENERAL, 1))
+		return FindPool(size).alloc();
+
+	MemTag::Charge(tag, ClassSize(size));
+	void *ptr = FindPool(size).alloc();
+	MemTag::MarkPool(ptr, tag);
+	return ptr;
 }
 
 void *MemAlloc(size_t size)
 {
-	if (size > sizeClasses[numSizeClasses - 1] || !memInit) {
-		void *ptr = aligned_malloc(size);
-		if (!ptr)
-			Error("Out of memory (Tried to allocate %d bytes)", static_cast<int>(size));
+	void *ptr;
+	if (size > MAX_POOL_SIZE || !memInit)
+		ptr = SysAlloc(size);
+	else
+		ptr = PoolAlloc(size);
+
+	MemProfiler::OnAlloc(ptr, size);
+	return ptr;
+}
+
+void *MemAllocAligned(size_t size, size_t align)
+{
+	Assert((align && (align & (align - 1)) == 0));
+	if (align <= 16)
+		return MemAlloc(size);
+	void *ptr;
+	if (!memInit) {
+		ptr = SysAlloc(size, align);
+		MemProfiler::OnAlloc(ptr, size);
 		return ptr;
 	}
 
-	int sizeClass = FindSizeClass(size);
-	switch (sizeClass) {
-	case 0:
-		return MemPool<8>::Alloc();
-	case 1:
-		return MemPool<16>::Alloc();
-	case 2:
-		return MemPool<24>::Alloc();
-	case 3:
-		return MemPool<32>::Alloc();
-	case 4:
-		return MemPool<48>::Alloc();
-	case 5:
-		return MemPool<64>::Alloc();
-	case 6:
-		return MemPool<96>::Alloc();
-	case 7:
-		return MemPool<128>::Alloc();
-	case 8:
-		return MemPool<192>::Alloc();
-	case 9:
-		return MemPool<256>::Alloc();
-	case 10:
-		return MemPool<384>::Alloc();
-	case 11:
-		return MemPool<512>::Alloc();
-	case 12:
-		return MemPool<768>::Alloc();
-	case 13:
-		return MemPool<1024>::Alloc();
-	NO_DEFAULT
+	// Objects in a pool are aligned to their size, since blocks are aligned
+	// to at least BLOCK_SIZE, so find the first size class whose object size
+	// is a multiple of the alignment.
+	size = PAD(size, align);
+	while (size <= MAX_POOL_SIZE && ClassSize(size) % align != 0)
+		size = PAD(ClassSize(size) + 1, align);
+	if (size > MAX_POOL_SIZE)
+		ptr = SysAlloc(size, align);
+	else
+		ptr = PoolAlloc(size);
+
+	MemProfiler::OnAlloc(ptr, size);
+	return ptr;
+}
+
+void *MemRealloc(void *ptr, size_t size)
+{
+	if (!ptr)
+		return MemAlloc(size);
+	if (!size) {
+		MemFree(ptr);
+		return NULL;
 	}
 
-	// Unreachable
-	while (true) {}
+	size_t oldSize;
+	if (MemVirtual::IsBlockPtr(ptr)) {
+		// Stay in place if the new size is in the same size class
+		oldSize = MemPoolImpl::GetObjSize(ptr);
+		if (size <= MAX_POOL_SIZE && ClassSize(size) == oldSize)
+			return ptr;
+	} else {
+#ifdef HAVE_MREMAP
+		// Large mappings can be resized in place, or moved without copying
+		size_t mapSize = MemVirtual::TryReleaseMmap(ptr);
+		if (mapSize) {
+			if (size > MMAP_THRESHOLD) {
+				size_t newSize = PAD(size, pageSize);
+				memTag_t tag = MemTag::GetSysTag(ptr);
+				if (tag != MEMTAG_GENERAL)
+					MemTag::Charge(tag, size);
+				MemProfiler::OnFree(ptr);
+				void *newPtr = mremap(ptr, mapSize, newSize, MREMAP_MAYMOVE);
+				if (newPtr == MAP_FAILED) {
+					if (tag != MEMTAG_GENERAL)
+						MemTag::Charge(tag, -static_cast<int64_t>(size));
+					Error("Out of memory (Tried to allocate %d bytes)", static_cast<int>(size));
+				}
+				if (tag != MEMTAG_GENERAL) {
+					MemTag::ReleaseSys(ptr);
+					MemTag::MarkSys(newPtr, tag, size);
+				}
+				MemVirtual::RegisterMmap(newPtr, newSize);
+				MemStats::threadStats_t &stats = MemStats::ThreadStats();
+				MemStats::Add(stats.sysFreeBytes, mapSize);
+				MemStats::Add(stats.sysAllocBytes, newSize);
+				MemProfiler::OnAlloc(newPtr, size);
+				return newPtr;
+			}
+
+			// Shrinking below the threshold, so copy it to a pool
+			MemVirtual::RegisterMmap(ptr, mapSize);
+			oldSize = mapSize;
+		} else
+#endif
+		{
+			// The system allocator may have left some room at the end
+			oldSize = aligned_size(ptr);
+			if (size <= oldSize && size > oldSize / 2)
+				return ptr;
+		}
+	}
+
+	void *newPtr = MemAlloc(size);
+	memcpy(newPtr, ptr, std::min(size, oldSize));
+	MemFree(ptr);
+	return newPtr;
 }
 
 void MemFree(void *ptr)
 {
+	MemProfiler::OnFree(ptr);
 	if (!MemVirtual::IsBlockPtr(ptr)) {
-		aligned_free(ptr);
+		SysFree(ptr);
 		return;
 	}
 
-	int sizeClass = FindSizeClass(MemPoolImpl::GetObjSize(ptr));
-	switch (sizeClass) {
-	case 0:
-		MemPool<8>::Free(ptr);
-		return;
-	case 1:
-		MemPool<16>::Free(ptr);
-		return;
-	case 2:
-		MemPool<24>::Free(ptr);
-		return;
-	case 3:
-		MemPool<32>::Free(ptr);
-		return;
-	case 4:
-		MemPool<48>::Free(ptr);
-		return;
-	case 5:
-		MemPool<64>::Free(ptr);
-		return;
-	case 6:
-		MemPool<96>::Free(ptr);
-		return;
-	case 7:
-		MemPool<128>::Free(ptr);
-		return;
-	case 8:
-		MemPool<192>::Free(ptr);
-		return;
-	case 9:
-		MemPool<256>::Free(ptr);
-		return;
-	case 10:
-		MemPool<384>::Free(ptr);
-		return;
-	case 11:
-		MemPool<512>::Free(ptr);
-		return;
-	case 12:
-		MemPool<768>::Free(ptr);
-		return;
-	case 13:
-		MemPool<1024>::Free(ptr);
+	size_t objSize = MemPoolImpl::GetObjSize(ptr);
+	if (MemTag::Used())
+		MemTag::ReleasePool(ptr, objSize);
+	FindPool(objSize).free(ptr);
+}
+
+void MemFree(void *ptr, size_t size)
+{
+	MemProfiler::OnFree(ptr);
+
+	// Allocations made before Memory::Init() use the system allocator even
+	// for small sizes, so we still need to check the pointer.
+	if (!MemVirtual::IsBlockPtr(ptr)) {
+		SysFree(ptr);
 		return;
-	NO_DEFAULT
 	}
 
-	// Unreachable
-	while (true) {}
+	if (MemTag::Used())
+		MemTag::ReleasePool(ptr, ClassSize(size));
+	FindPool(size).free(ptr);
+}
+
+pmr::memory_resource *pmr::get_default_resource()
+{
+	static pmr::pool_resource resource;
+	return &resource;
+}
+
+#ifdef USE_MEMORY_OVERRIDE
+// Overloads for the standard C++ new and delete opertors to use the main heap.
+// Note that these don't throw bad_alloc, but instead crash if out of memory.
+void *operator new(size_t size)
+{
+	return MemAlloc(size);
 }
+void *operator new[](size_t size)
+{
+	return MemAlloc(size);
+}
+void operator delete(void *ptr) noexcept
+{
+	MemFree(ptr);
+}
+void operator delete[](void *ptr) noexcept
+{
+	MemFree(ptr);
+}
+void operator delete(void *ptr, size_t size) noexcept
+{
+	MemFree(ptr, size);
+}
+void operator delete[](void *ptr, size_t size) noexcept
+{
+	MemFree(ptr, size);
+}
+#endif
@@ -2,42 +2,46 @@
 
 // Various memory management utilities
 
+// Round up a value to a multiple of alignment, which must be a power of 2
+#define PAD(base, alignment) (((base) + (alignment) - 1) & ~((alignment) - 1))
+
 // Initialize the memory subsystem
 namespace Memory {
 void Init();
+
+// Register memory console commands
+void InitCommands();
 }
 
 // Replacements for the standard malloc() and free()
 EXPORT __malloc void *MemAlloc(size_t size);
 EXPORT void MemFree(void *ptr);
 
+// Sized free, which avoids looking up the size class of the pointer. The size
+// must be the same as the one passed to MemAlloc.
+EXPORT void MemFree(void *ptr, size_t size);
+
+// Resize an allocation made with MemAlloc, like the standard realloc(). This
+// is done in place if the new size is in the same size class, and large
+// allocations are resized with mremap where it is available. Only 16 byte
+// alignment is kept if the allocation has to move.
+EXPORT void *MemRealloc(void *ptr, size_t size);
+
+// Allocate memory with a given alignment, which must be a power of 2. The
+// memory must be freed with the unsized version of MemFree.
+EXPORT __malloc void *MemAllocAligned(size_t size, size_t align);
+
 // Helper functions to allocate space for a read-only copy of a string.
 EXPORT __malloc const char *CopyString(const char *string);
 EXPORT void FreeString(const char *string);
 
-#ifndef BUILD_TEST
-// Overloads for the standard C++ new and delete opertors to use the main heap.
-// Note that these don't throw bad_alloc, but instead crash if out of memory.
-inline __malloc void *operator new(size_t size) throw(std::bad_alloc)
-{
-	return MemAlloc(size);
-}
-inline __malloc void *operator new[](size_t size) throw(std::bad_alloc)
-{
-	return MemAlloc(size);
-}
-inline void operator delete(void *ptr) throw()
-{
-	return MemFree(ptr);
-}
-inline void operator delete[](void *ptr) throw()
-{
-	return MemFree(ptr);
-}
-#endif
+// The standard C++ new and delete operators are replaced to use the main heap
+// when built with USE_MEMORY_OVERRIDE=1. These are defined in Memory.cpp since
+// replacement allocation functions can't be inline.
 
-// STL allocator class that uses our memory functions instead
-template<typename T> class StlAllocator {
+// STL allocator class that uses our memory functions instead. Types with an
+// alignment greater than 16 are allocated with MemAllocAligned.
+template<typename T, size_t Align = std::alignment_of<T>::value> class StlAllocator {
 public:
 	// STL typedefs
 	typedef size_t size_type;
@@ -53,8 +57,8 @@ public:
 	StlAllocator(const StlAllocator &) {}
 
 	// Allow assignment from allocators of different types
-	template<typename U> StlAllocator(const StlAllocator<U> &) {}
-	template<typename U> StlAllocator &operator=(const StlAllocator<U> &)
+	template<typename U, size_t A> StlAllocator(const StlAllocator<U, A> &) {}
+	template<typename U, size_t A> StlAllocator &operator=(const StlAllocator<U, A> &)
 	{
 		return *this;
 	}
@@ -62,11 +66,26 @@ public:
 	// Allocate and free memory
 	pointer allocate(size_type n, const void * = NULL)
 	{
+		if (Align > 16)
+			return static_cast<pointer>(MemAllocAligned(n * sizeof(T), Align));
 		return static_cast<pointer>(MemAlloc(n * sizeof(T)));
 	}
-	void deallocate(void *ptr, size_type)
+	void deallocate(pointer ptr, size_type n)
 	{
-		MemFree(ptr);
+		if (Align > 16)
+			MemFree(ptr);
+		else
+			MemFree(ptr, n * sizeof(T));
+	}
+
+	// Resize an array of trivially copyable objects using MemRealloc. This
+	// isn't used by the standard containers, which always allocate a new
+	// array, but is available to containers which manage their own storage.
+	pointer reallocate(pointer ptr, size_type n)
+	{
+		static_assert(std::is_trivially_copyable<T>::value, "reallocate requires a trivially copyable type");
+		static_assert(Align <= 16, "reallocate doesn't preserve alignments greater than 16");
+		return static_cast<pointer>(MemRealloc(ptr, n * sizeof(T)));
 	}
 
 	// Get an address from a reference
@@ -95,8 +114,19 @@ public:
 		return std::numeric_limits<size_type>::max();
 	}
 
-	// Get an allocator for a different type
+	// Get an allocator for a different type. Containers rebind the allocator
+	// to their own node or element type, so the alignment is kept.
 	template <typename U> struct rebind {
-		typedef StlAllocator<U> other;
+		typedef StlAllocator<U, (Align > std::alignment_of<U>::value ? Align : std::alignment_of<U>::value)> other;
 	};
+
+	// All allocators are equivalent
+	template<typename U, size_t A> bool operator==(const StlAllocator<U, A> &) const
+	{
+		return true;
+	}
+	template<typename U, size_t A> bool operator!=(const StlAllocator<U, A> &) const
+	{
+		return false;
+	}
 };
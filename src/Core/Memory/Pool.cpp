@@ -5,129 +5,178 @@
 // To access the structs
 using namespace MemPoolImpl;
 
-// Special value for the next pointer of a block, when it belong to a thread.
-#define THREAD_BLOCK reinterpret_cast<List<memBlock_t>::node_ptr>(-1)
-
-// Maximum number of blocks the free block list can hold before blocks are freed
-// back to the operating system.
+// Maximum number of blocks the free block lists can hold before blocks are
+// freed back to the operating system.
 #define MAX_FREE_BLOCKS 64
 
-// Global free block list
-static LFList<freeItem_t> freeBlockList;
+// Global free block lists, one for each span size, with an approximate count
+// of the blocks in them
+static const int NUM_SPAN_SIZES = 4;
+static lockfree::intrusive_stack<freeItem_t, intrusive::base_hook<freeHook_t>> freeBlockList[NUM_SPAN_SIZES];
+static std::atomic<int> freeBlockCount{0};
 
 // Get the base block pointer from an object inside it
-static inline void *BaseFromPtr(void *ptr)
+static inline void *BaseFromPtr(void *ptr, size_t spanSize)
 {
-	return reinterpret_cast<void *>(reinterpret_cast<intptr_t>(ptr) & ~(MemPoolImpl::BLOCK_SIZE - 1));
+	return reinterpret_cast<void *>(reinterpret_cast<intptr_t>(ptr) & ~(spanSize - 1));
 }
 
 // Convert between a memBlock_t pointer and a base block pointer
-static inline void *BaseFromBlock(memBlock_t *block)
+static inline void *BaseFromBlock(memBlock_t *block, size_t spanSize)
+{
+	return BaseFromPtr(block, spanSize);
+}
+static inline memBlock_t *BlockFromBase(void *base, size_t spanSize)
+{
+	return reinterpret_cast<memBlock_t *>(static_cast<char *>(base) + spanSize - sizeof(memBlock_t));
+}
+
+// Get a block of the given size, either from a free list or from the
+// operating system.
+static inline void *GetFreeBlock(size_t spanSize)
+{
+	int numBlocks = spanSize / BLOCK_SIZE;
+	void *base = freeBlockList[IntLog2(numBlocks)].pop();
+	if (base)
+		freeBlockCount.fetch_sub(numBlocks, std::memory_order_relaxed);
+	else
+		base = MemVirtual::AllocSpan(numBlocks);
+	return base;
+}
+
+// Release an empty block. The block is freed to the operating system if the
+// free block lists are full. This check isn't thread-safe but it is OK to
+// have a few more blocks than MAX_FREE_BLOCKS.
+static inline void ReleaseBlock(void *base, size_t spanSize)
+{
+	int numBlocks = spanSize / BLOCK_SIZE;
+	if (freeBlockCount.load(std::memory_order_relaxed) + numBlocks > MAX_FREE_BLOCKS)
+		MemVirtual::FreeSpan(base, numBlocks);
+	else {
+		freeBlockList[IntLog2(numBlocks)].push(*new(base) freeItem_t);
+		freeBlockCount.fetch_add(numBlocks, std::memory_order_relaxed);
+	}
+}
+
+// Pack and unpack the remote free list word. The list head is stored as an
+// offset from the base of the block, and is only valid if the count is not 0.
+static inline uint64_t RemoteWord(uint32_t offset, uint32_t count, blockState_t state)
 {
-	return BaseFromPtr(block);
+	return static_cast<uint64_t>(offset) << 32 | count << 2 | state;
 }
-static inline memBlock_t *BlockFromBase(void *base)
+static inline uint32_t RemoteOffset(uint64_t word)
 {
-	return reinterpret_cast<memBlock_t *>(static_cast<char *>(base) + MemPoolImpl::BLOCK_SIZE - sizeof(memBlock_t));
+	return word >> 32;
+}
+static inline uint32_t RemoteCount(uint64_t word)
+{
+	return static_cast<uint32_t>(word) >> 2;
+}
+static inline blockState_t RemoteState(uint64_t word)
+{
+	return static_cast<blockState_t>(word & 3);
 }
 
-// Get the memBlock_t from an object inside the block
-static inline memBlock_t *BlockFromPtr(void *ptr)
+MemPoolImpl::blockLists_t::blockLists_t(size_t objSize_, size_t spanSize_)
+	: objSize(objSize_), spanSize(spanSize_)
 {
-	return BlockFromBase(BaseFromPtr(ptr));
+	statsIndex = MemStats::RegisterPool(this);
 }
 
-// Mark a block as a thread block. Set value to true to mark or false to unmark.
-static inline void MarkThreadBlock(memBlock_t *block, bool value)
+// Get the partial bin for a block with the given number of free objects
+static inline int PartialBin(uint32_t numFree, int maxObjs)
 {
-	List<memBlock_t>::node_ptr node = List<memBlock_t>::value_traits::to_node_ptr(*block);
-	List<memBlock_t>::node_traits::set_next(node, value ? THREAD_BLOCK : NULL);
+	return std::min<int>(numFree * NUM_PARTIAL_BINS / maxObjs, NUM_PARTIAL_BINS - 1);
 }
 
-// Check if a block is a thread block
-static inline bool IsThreadBlock(memBlock_t *block)
+// Load a remote free list which has been taken from a block into the thread's
+// free list, and return the first item.
+static inline void *ReclaimRemote(void *base, uint64_t word, threadData_t &threadData)
 {
-	List<memBlock_t>::node_ptr node = List<memBlock_t>::value_traits::to_node_ptr(*block);
-	return List<memBlock_t>::node_traits::get_next(node) == THREAD_BLOCK;
+	freeList_t::node_ptr item = freeList_t::value_traits::to_node_ptr(*reinterpret_cast<freeItem_t *>(static_cast<char *>(base) + RemoteOffset(word)));
+	threadData.freeList = freeList_t::node_traits::get_next(item);
+	return freeList_t::value_traits::to_value_ptr(item);
 }
 
-void *MemPoolImpl::Alloc(size_t objSize, blockLists_t &blockLists, threadData_t &threadData)
+void *MemPoolImpl::Alloc(size_t objSize, size_t spanSize, blockLists_t &blockLists, threadData_t &threadData)
 {
-	void *ptr;
 	memBlock_t *block;
+	MemStats::Add(MemStats::ThreadStats().poolAllocs[blockLists.statsIndex]);
 
 	// Try fast paths first
 	if (threadData.threadBlock) {
 		// Fast path 1: attempt to reap directly from block
-		if (threadData.reapStart && threadData.reapStart <= static_cast<char *>(BaseFromBlock(threadData.threadBlock)) + BLOCK_SIZE - sizeof(memBlock_t) - objSize) {
+		if (threadData.reapStart && threadData.reapStart <= static_cast<char *>(BaseFromBlock(threadData.threadBlock, spanSize)) + spanSize - sizeof(memBlock_t) - objSize) {
 			void *ptr = threadData.reapStart;
 			threadData.reapStart = static_cast<char *>(threadData.reapStart) + objSize;
 			return ptr;
 		}
 
 		// Fast path 2: attempt to allocate from per-thread free list
-		void *ptr = SList<freeItem_t>::value_traits::to_value_ptr(threadData.freeList);
-		if (ptr) {
-			threadData.freeList = SList<freeItem_t>::node_traits::get_next(threadData.freeList);
+		if (threadData.freeList) {
+			void *ptr = freeList_t::value_traits::to_value_ptr(threadData.freeList);
+			threadData.freeList = freeList_t::node_traits::get_next(threadData.freeList);
 			return ptr;
 		}
 
-		// Try to get the free list from our per-thread block:
-		// Other threads may have freed something in it.
+		// Try to take the remote free list of our per-thread block: other
+		// threads may have freed something in it. If it is empty then the
+		// block is full, so give it up and get a new one.
 		block = threadData.threadBlock;
-		SList<freeItem_t> list;
-		block->lock.Lock();
-		list.swap(block->freeList);
-		block->numFree = 0;
-		if (list.empty()) {
-			// The block is now full, so unmark it and get a new one
-			MarkThreadBlock(block, false);
-			block->lock.Unlock();
-		} else {
-			block->lock.Unlock();
-			ptr = &list.front();
-			list.pop_front();
-			threadData.freeList = list.begin().pointed_node();
-			return ptr;
+		uint64_t word = block->remoteFree.load(std::memory_order_relaxed);
+		while (true) {
+			if (RemoteCount(word) == 0) {
+				if (block->remoteFree.compare_exchange_weak(word, RemoteWord(0, 0, BLOCK_FULL), std::memory_order_relaxed, std::memory_order_relaxed)) {
+					blockLists.numThreadBlocks.fetch_sub(1, std::memory_order_relaxed);
+					break;
+				}
+			} else if (block->remoteFree.compare_exchange_weak(word, RemoteWord(0, 0, BLOCK_THREAD), std::memory_order_acquire, std::memory_order_relaxed))
+				return ReclaimRemote(BaseFromBlock(block, spanSize), word, threadData);
 		}
+		threadData.threadBlock = NULL;
 	}
 
 	// Couldn't allocate from thread block, either because we don't have a block
-	// or it is full. Get a new block from the partial list and load its free
-	// list.
-	blockLists.lock.Lock();
-	//blockLists.partial.size();
-	foreach (memBlock_t &blk, blockLists.partial) {
-		block = &blk;
-		if (!block->lock.TryLock())
-			continue;
-		blockLists.partial.erase(blockLists.partial.iterator_to(*block));
-		//blockLists.partial.size();
-		blockLists.lock.Unlock();
-		MarkThreadBlock(block, true);
-		SList<freeItem_t> list;
-		list.swap(block->freeList);
-		block->numFree = 0;
-		block->lock.Unlock();
-		ptr = &list.front();
-		list.pop_front();
-		threadData.freeList = list.begin().pointed_node();
-		threadData.threadBlock = block;
-		threadData.reapStart = NULL;
-		return ptr;
+	// or it is full. Get the fullest block from the partial lists and take its
+	// remote free list, which can't be empty.
+	blockLists.lock.lock();
+	int maxObjs = (spanSize - sizeof(memBlock_t)) / objSize;
+	for (int bin = 0; bin < NUM_PARTIAL_BINS; bin++) {
+		blockList_t &partial = blockLists.partial[bin];
+		while (!partial.empty()) {
+			block = &partial.front();
+			partial.pop_front();
+
+			// Blocks are only filed when they enter the partial list, and
+			// they can only get emptier while in it. Move blocks which are
+			// in the wrong bin and keep looking.
+			int actualBin = PartialBin(RemoteCount(block->remoteFree.load(std::memory_order_relaxed)), maxObjs);
+			if (actualBin > bin) {
+				block->bin = actualBin;
+				blockLists.partial[actualBin].push_back(*block);
+				continue;
+			}
+
+			uint64_t word = block->remoteFree.exchange(RemoteWord(0, 0, BLOCK_THREAD), std::memory_order_acquire);
+			blockLists.numPartial.fetch_sub(1, std::memory_order_relaxed);
+			blockLists.lock.unlock();
+			blockLists.numThreadBlocks.fetch_add(1, std::memory_order_relaxed);
+			Assert((RemoteState(word) == BLOCK_PARTIAL && RemoteCount(word) != 0));
+			threadData.threadBlock = block;
+			threadData.reapStart = NULL;
+			return ReclaimRemote(BaseFromBlock(block, spanSize), word, threadData);
+		}
 	}
-	//blockLists.partial.size();
-	blockLists.lock.Unlock();
+	blockLists.lock.unlock();
 
 	// The partial list is empty, so we try to get a block from the free list.
 	// If that fails, allocate a new block.
-	void *base = freeBlockList.Pop();
-	if (!base)
-		base = MemVirtual::AllocBlock();
-	block = new(BlockFromBase(base)) memBlock_t;
-	MarkThreadBlock(block, true);
+	void *base = GetFreeBlock(spanSize);
+	block = new(BlockFromBase(base, spanSize)) memBlock_t;
+	block->remoteFree.store(RemoteWord(0, 0, BLOCK_THREAD), std::memory_order_relaxed);
 	block->objSize = objSize;
-	block->numFree = 0;
+	blockLists.numBlocks.fetch_add(1, std::memory_order_relaxed);
+	blockLists.numThreadBlocks.fetch_add(1, std::memory_order_relaxed);
 	threadData.reapStart = static_cast<char *>(base) + objSize;
 	threadData.threadBlock = block;
 
@@ -135,71 +184,157 @@ void *MemPoolImpl::Alloc(size_t objSize, blockLists_t &blockLists, threadData_t
 	return base;
 }
 
-void MemPoolImpl::Free(void *ptr, int maxObjs, blockLists_t &blockLists, threadData_t &threadData)
+// Remove an empty block from the partial list so that it can be released.
+// This fails if another thread took the block from the partial list before
+// we got the lock.
+static inline bool ClaimEmptyBlock(memBlock_t *block, uint64_t word, blockLists_t &blockLists)
+{
+	std::lock_guard<decltype(blockLists.lock)> locked(blockLists.lock);
+	if (!block->remoteFree.compare_exchange_strong(word, RemoteWord(0, 0, BLOCK_RELEASED), std::memory_order_acquire, std::memory_order_relaxed))
+		return false;
+	blockLists.partial[block->bin].erase(blockLists.partial[block->bin].iterator_to(*block));
+	blockLists.numPartial.fetch_sub(1, std::memory_order_relaxed);
+	blockLists.numBlocks.fetch_sub(1, std::memory_order_relaxed);
+	return true;
+}
+
+// Push a chain of objects from the same block onto the block's remote free
+// list. The objects must already be linked from first to last.
+static inline void PushRemote(void *base, memBlock_t *block, freeList_t::node_ptr first, freeList_t::node_ptr last, uint32_t count, size_t spanSize, int maxObjs, blockLists_t &blockLists)
+{
+	uint32_t offset = reinterpret_cast<char *>(freeList_t::value_traits::to_value_ptr(first)) - static_cast<char *>(base);
+	uint64_t word = block->remoteFree.load(std::memory_order_relaxed);
+	uint64_t newWord;
+	while (true) {
+		// If the block was full, we need to move it to the partial list.
+		// Nobody else can touch the block until it is in the list, so the
+		// lock is held during the transition.
+		if (RemoteState(word) == BLOCK_FULL) {
+			blockLists.lock.lock();
+			word = block->remoteFree.load(std::memory_order_relaxed);
+			if (RemoteState(word) == BLOCK_FULL) {
+				freeList_t::node_traits::set_next(last, NULL);
+				newWord = RemoteWord(offset, count, BLOCK_PARTIAL);
+				block->remoteFree.store(newWord, std::memory_order_release);
+				block->bin = PartialBin(count, maxObjs);
+				blockLists.partial[block->bin].push_back(*block);
+				blockLists.numPartial.fetch_add(1, std::memory_order_relaxed);
+				blockLists.lock.unlock();
+				break;
+			}
+			blockLists.lock.unlock();
+			continue;
+		}
+
+		if (RemoteCount(word) == 0)
+			freeList_t::node_traits::set_next(last, NULL);
+		else
+			freeList_t::node_traits::set_next(last, freeList_t::value_traits::to_node_ptr(*reinterpret_cast<freeItem_t *>(static_cast<char *>(base) + RemoteOffset(word))));
+		newWord = RemoteWord(offset, RemoteCount(word) + count, RemoteState(word));
+		if (block->remoteFree.compare_exchange_weak(word, newWord, std::memory_order_release, std::memory_order_relaxed))
+			break;
+	}
+
+	// If this emptied a partial block, release the block
+	if (RemoteState(newWord) == BLOCK_PARTIAL && RemoteCount(newWord) == static_cast<uint32_t>(maxObjs) && ClaimEmptyBlock(block, newWord, blockLists)) {
+		block->~memBlock_t();
+		ReleaseBlock(base, spanSize);
+	}
+}
+
+void MemPoolImpl::Free(void *ptr, size_t spanSize, int maxObjs, blockLists_t &blockLists, threadData_t &threadData)
 {
+	MemStats::Add(MemStats::ThreadStats().poolFrees[blockLists.statsIndex]);
+
 	// Get the block this pointer belongs to.
-	void *base = BaseFromPtr(ptr);
-	memBlock_t *block = BlockFromBase(base);
+	void *base = BaseFromPtr(ptr, spanSize);
+	memBlock_t *block = BlockFromBase(base, spanSize);
 
 	// If it belongs to the current thread block, then just send it to our free
 	// list.
+	freeList_t::node_ptr item = freeList_t::value_traits::to_node_ptr(*static_cast<freeItem_t *>(ptr));
 	if (block == threadData.threadBlock) {
-		SList<freeItem_t>::node_ptr item = SList<freeItem_t>::value_traits::to_node_ptr(*static_cast<freeItem_t *>(ptr));
-		SList<freeItem_t>::node_traits::set_next(item, threadData.freeList);
+		freeList_t::node_traits::set_next(item, threadData.freeList);
 		threadData.freeList = item;
 		return;
 	}
 
-	// Lock the block
-	block->lock.Lock();
-
-	// Add to the block's free list
-	block->freeList.push_front(*static_cast<freeItem_t *>(ptr));
-	block->numFree++;
+	// Push the object onto the block's remote free list
+	PushRemote(base, block, item, item, 1, spanSize, maxObjs, blockLists);
+}
 
-	// Do nothing if a thread block
-	if (IsThreadBlock(block)) {
-		block->lock.Unlock();
-		return;
-	}
+void MemPoolImpl::AllocBulk(size_t objSize, size_t spanSize, blockLists_t &blockLists, threadData_t &threadData, void **out, size_t count)
+{
+	size_t i = 0;
+	size_t fastCount = 0;
+	while (i < count) {
+		if (threadData.threadBlock) {
+			// Take a contiguous run from the unused part of the thread block
+			if (threadData.reapStart) {
+				char *reap = static_cast<char *>(threadData.reapStart);
+				char *reapEnd = static_cast<char *>(BaseFromBlock(threadData.threadBlock, spanSize)) + spanSize - sizeof(memBlock_t) - objSize;
+				size_t start = i;
+				for (; i < count && reap <= reapEnd; reap += objSize)
+					out[i++] = reap;
+				threadData.reapStart = reap;
+				fastCount += i - start;
+			}
 
-	// If the block was full, move it back into the partial list
-	if (block->numFree == 1) {
-		blockLists.lock.Lock();
-		blockLists.partial.push_front(*block);
-		block->lock.Unlock();
-		blockLists.lock.Unlock();
-		return;
-	}
+			// Then take the whole thread free list, or as much of it as needed
+			size_t start = i;
+			freeList_t::node_ptr item = threadData.freeList;
+			for (; i < count && item; item = freeList_t::node_traits::get_next(item))
+				out[i++] = freeList_t::value_traits::to_value_ptr(item);
+			threadData.freeList = item;
+			fastCount += i - start;
+			if (i == count)
+				break;
+		}
 
-	// If the block is now empty, release it
-	else if (block->numFree == maxObjs) {
-		blockLists.lock.Lock();
-		blockLists.partial.erase(blockLists.partial.iterator_to(*block));
-		blockLists.lock.Unlock();
-
-		// Free the block to the operating system if the free block list is
-		// full. This check isn't thread-safe but it is OK to have a few
-		// more blocks than MAX_FREE_BLOCKS.
-		if (freeBlockList.Length() >= MAX_FREE_BLOCKS)
-			MemVirtual::FreeBlock(base);
-		else
-			freeBlockList.Push(*reinterpret_cast<freeItem_t *>(base));
-		return;
+		// Go through the slow path to reclaim a remote free list or get a new
+		// block, which refills the thread block for the next iteration
+		out[i++] = Alloc(objSize, spanSize, blockLists, threadData);
 	}
-
-	// Unlock the block
-	block->lock.Unlock();
+	MemStats::Add(MemStats::ThreadStats().poolAllocs[blockLists.statsIndex], fastCount);
 }
 
-void MemPoolImpl::FreeBlock(memBlock_t *block)
+void MemPoolImpl::FreeBulk(void *const *ptrs, size_t count, size_t spanSize, int maxObjs, blockLists_t &blockLists, threadData_t &threadData)
 {
-	if (block)
-		MemVirtual::FreeBlock(BaseFromBlock(block));
+	MemStats::Add(MemStats::ThreadStats().poolFrees[blockLists.statsIndex], count);
+
+	size_t i = 0;
+	while (i < count) {
+		// Link consecutive objects from the same block into a chain, so that
+		// they can be freed together
+		void *base = BaseFromPtr(ptrs[i], spanSize);
+		memBlock_t *block = BlockFromBase(base, spanSize);
+		freeList_t::node_ptr first = freeList_t::value_traits::to_node_ptr(*static_cast<freeItem_t *>(ptrs[i]));
+		freeList_t::node_ptr last = first;
+		uint32_t run = 1;
+		while (i + run < count && BaseFromPtr(ptrs[i + run], spanSize) == base) {
+			freeList_t::node_ptr item = freeList_t::value_traits::to_node_ptr(*static_cast<freeItem_t *>(ptrs[i + run]));
+			freeList_t::node_traits::set_next(last, item);
+			last = item;
+			run++;
+		}
+		i += run;
+
+		if (block == threadData.threadBlock) {
+			freeList_t::node_traits::set_next(last, threadData.freeList);
+			threadData.freeList = first;
+		} else
+			PushRemote(base, block, first, last, run, spanSize, maxObjs, blockLists);
+	}
 }
 
 size_t MemPoolImpl::GetObjSize(void *ptr)
 {
-	memBlock_t *block = BlockFromPtr(ptr);
+	size_t spanSize = MemVirtual::GetSpanBlocks(ptr) * BLOCK_SIZE;
+	memBlock_t *block = BlockFromBase(BaseFromPtr(ptr, spanSize), spanSize);
 	return block->objSize;
 }
+
+int MemPoolImpl::GetCachedBlocks()
+{
+	return freeBlockCount.load(std::memory_order_relaxed);
+}
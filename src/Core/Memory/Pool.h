@@ -11,42 +11,97 @@ namespace MemPoolImpl {
 // Size of a MemPool block
 static const int BLOCK_SIZE = 65536;
 
+// Pools for large objects use spans of several contiguous blocks, aligned to
+// the span size. The span size is a power of 2 number of blocks, chosen so
+// that at least MIN_SPAN_OBJECTS objects fit in a span.
+static const int MAX_SPAN_BLOCKS = 8;
+static const int MIN_SPAN_OBJECTS = 8;
+
 // Empty item containing only a hook for a list
-struct freeItem_t: public SList<freeItem_t>::Hook {};
+typedef intrusive::slist_base_hook<intrusive::link_mode<intrusive::normal_link>> freeHook_t;
+struct freeItem_t: public freeHook_t {};
+typedef intrusive::slist<freeItem_t, intrusive::constant_time_size<false>, intrusive::linear<true>> freeList_t;
 
-// Memory block descriptor. This is always located at the end of a block. The
-// block's next pointer is set to THREAD_BLOCK when it belongs to a thread.
-struct memBlock_t: public List<memBlock_t>::Hook {
-	SList<freeItem_t> freeList;
-	int numFree;
+// Memory block descriptor. This is always located at the end of a block, or
+// at the end of the last block of a span.
+//
+// Objects freed by threads other than the owner of a block are pushed onto
+// the remote free list without taking a lock. The list head is packed in a
+// single word along with the number of items in the list and the block state:
+// - BLOCK_THREAD: the block belongs to a thread, which reclaims the remote
+//   free list in bulk when it runs out of local free objects.
+// - BLOCK_FULL: the block has no free objects and belongs to nobody. The
+//   thread which frees the first object into it moves it to the partial list.
+// - BLOCK_PARTIAL: the block is in the partial list. All objects in it were
+//   allocated when it became full, so it is empty once the remote free list
+//   holds maxObjs items.
+enum blockState_t {
+	BLOCK_THREAD,
+	BLOCK_FULL,
+	BLOCK_PARTIAL,
+	BLOCK_RELEASED
+};
+typedef intrusive::list_base_hook<intrusive::link_mode<intrusive::normal_link>> blockHook_t;
+struct memBlock_t: public blockHook_t {
+	std::atomic<uint64_t> remoteFree;
 	int objSize;
-	Mutex lock;
+	int bin;
 };
+typedef intrusive::list<memBlock_t, intrusive::constant_time_size<false>> blockList_t;
+
+// Partial blocks are kept in bins by the fraction of free objects in them.
+// Bin 0 holds the fullest blocks, which are preferred for allocation so that
+// sparse blocks get a chance to become empty and be released.
+static const int NUM_PARTIAL_BINS = 4;
 
-// Block lists, protected by a lock. The partial list contains blocks which
-// are partially filled.
+// Block lists, protected by a lock. The partial lists contain blocks which
+// are partially filled. The lock is only taken when a block moves between
+// the full, partial and released states or between partial bins, or when a
+// thread needs a new block.
 struct blockLists_t {
-	List<memBlock_t> partial;
-	Mutex lock;
+	blockLists_t(size_t objSize_, size_t spanSize_);
+
+	blockList_t partial[NUM_PARTIAL_BINS];
+	thread::profiled_lock<std::mutex> lock{"blockLists.lock"};
+
+	// Pool information and block counts, for statistics
+	size_t objSize;
+	size_t spanSize;
+	int statsIndex;
+	std::atomic<int> numBlocks{0};
+	std::atomic<int> numPartial{0};
+	std::atomic<int> numThreadBlocks{0};
 };
 
-// Per-thread data for fast lock-less allocation
+// Per-thread data for fast lock-less allocation. This must be a POD type so
+// that it can be used with thread_local.
 struct threadData_t {
 	memBlock_t *threadBlock;
-	SList<freeItem_t>::node_ptr freeList;
+	freeList_t::node_ptr freeList;
 	void *reapStart;
 };
 
+// Get the number of blocks in a span for a given object size
+constexpr int SpanBlocks(size_t objSize, int blocks = 1)
+{
+	return blocks == MAX_SPAN_BLOCKS || (blocks * BLOCK_SIZE - sizeof(memBlock_t)) / objSize >= MIN_SPAN_OBJECTS ? blocks : SpanBlocks(objSize, blocks * 2);
+}
+
 // Actual alloc and free functions
-EXPORT __malloc void *Alloc(size_t objSize, blockLists_t &blockLists, threadData_t &threadData);
-EXPORT void Free(void *ptr, int maxObjs, blockLists_t &blockLists, threadData_t &threadData);
+EXPORT __malloc void *Alloc(size_t objSize, size_t spanSize, blockLists_t &blockLists, threadData_t &threadData);
+EXPORT void Free(void *ptr, size_t spanSize, int maxObjs, blockLists_t &blockLists, threadData_t &threadData);
 
-// Helper function for freeing a whole block, for module unloading
-EXPORT void FreeBlock(memBlock_t *block);
+// Bulk versions, which take runs of objects from the thread block and its free
+// list at once, and free runs of objects from the same block together
+EXPORT void AllocBulk(size_t objSize, size_t spanSize, blockLists_t &blockLists, threadData_t &threadData, void **out, size_t count);
+EXPORT void FreeBulk(void *const *ptrs, size_t count, size_t spanSize, int maxObjs, blockLists_t &blockLists, threadData_t &threadData);
 
 // Helper function for the general allocator, retrieves objSize from a pointer
 size_t GetObjSize(void *ptr);
 
+// Get the number of blocks kept in the free block lists
+int GetCachedBlocks();
+
 }
 
 // MemPool class
@@ -55,25 +110,7 @@ public:
 	// Allocate a single object from the pool
 	static __malloc void *Alloc()
 	{
-#if BUILD_MODULE && _WIN32
-		MemPoolImpl::threadData_t *threadDataPtr = threadDataTLS.Get();
-		if (!threadDataPtr) {
-			threadDataPtr = new(malloc(sizeof(MemPoolImpl::threadData_t))) MemPoolImpl::threadData_t;
-			threadDataPtr->threadBlock = NULL;
-			threadDataPtr->freeList = NULL;
-			threadDataTLS.Set(threadDataPtr);
-			moduleData.data[AtomicIncrement(&moduleData.count)] = threadDataPtr;
-		}
-
-		MemPoolImpl::threadData_t &threadData = *threadDataPtr;
-#elif BUILD_MODULE
-		// Register thread data. Check threadBlock since it can only be NULL on
-		// the first allocation.
-		if (!threadData.threadBlock)
-			moduleData.data[AtomicIncrement(&moduleData.count)] = &threadData;
-#endif
-
-		return MemPoolImpl::Alloc(objSize, blockLists, threadData);
+		return MemPoolImpl::Alloc(objSize, spanSize, blockLists, threadData);
 	}
 
 	// Free a single object back to the pool
@@ -83,76 +120,42 @@ public:
 		if (!ptr)
 			return;
 
-#if BUILD_MODULE && _WIN32
-		MemPoolImpl::threadData_t *threadDataPtr = threadDataTLS.Get();
-		if (!threadDataPtr) {
-			threadDataPtr = new(malloc(sizeof(MemPoolImpl::threadData_t))) MemPoolImpl::threadData_t;
-			threadDataPtr->threadBlock = NULL;
-			threadDataPtr->freeList = NULL;
-			threadDataPtr->reapStart = NULL;
-			threadDataTLS.Set(threadDataPtr);
-			moduleData.data[AtomicIncrement(&moduleData.count)] = threadDataPtr;
-		}
+		MemPoolImpl::Free(ptr, spanSize, maxObjs, blockLists, threadData);
+	}
 
-		MemPoolImpl::threadData_t &threadData = *threadDataPtr;
-#endif
+	// Allocate count objects into an array
+	static void AllocBulk(void **out, size_t count)
+	{
+		MemPoolImpl::AllocBulk(objSize, spanSize, blockLists, threadData, out, count);
+	}
 
-		MemPoolImpl::Free(ptr, maxObjs, blockLists, threadData);
+	// Free an array of objects, none of which may be NULL. Freeing objects in
+	// the order they were allocated is fastest, since neighbouring objects
+	// from the same block are freed together.
+	static void FreeBulk(void *const *ptrs, size_t count)
+	{
+		MemPoolImpl::FreeBulk(ptrs, count, spanSize, maxObjs, blockLists, threadData);
 	}
 
 private:
 	static MemPoolImpl::blockLists_t blockLists;
-#if BUILD_MODULE && _WIN32
-	static ThreadLocal<MemPoolImpl::threadData_t *> threadDataTLS;
-#else
-	static __thread MemPoolImpl::threadData_t threadData;
-#endif
+	static thread_local MemPoolImpl::threadData_t threadData;
 
-	// Number of objects that can fit in one block
-	static const int maxObjs = (MemPoolImpl::BLOCK_SIZE - sizeof(MemPoolImpl::memBlock_t)) / objSize;
+	// Size of the blocks used by this pool, and the number of objects that
+	// can fit in one
+	static const size_t spanSize = MemPoolImpl::SpanBlocks(objSize) * MemPoolImpl::BLOCK_SIZE;
+	static const int maxObjs = (spanSize - sizeof(MemPoolImpl::memBlock_t)) / objSize;
 
 	// Make sure objSize is large enough to contain at least one pointer
-	StaticAssert(objSize >= sizeof(void *));
+	static_assert(objSize >= sizeof(void *), "MemPool objects must be able to hold a pointer");
 
 	// Make sure we can fit at least 3 objects in a block
-	StaticAssert(maxObjs >= 3);
-
-#ifdef BUILD_MODULE
-	// For modules, we register all threadData so that thread blocks can be
-	// freed when the module is unloaded. Note that this means that memory pools
-	// can't be used in static object destructors.
-	struct moduleData_t {
-		// Initialized to 0 by static initialization
-		MemPoolImpl::threadData_t *data[MAX_REAL_THREADS];
-		atomic_t count;
-
-		// Release all thread blocks when the module is unloaded
-		~moduleData_t()
-		{
-			for (int i = 0; i < count; i++) {
-				if (data[i]) {
-					FreeBlock(data[i]->threadBlock);
-#ifdef _WIN32
-					free(data[i]);
-#endif
-				}
-			}
-		}
-	};
-	static moduleData_t moduleData;
-#endif
+	static_assert(maxObjs >= 3, "MemPool objects are too large for a block");
 };
 
 // Static member definitions
-template<size_t objSize> MemPoolImpl::blockLists_t MemPool<objSize>::blockLists;
-#ifdef BUILD_MODULE
-template<size_t objSize> typename MemPool<objSize>::moduleData_t MemPool<objSize>::moduleData;
-#endif
-#if BUILD_MODULE && _WIN32
-template<size_t objSize> ThreadLocal<MemPoolImpl::threadData_t *> MemPool<objSize>::threadDataTLS;
-#else
-template<size_t objSize> __thread MemPoolImpl::threadData_t MemPool<objSize>::threadData = {NULL, NULL, NULL};
-#endif
+template<size_t objSize> MemPoolImpl::blockLists_t MemPool<objSize>::blockLists(objSize, spanSize);
+template<size_t objSize> thread_local MemPoolImpl::threadData_t MemPool<objSize>::threadData = {NULL, NULL, NULL};
 
 #else
 
@@ -168,7 +171,17 @@ public:
 	}
 	static void Free(void *ptr)
 	{
-		MemFree(ptr);
+		MemFree(ptr, objSize);
+	}
+	static void AllocBulk(void **out, size_t count)
+	{
+		for (size_t i = 0; i < count; i++)
+			out[i] = MemAlloc(objSize);
+	}
+	static void FreeBulk(void *const *ptrs, size_t count)
+	{
+		for (size_t i = 0; i < count; i++)
+			MemFree(ptrs[i], objSize);
 	}
 };
 
@@ -179,13 +192,156 @@ template<typename T> class UseMemPool {
 public:
 	__malloc void *operator new(size_t size)
 	{
-		UNUSED(size);
-		Assert(size == sizeof(T));
-		return MemPool<sizeof(T)>::Alloc();
+		if (size == sizeof(T))
+			return MemPool<sizeof(T)>::Alloc();
+		else
+			return MemAlloc(size);
+	}
+
+	// Sized delete, which also works when deleting a derived class through
+	// a pointer to T, provided the destructor is virtual.
+	void operator delete(void *ptr, size_t size)
+	{
+		if (size == sizeof(T))
+			MemPool<sizeof(T)>::Free(ptr);
+		else
+			MemFree(ptr, size);
+	}
+};
+
+// Pool of objects of type T which can allocate and free many objects at once,
+// for objects which are created and destroyed in large numbers every frame.
+// Objects share the MemPool for their size. In debug builds, each object has
+// a generation counter which is incremented when it is freed, so that handles
+// to freed objects can be detected.
+template<typename T> class ObjectPool {
+public:
+	// Reference to an object which can be checked in debug builds
+	struct handle_t {
+		T *ptr;
+#ifdef DEBUG
+		uint32_t generation;
+#endif
+	};
+
+	// Allocate and free uninitialized memory for a single object
+	static __malloc T *Alloc()
+	{
+		return FromSlot(pool_t::Alloc());
+	}
+	static void Free(T *ptr)
+	{
+		if (ptr)
+			pool_t::Free(ToSlot(ptr));
 	}
 
-	void operator delete(void *ptr)
+	// Construct and destroy a single object
+	template<typename... Args> static T *New(Args&&... args)
 	{
-		MemPool<sizeof(T)>::Free(ptr);
+		return ::new(Alloc()) T(std::forward<Args>(args)...);
+	}
+	static void Delete(T *ptr)
+	{
+		if (ptr) {
+			ptr->~T();
+			Free(ptr);
+		}
+	}
+
+	// Allocate uninitialized memory for count objects. The objects must be
+	// constructed by the caller.
+	static void AllocateBulk(size_t count, T **out)
+	{
+		void **slots = reinterpret_cast<void **>(out);
+		pool_t::AllocBulk(slots, count);
+		if (HEADER_SIZE) {
+			for (size_t i = 0; i < count; i++)
+				out[i] = FromSlot(slots[i]);
+		}
+	}
+
+	// Free count objects, which must already have been destroyed
+	static void FreeBulk(T *const *ptrs, size_t count)
+	{
+		if (!HEADER_SIZE) {
+			pool_t::FreeBulk(reinterpret_cast<void *const *>(ptrs), count);
+			return;
+		}
+		const size_t BATCH = 256;
+		void *slots[BATCH];
+		for (size_t i = 0; i < count; i += BATCH) {
+			size_t n = std::min(count - i, BATCH);
+			for (size_t j = 0; j < n; j++)
+				slots[j] = ToSlot(ptrs[i + j]);
+			pool_t::FreeBulk(slots, n);
+		}
+	}
+	static void FreeBulk(const std::vector<T *> &ptrs)
+	{
+		FreeBulk(ptrs.data(), ptrs.size());
+	}
+
+	// Get a handle to a live object
+	static handle_t GetHandle(T *ptr)
+	{
+#ifdef DEBUG
+		return {ptr, Header(ptr)->generation};
+#else
+		return {ptr};
+#endif
+	}
+
+	// Check whether the object a handle refers to is still alive. This always
+	// returns true in release builds. It can also return true if the memory
+	// has been used by someone else since, since the size class is shared.
+#ifdef DEBUG
+	static bool IsValid(const handle_t &handle)
+	{
+		return Header(handle.ptr)->generation == handle.generation;
+	}
+#else
+	static bool IsValid(const handle_t &)
+	{
+		return true;
+	}
+#endif
+
+	// Get the object a handle refers to, which must still be alive
+	static T *Get(const handle_t &handle)
+	{
+		AssertMsg(IsValid(handle), "Stale ObjectPool handle");
+		return handle.ptr;
+	}
+
+private:
+	// In debug builds, each object is preceded by a header. The first word of
+	// the slot is used for the free list link, so the generation goes after
+	// it to survive being freed.
+	struct header_t {
+		void *link;
+		uint32_t generation;
+	};
+#ifdef DEBUG
+	static const size_t HEADER_SIZE = PAD(sizeof(header_t), 16);
+#else
+	static const size_t HEADER_SIZE = 0;
+#endif
+	typedef MemPool<PAD(sizeof(T) + HEADER_SIZE, 8)> pool_t;
+	static_assert(std::alignment_of<T>::value <= 16, "ObjectPool objects can't need more than 16 byte alignment");
+
+	static header_t *Header(T *ptr)
+	{
+		return reinterpret_cast<header_t *>(reinterpret_cast<char *>(ptr) - HEADER_SIZE);
+	}
+	static T *FromSlot(void *slot)
+	{
+		return reinterpret_cast<T *>(static_cast<char *>(slot) + HEADER_SIZE);
+	}
+	static void *ToSlot(T *ptr)
+	{
+#ifdef DEBUG
+		Header(ptr)->generation++;
+#endif
+		return reinterpret_cast<char *>(ptr) - HEADER_SIZE;
 	}
 };
@@ -0,0 +1,275 @@
+//@@COPYRIGHT@@
+
+#ifndef _WIN32
+#include <execinfo.h>
+#include <dlfcn.h>
+#include <cxxabi.h>
+#endif
+
+// Maximum number of frames recorded for each sample
+#define MAX_FRAMES 32
+
+// Amount of memory a thread allocates between checks of whether the profiler
+// has been started
+#define RECHECK_BYTES (1024 * 1024)
+
+// Number of counters in the filter of sampled addresses
+#define FILTER_SIZE 16384
+
+thread_local intptr_t MemProfiler::bytesUntilSample = 0;
+std::atomic<bool> MemProfiler::trackFrees{false};
+
+// Mean sampling interval in bytes, or 0 if the profiler is stopped
+static std::atomic<size_t> sampleInterval{0};
+
+// Set while the current thread is inside the profiler, so that allocations
+// made by the profiler itself are not sampled
+static thread_local bool inProfiler = false;
+
+// Random number generator state for the current thread
+static thread_local uint32_t randomState = 0;
+
+// Live samples for each call stack
+typedef std::vector<void *> callStack_t;
+struct stackStats_t {
+	size_t liveBytes;
+	int liveSamples;
+};
+typedef std::map<callStack_t, stackStats_t> stackTable_t;
+static stackTable_t stackTable;
+
+// Live sampled allocations, with the number of bytes each one stands for
+struct sample_t {
+	size_t weight;
+	stackTable_t::iterator stack;
+};
+static std::unordered_map<void *, sample_t> sampleTable;
+
+// Mutex protecting the tables. This isn't a profiled_lock since the lock
+// profiler may allocate memory.
+static std::mutex profilerLock;
+
+// Counting filter of addresses which may have been sampled, so that most
+// frees can be rejected without taking the lock. The counters are only
+// modified with the lock held. Since pools reuse the same addresses over and
+// over, entries must be removed when samples are freed, otherwise after a
+// while most frees would go through the slow path.
+static std::atomic<uint16_t> sampleFilter[FILTER_SIZE];
+
+static inline std::atomic<uint16_t> &FilterEntry(void *ptr)
+{
+	uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
+	return sampleFilter[((addr >> 4) ^ (addr >> 18)) & (FILTER_SIZE - 1)];
+}
+static inline void FilterAdd(void *ptr, int count)
+{
+	std::atomic<uint16_t> &entry = FilterEntry(ptr);
+	entry.store(entry.load(std::memory_order_relaxed) + count, std::memory_order_relaxed);
+}
+
+// Get the number of bytes until the next sample. This follows an exponential
+// distribution, so that samples are taken at random points in the stream of
+// allocated bytes rather than every interval bytes.
+static intptr_t NextSampleDistance(size_t interval)
+{
+	if (!randomState)
+		randomState = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(&randomState) >> 4) | 1;
+	randomState ^= randomState << 13;
+	randomState ^= randomState >> 17;
+	randomState ^= randomState << 5;
+	double u = ((randomState >> 8) + 1) / 16777217.0;
+	return static_cast<intptr_t>(-log(u) * interval) + 1;
+}
+
+// Clear all samples, the lock must be held
+static void ClearSamples()
+{
+	sampleTable.clear();
+	stackTable.clear();
+	for (std::atomic<uint16_t> &i: sampleFilter)
+		i.store(0, std::memory_order_relaxed);
+}
+
+// Capture the call stack of the caller of SampleAlloc
+static int CaptureStack(void **frames)
+{
+#ifdef _WIN32
+	return CaptureStackBackTrace(2, MAX_FRAMES, frames, NULL);
+#else
+	void *buffer[MAX_FRAMES + 2];
+	int depth = backtrace(buffer, MAX_FRAMES + 2);
+	depth = std::max(depth - 2, 0);
+	std::copy(buffer + 2, buffer + 2 + depth, frames);
+	return depth;
+#endif
+}
+
+// Get a readable name for a code address
+static std::string Symbolize(void *addr)
+{
+#ifndef _WIN32
+	Dl_info info;
+	if (dladdr(addr, &info)) {
+		if (info.dli_sname) {
+			int status;
+			char *demangled = abi::__cxa_demangle(info.dli_sname, NULL, NULL, &status);
+			std::string name = status == 0 ? demangled : info.dli_sname;
+			free(demangled);
+			std::replace(name.begin(), name.end(), ';', ':');
+			return name;
+		}
+		if (info.dli_fname) {
+			const char *module = strrchr(info.dli_fname, '/');
+			return va("%s+0x%x", module ? module + 1 : info.dli_fname, static_cast<char *>(addr) - static_cast<char *>(info.dli_fbase));
+		}
+	}
+#endif
+	return va("0x%x", reinterpret_cast<uintptr_t>(addr));
+}
+
+void MemProfiler::SampleAlloc(void *ptr, size_t size)
+{
+	size_t interval = sampleInterval.load(std::memory_order_relaxed);
+	if (!interval || inProfiler) {
+		bytesUntilSample = interval ? NextSampleDistance(interval) : RECHECK_BYTES;
+		return;
+	}
+	bytesUntilSample = NextSampleDistance(interval);
+
+	inProfiler = true;
+	void *frames[MAX_FRAMES];
+	int depth = CaptureStack(frames);
+
+	// An allocation of this size is sampled with probability
+	// 1 - exp(-size / interval), so each sample stands for the inverse of
+	// that many bytes.
+	size_t weight = size / -expm1(-static_cast<double>(size) / interval);
+
+	{
+		std::lock_guard<std::mutex> locked(profilerLock);
+		sample_t &sample = sampleTable[ptr];
+		if (sample.weight) {
+			// The address was reused without us seeing the free
+			sample.stack->second.liveBytes -= sample.weight;
+			if (--sample.stack->second.liveSamples == 0)
+				stackTable.erase(sample.stack);
+		} else
+			FilterAdd(ptr, 1);
+		auto stack = stackTable.emplace(callStack_t(frames, frames + depth), stackStats_t{0, 0}).first;
+		stack->second.liveBytes += weight;
+		stack->second.liveSamples++;
+		sample = sample_t{weight, stack};
+	}
+	inProfiler = false;
+}
+
+void MemProfiler::RecordFree(void *ptr)
+{
+	if (inProfiler || !FilterEntry(ptr).load(std::memory_order_relaxed))
+		return;
+
+	inProfiler = true;
+	{
+		std::lock_guard<std::mutex> locked(profilerLock);
+		auto i = sampleTable.find(ptr);
+		if (i != sampleTable.end()) {
+			auto stack = i->second.stack;
+			stack->second.liveBytes -= i->second.weight;
+			if (--stack->second.liveSamples == 0)
+				stackTable.erase(stack);
+			sampleTable.erase(i);
+			FilterAdd(ptr, -1);
+			if (sampleTable.empty() && !sampleInterval.load(std::memory_order_relaxed))
+				trackFrees = false;
+		}
+	}
+	inProfiler = false;
+}
+
+void MemProfiler::Start(size_t interval)
+{
+	Assert((interval));
+	inProfiler = true;
+
+	// The first backtrace loads the unwinder, so get that out of the way now
+	// rather than in the middle of an allocation
+	void *frames[MAX_FRAMES];
+	CaptureStack(frames);
+
+	{
+		std::lock_guard<std::mutex> locked(profilerLock);
+		ClearSamples();
+		trackFrees = true;
+		sampleInterval = interval;
+	}
+	inProfiler = false;
+	bytesUntilSample = NextSampleDistance(interval);
+}
+
+void MemProfiler::Stop()
+{
+	inProfiler = true;
+	{
+		std::lock_guard<std::mutex> locked(profilerLock);
+		sampleInterval = 0;
+		trackFrees = !sampleTable.empty();
+	}
+	inProfiler = false;
+}
+
+void MemProfiler::Reset()
+{
+	inProfiler = true;
+	{
+		std::lock_guard<std::mutex> locked(profilerLock);
+		ClearSamples();
+		trackFrees = sampleInterval != 0;
+	}
+	inProfiler = false;
+}
+
+bool MemProfiler::IsRunning()
+{
+	return sampleInterval.load(std::memory_order_relaxed) != 0;
+}
+
+size_t MemProfiler::GetLiveBytes()
+{
+	size_t total = 0;
+	inProfiler = true;
+	{
+		std::lock_guard<std::mutex> locked(profilerLock);
+		for (auto &i: stackTable)
+			total += i.second.liveBytes;
+	}
+	inProfiler = false;
+	return total;
+}
+
+std::string MemProfiler::FormatCollapsed()
+{
+	// Copy the stacks so that symbols can be looked up without the lock
+	std::vector<std::pair<callStack_t, size_t>> stacks;
+	inProfiler = true;
+	{
+		std::lock_guard<std::mutex> locked(profilerLock);
+		for (auto &i: stackTable)
+			stacks.emplace_back(i.first, i.second.liveBytes);
+	}
+	inProfiler = false;
+
+	std::unordered_map<void *, std::string> symbols;
+	std::string out;
+	for (auto &i: stacks) {
+		for (auto frame = i.first.rbegin(); frame != i.first.rend(); ++frame) {
+			auto symbol = symbols.find(*frame);
+			if (symbol == symbols.end())
+				symbol = symbols.emplace(*frame, Symbolize(*frame)).first;
+			if (frame != i.first.rbegin())
+				out += ';';
+			out += symbol->second;
+		}
+		out += va(" %d\n", i.second);
+	}
+	return out;
+}
@@ -0,0 +1,51 @@
+//@@COPYRIGHT@@
+
+// Sampling heap profiler. Roughly one allocation is sampled for every
+// interval bytes allocated, and the call stack of each live sample is
+// recorded so that memory usage can be attributed to the code allocating it.
+
+namespace MemProfiler {
+
+// Number of bytes the current thread can allocate before the next sample.
+// When the profiler is stopped this is used to check periodically whether it
+// has been started.
+extern thread_local intptr_t bytesUntilSample;
+
+// Set while frees need to be checked against the sampled allocations
+extern std::atomic<bool> trackFrees;
+
+// Slow paths of the hooks below
+EXPORT void SampleAlloc(void *ptr, size_t size);
+EXPORT void RecordFree(void *ptr);
+
+// Hooks called by MemAlloc and MemFree
+inline void OnAlloc(void *ptr, size_t size)
+{
+	if (__builtin_expect((bytesUntilSample -= size) < 0, 0))
+		SampleAlloc(ptr, size);
+}
+inline void OnFree(void *ptr)
+{
+	if (__builtin_expect(trackFrees.load(std::memory_order_relaxed), 0))
+		RecordFree(ptr);
+}
+
+// Start sampling with the given mean interval in bytes, discarding any
+// previous samples. Other threads start sampling after their next slow path
+// check, which happens at least once per megabyte allocated.
+EXPORT void Start(size_t interval);
+
+// Stop taking new samples. Live samples are still tracked until Reset.
+EXPORT void Stop();
+EXPORT void Reset();
+EXPORT bool IsRunning();
+
+// Get the estimated number of live bytes in sampled allocations
+EXPORT size_t GetLiveBytes();
+
+// Format the live samples in collapsed stack format, with one line per call
+// stack, frames from the outermost one separated by semicolons, followed by
+// the estimated live bytes. This can be used as input to flamegraph.pl.
+EXPORT std::string FormatCollapsed();
+
+}
@@ -0,0 +1,194 @@
+//@@COPYRIGHT@@
+
+// Polymorphic memory resources, which allow standard containers to allocate
+// from arenas. This follows the interface of std::pmr from C++17.
+
+namespace pmr {
+
+// Abstract interface for a source of memory
+class memory_resource {
+public:
+	virtual ~memory_resource() {}
+
+	// Allocate and free memory. Alignment must be a power of 2.
+	__malloc void *allocate(size_t bytes, size_t alignment = DEFAULT_MEMORY_ALIGNMENT)
+	{
+		return do_allocate(bytes, alignment);
+	}
+	void deallocate(void *ptr, size_t bytes, size_t alignment = DEFAULT_MEMORY_ALIGNMENT)
+	{
+		do_deallocate(ptr, bytes, alignment);
+	}
+
+	// Check if memory allocated from one resource can be freed by another
+	bool is_equal(const memory_resource &other) const noexcept
+	{
+		return do_is_equal(other);
+	}
+
+private:
+	virtual void *do_allocate(size_t bytes, size_t alignment) = 0;
+	virtual void do_deallocate(void *ptr, size_t bytes, size_t alignment) = 0;
+	virtual bool do_is_equal(const memory_resource &other) const noexcept = 0;
+};
+
+inline bool operator==(const memory_resource &a, const memory_resource &b) noexcept
+{
+	return &a == &b || a.is_equal(b);
+}
+inline bool operator!=(const memory_resource &a, const memory_resource &b) noexcept
+{
+	return !(a == b);
+}
+
+// Resource using the MemPool size classes through MemAlloc and MemFree. This
+// is the default resource, and all instances are equivalent.
+class pool_resource: public memory_resource {
+private:
+	void *do_allocate(size_t bytes, size_t alignment) override
+	{
+		return alignment > DEFAULT_MEMORY_ALIGNMENT ? MemAllocAligned(bytes, alignment) : MemAlloc(bytes);
+	}
+	void do_deallocate(void *ptr, size_t bytes, size_t alignment) override
+	{
+		if (alignment > DEFAULT_MEMORY_ALIGNMENT)
+			MemFree(ptr);
+		else
+			MemFree(ptr, bytes);
+	}
+	bool do_is_equal(const memory_resource &other) const noexcept override
+	{
+		return dynamic_cast<const pool_resource *>(&other) != nullptr;
+	}
+};
+
+// Get the default resource, which is a pool_resource
+EXPORT memory_resource *get_default_resource();
+
+// Resource allocating from an arena. Deallocation does nothing, the memory is
+// only freed when the arena itself is reset or rewound. This works with
+// MemArena, MemArenaFixed, MemArenaConcurrent and MemFrameArena.
+template<typename Arena> class arena_resource: public memory_resource {
+public:
+	explicit arena_resource(Arena &arena)
+		: arena(arena) {}
+
+	// Get the underlying arena
+	Arena &get_arena() const
+	{
+		return arena;
+	}
+
+private:
+	Arena &arena;
+
+	void *do_allocate(size_t bytes, size_t alignment) override
+	{
+		void *ptr = arena.Alloc(bytes, std::max<size_t>(alignment, 1));
+		if (!ptr)
+			throw std::bad_alloc();
+		return ptr;
+	}
+	void do_deallocate(void *, size_t, size_t) override {}
+	bool do_is_equal(const memory_resource &other) const noexcept override
+	{
+		return this == &other;
+	}
+};
+
+// Make an arena_resource for an arena
+template<typename Arena> inline arena_resource<Arena> make_arena_resource(Arena &arena)
+{
+	return arena_resource<Arena>(arena);
+}
+
+// Allocator which forwards to a memory_resource, for use with the standard
+// containers. Copies of a container use the default resource.
+template<typename T> class polymorphic_allocator {
+public:
+	typedef T value_type;
+
+	// Constructors
+	polymorphic_allocator() noexcept
+		: resource(get_default_resource()) {}
+	polymorphic_allocator(memory_resource *resource) noexcept
+		: resource(resource) {}
+	template<typename U> polymorphic_allocator(const polymorphic_allocator<U> &other) noexcept
+		: resource(other.get_resource()) {}
+
+	// Allocate and free memory
+	T *allocate(size_t n)
+	{
+		return static_cast<T *>(resource->allocate(n * sizeof(T), std::alignment_of<T>::value));
+	}
+	void deallocate(T *ptr, size_t n)
+	{
+		resource->deallocate(ptr, n * sizeof(T), std::alignment_of<T>::value);
+	}
+
+	// Construct an object, passing this allocator on to it if it uses
+	// allocators itself, so that nested containers use the same resource.
+	// Unlike std::pmr, this isn't done for the members of std::pair.
+	template<typename U, typename... Args> void construct(U *ptr, Args&&... args)
+	{
+		typedef std::integral_constant<bool, std::uses_allocator<U, polymorphic_allocator>::value && std::is_constructible<U, Args..., polymorphic_allocator>::value> usesAllocator;
+		ConstructImpl(usesAllocator(), ptr, std::forward<Args>(args)...);
+	}
+
+	// Containers copied from this one use the default resource
+	polymorphic_allocator select_on_container_copy_construction() const
+	{
+		return polymorphic_allocator();
+	}
+
+	memory_resource *get_resource() const
+	{
+		return resource;
+	}
+
+private:
+	memory_resource *resource;
+
+	template<typename U, typename... Args> void ConstructImpl(std::true_type, U *ptr, Args&&... args)
+	{
+		new(ptr) U(std::forward<Args>(args)..., *this);
+	}
+	template<typename U, typename... Args> void ConstructImpl(std::false_type, U *ptr, Args&&... args)
+	{
+		new(ptr) U(std::forward<Args>(args)...);
+	}
+};
+
+template<typename T, typename U> inline bool operator==(const polymorphic_allocator<T> &a, const polymorphic_allocator<U> &b) noexcept
+{
+	return *a.get_resource() == *b.get_resource();
+}
+template<typename T, typename U> inline bool operator!=(const polymorphic_allocator<T> &a, const polymorphic_allocator<U> &b) noexcept
+{
+	return !(a == b);
+}
+
+// Standard containers using polymorphic allocators
+template<typename T> using vector = std::vector<T, polymorphic_allocator<T>>;
+typedef std::basic_string<char, std::char_traits<char>, polymorphic_allocator<char>> string;
+template<typename Key, typename T, typename Hash = std::hash<Key>, typename Pred = std::equal_to<Key>>
+using unordered_map = std::unordered_map<Key, T, Hash, Pred, polymorphic_allocator<std::pair<const Key, T>>>;
+
+}
+
+// Hash function for pmr::string, since std::hash is only defined for strings
+// using the default allocator
+namespace std {
+template<> struct hash<pmr::string> {
+	size_t operator()(const pmr::string &str) const noexcept
+	{
+		// FNV-1a
+		size_t hash = sizeof(size_t) == 8 ? 14695981039346656037ull : 2166136261u;
+		for (char c: str) {
+			hash ^= static_cast<unsigned char>(c);
+			hash *= sizeof(size_t) == 8 ? 1099511628211ull : 16777619u;
+		}
+		return hash;
+	}
+};
+}
@@ -0,0 +1,179 @@
+//@@COPYRIGHT@@
+
+thread_local MemStats::threadStats_t *MemStats::currentThreadStats = NULL;
+
+// List of all thread records
+static std::atomic<MemStats::threadStats_t *> threadList{NULL};
+
+// List of all pools. These are registered by global constructors, so the
+// table must not need any dynamic initialization.
+static MemPoolImpl::blockLists_t *poolList[MemStats::MAX_POOLS];
+static std::atomic<int> numPools{0};
+
+MemStats::threadStats_t &MemStats::RegisterThread()
+{
+	// The record is allocated with calloc since it is needed by MemAlloc
+	threadStats_t *stats = static_cast<threadStats_t *>(calloc(1, sizeof(threadStats_t)));
+	if (!stats)
+		FatalError("Out of memory (Tried to allocate %d bytes)", sizeof(threadStats_t));
+	stats->next = threadList.load(std::memory_order_relaxed);
+	while (!threadList.compare_exchange_weak(stats->next, stats, std::memory_order_release, std::memory_order_relaxed)) {}
+	currentThreadStats = stats;
+	return *stats;
+}
+
+int MemStats::RegisterPool(MemPoolImpl::blockLists_t *pool)
+{
+	int index = numPools.fetch_add(1, std::memory_order_relaxed);
+	if (index >= MAX_POOLS)
+		return MAX_POOLS - 1;
+	poolList[index] = pool;
+	return index;
+}
+
+MemStats::heapStats_t MemStats::GetHeapStats()
+{
+	heapStats_t stats = heapStats_t();
+	int count = std::min(numPools.load(std::memory_order_relaxed), MAX_POOLS);
+	stats.pools.resize(count);
+	for (int i = 0; i < count; i++) {
+		MemPoolImpl::blockLists_t *pool = poolList[i];
+		poolStats_t &out = stats.pools[i];
+		out.objSize = pool->objSize;
+		out.spanSize = pool->spanSize;
+		out.blocks = pool->numBlocks.load(std::memory_order_relaxed);
+		out.partialBlocks = pool->numPartial.load(std::memory_order_relaxed);
+		out.threadBlocks = pool->numThreadBlocks.load(std::memory_order_relaxed);
+	}
+
+	// Sum the per-thread counters
+	for (threadStats_t *thread = threadList.load(std::memory_order_acquire); thread; thread = thread->next) {
+		for (int i = 0; i < count; i++) {
+			stats.pools[i].allocs += thread->poolAllocs[i].load(std::memory_order_relaxed);
+			stats.pools[i].frees += thread->poolFrees[i].load(std::memory_order_relaxed);
+		}
+		stats.sysAllocs += thread->sysAllocs.load(std::memory_order_relaxed);
+		stats.sysFrees += thread->sysFrees.load(std::memory_order_relaxed);
+		stats.sysLiveBytes += thread->sysAllocBytes.load(std::memory_order_relaxed) - thread->sysFreeBytes.load(std::memory_order_relaxed);
+		for (int i = 0; i < NUM_MEMTAGS; i++)
+			stats.tagLiveBytes[i] += thread->tagAllocBytes[i].load(std::memory_order_relaxed) - thread->tagFreeBytes[i].load(std::memory_order_relaxed);
+	}
+	for (poolStats_t &i: stats.pools)
+		i.liveObjects = i.allocs - i.frees;
+
+	// General memory isn't tracked, so work it out from the total
+	int64_t generalBytes = stats.sysLiveBytes;
+	for (poolStats_t &i: stats.pools)
+		generalBytes += i.liveObjects * i.objSize;
+	for (int i = 1; i < NUM_MEMTAGS; i++)
+		generalBytes -= stats.tagLiveBytes[i];
+	stats.tagLiveBytes[MEMTAG_GENERAL] = std::max<int64_t>(generalBytes, 0);
+
+	stats.reservedBytes = MemVirtual::GetReservedBytes();
+	stats.committedBytes = MemVirtual::GetCommittedBytes();
+	stats.decayingBytes = MemVirtual::GetDecayingBytes();
+	stats.cachedBlocks = MemPoolImpl::GetCachedBlocks();
+	return stats;
+}
+
+std::string MemStats::FormatJSON(const heapStats_t &stats)
+{
+	std::string out = va("{\"reserved\":%d,\"committed\":%d,\"decaying\":%d,\"cachedBlocks\":%d,\"sysAllocs\":%d,\"sysFrees\":%d,\"sysLiveBytes\":%d,\"pools\":[",
+	                     stats.reservedBytes, stats.committedBytes, stats.decayingBytes, stats.cachedBlocks, stats.sysAllocs, stats.sysFrees, stats.sysLiveBytes);
+	for (size_t i = 0; i < stats.pools.size(); i++) {
+		const poolStats_t &pool = stats.pools[i];
+		out += va("%s{\"objSize\":%d,\"spanSize\":%d,\"allocs\":%d,\"frees\":%d,\"live\":%d,\"blocks\":%d,\"partial\":%d,\"thread\":%d}",
+		          i ? "," : "", pool.objSize, pool.spanSize, pool.allocs, pool.frees, pool.liveObjects, pool.blocks, pool.partialBlocks, pool.threadBlocks);
+	}
+	out += "],\"tags\":{";
+	for (int i = 0; i < NUM_MEMTAGS; i++)
+		out += va("%s\"%s\":%d", i ? "," : "", MemTag::GetName(static_cast<memTag_t>(i)), stats.tagLiveBytes[i]);
+	out += "}}";
+	return out;
+}
+
+// The unit tests don't have a console
+#ifndef BUILD_TEST
+
+// Meminfo command
+static void MemInfo_f(CmdArgs *args)
+{
+	// Command help
+	if (!args) {
+		Printf("usage: meminfo [json]");
+		Printf("Shows memory allocator statistics, optionally as JSON.");
+		return;
+	}
+
+	MemStats::heapStats_t stats = MemStats::GetHeapStats();
+	if (args->Argc() >= 2 && !strcmp(args->Argv(1), "json")) {
+		Printf(MemStats::FormatJSON(stats));
+		return;
+	}
+
+	Printf("%8s %8s %10s %10s %8s %8s %8s %10s", "size", "span", "live", "allocs", "blocks", "partial", "thread", "usage");
+	for (const MemStats::poolStats_t &pool: stats.pools) {
+		if (!pool.allocs)
+			continue;
+		size_t blockBytes = pool.blocks * pool.spanSize;
+		Printf("%8d %7dK %10d %10d %8d %8d %8d %9.1f%%", pool.objSize, pool.spanSize / 1024, pool.liveObjects, pool.allocs,
+		       pool.blocks, pool.partialBlocks, pool.threadBlocks, blockBytes ? 100.0 * pool.liveObjects * pool.objSize / blockBytes : 0.0);
+	}
+	Printf("Pool heap: %dKB committed (%dKB decaying), %dKB reserved, %d cached free blocks", stats.committedBytes / 1024, stats.decayingBytes / 1024, stats.reservedBytes / 1024, stats.cachedBlocks);
+	Printf("System allocator: %d live allocations, %dKB", stats.sysAllocs - stats.sysFrees, stats.sysLiveBytes / 1024);
+	for (int i = 0; i < NUM_MEMTAGS; i++)
+		Printf("Tag %s: %dKB", MemTag::GetName(static_cast<memTag_t>(i)), stats.tagLiveBytes[i] / 1024);
+}
+
+// Heapprofile command
+static void HeapProfile_f(CmdArgs *args)
+{
+	// Command help
+	if (!args) {
+		Printf("usage: heapprofile start [interval] | stop | reset | dump [file]");
+		Printf("Controls the sampling heap profiler. About one allocation is sampled for");
+		Printf("every interval bytes allocated (default 512KB). Dump writes the live");
+		Printf("samples in collapsed stack format, to the console or to a file.");
+		return;
+	}
+
+	const char *cmd = args->Argc() >= 2 ? args->Argv(1) : "";
+	if (!strcmp(cmd, "start")) {
+		size_t interval = args->Argc() >= 3 ? strtoul(args->Argv(2), NULL, 0) : 512 * 1024;
+		if (!interval) {
+			Printf("Invalid sampling interval");
+			return;
+		}
+		MemProfiler::Start(interval);
+		Printf("Heap profiler started, sampling every %d bytes", interval);
+	} else if (!strcmp(cmd, "stop"))
+		MemProfiler::Stop();
+	else if (!strcmp(cmd, "reset"))
+		MemProfiler::Reset();
+	else if (!strcmp(cmd, "dump")) {
+		std::string out = MemProfiler::FormatCollapsed();
+		if (args->Argc() < 3) {
+			Printf("%s", out);
+			return;
+		}
+		std::error_code err;
+		Filesystem::WriteFile(args->Argv(2), out, err);
+		if (err)
+			Printf("Couldn't write %s: %s", args->Argv(2), err.message());
+	} else
+		Printf("Heap profiler %s, %dKB live in sampled allocations", MemProfiler::IsRunning() ? "running" : "stopped", MemProfiler::GetLiveBytes() / 1024);
+}
+
+void Memory::InitCommands()
+{
+	Cmd::Register("meminfo", MemInfo_f);
+	Cmd::Register("heapprofile", HeapProfile_f);
+}
+
+#else
+
+void Memory::InitCommands()
+{
+}
+
+#endif
@@ -0,0 +1,87 @@
+//@@COPYRIGHT@@
+
+// Allocator statistics. Allocation and free counts are kept per thread and
+// only summed when statistics are requested, so the hot paths never write to
+// shared cache lines.
+
+namespace MemStats {
+
+// Maximum number of pools which are tracked individually. Any further pools
+// share the last slot.
+const int MAX_POOLS = 64;
+
+// Counters owned by a single thread. Only that thread writes to them, other
+// threads may read them at any time. Records are never freed, so the counts
+// of threads which have exited are still included in the totals.
+struct threadStats_t {
+	threadStats_t *next;
+	std::atomic<uint64_t> poolAllocs[MAX_POOLS];
+	std::atomic<uint64_t> poolFrees[MAX_POOLS];
+	std::atomic<uint64_t> sysAllocs, sysFrees;
+	std::atomic<uint64_t> sysAllocBytes, sysFreeBytes;
+
+	// Bytes allocated and freed with each memory tag, and the change in live
+	// bytes which hasn't been added to the shared totals used for budgets yet
+	std::atomic<uint64_t> tagAllocBytes[NUM_MEMTAGS], tagFreeBytes[NUM_MEMTAGS];
+	int64_t tagPending[NUM_MEMTAGS];
+};
+
+// Get the counters for the current thread
+extern thread_local threadStats_t *currentThreadStats;
+EXPORT threadStats_t &RegisterThread();
+inline threadStats_t &ThreadStats()
+{
+	if (__builtin_expect(!currentThreadStats, 0))
+		return RegisterThread();
+	return *currentThreadStats;
+}
+
+// Increment a counter owned by the current thread
+inline void Add(std::atomic<uint64_t> &counter, uint64_t value = 1)
+{
+	counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+// Register a pool, returns its index in the per-thread counters
+int RegisterPool(MemPoolImpl::blockLists_t *pool);
+
+// Snapshot of the statistics for a pool
+struct poolStats_t {
+	size_t objSize;
+	size_t spanSize;
+	uint64_t allocs;
+	uint64_t frees;
+	int64_t liveObjects;
+	int blocks;
+	int partialBlocks;
+	int threadBlocks;
+};
+
+// Snapshot of the statistics for the whole heap
+struct heapStats_t {
+	std::vector<poolStats_t> pools;
+
+	// Allocations which were passed on to the system allocator
+	uint64_t sysAllocs;
+	uint64_t sysFrees;
+	int64_t sysLiveBytes;
+
+	// Live bytes for each memory tag. General memory is everything which
+	// isn't attributed to another tag.
+	int64_t tagLiveBytes[NUM_MEMTAGS];
+
+	// Virtual memory used for pool blocks
+	size_t reservedBytes;
+	size_t committedBytes;
+	size_t decayingBytes;
+	int cachedBlocks;
+};
+
+// Sum all counters. The result is only approximate if other threads are
+// allocating at the same time.
+EXPORT heapStats_t GetHeapStats();
+
+// Format the statistics as JSON, for use by external tools
+EXPORT std::string FormatJSON(const heapStats_t &stats);
+
+}
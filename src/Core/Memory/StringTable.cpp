@@ -0,0 +1,158 @@
+//@@COPYRIGHT@@
+
+using StringTable::entry_t;
+
+// Initial number of buckets in the table, which doubles whenever there are
+// more strings than buckets
+#define INITIAL_BUCKETS 1024
+
+// The table is used by cvar and command constructors, so it is created on
+// first use rather than by a global constructor.
+struct table_t {
+	std::vector<entry_t *> buckets{INITIAL_BUCKETS};
+	int count = 0;
+	MemArena<65536> arena{MEMTAG_GENERAL};
+	size_t bytes = 0;
+	thread::adaptive_shared_mutex lock;
+};
+static table_t &GetTable()
+{
+	static table_t table;
+	return table;
+}
+
+// Fold the case of ASCII letters
+static inline char FoldCase(char c)
+{
+	return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+// FNV-1a hash of the case-folded string, also returns its length
+static inline size_t FoldedHash(const char *string, size_t &length)
+{
+	size_t hash = sizeof(size_t) == 8 ? 14695981039346656037ull : 2166136261u;
+	const char *i;
+	for (i = string; *i; i++) {
+		hash ^= static_cast<unsigned char>(FoldCase(*i));
+		hash *= sizeof(size_t) == 8 ? 1099511628211ull : 16777619u;
+	}
+	length = i - string;
+	return hash;
+}
+
+// Compare two strings of the same length ignoring case
+static inline bool FoldedEqual(const char *a, const char *b, size_t length)
+{
+	for (size_t i = 0; i < length; i++) {
+		if (FoldCase(a[i]) != FoldCase(b[i]))
+			return false;
+	}
+	return true;
+}
+
+// Look up a string in the table, the lock must be held. If exact is false,
+// any string which is equal ignoring case is returned.
+static entry_t *Lookup(table_t &table, const char *string, size_t length, size_t hash, bool exact)
+{
+	for (entry_t *entry = table.buckets[hash & (table.buckets.size() - 1)]; entry; entry = entry->next) {
+		if (entry->hash != hash || entry->length != length)
+			continue;
+		if (exact ? !memcmp(entry->data, string, length) : FoldedEqual(entry->data, string, length))
+			return entry;
+	}
+	return NULL;
+}
+
+// Double the number of buckets, the lock must be held exclusively
+static void Grow(table_t &table)
+{
+	std::vector<entry_t *> buckets(table.buckets.size() * 2);
+	for (entry_t *entry: table.buckets) {
+		while (entry) {
+			entry_t *next = entry->next;
+			entry_t *&bucket = buckets[entry->hash & (buckets.size() - 1)];
+			entry->next = bucket;
+			bucket = entry;
+			entry = next;
+		}
+	}
+	table.buckets.swap(buckets);
+}
+
+const char *StringTable::Intern(const char *string)
+{
+	table_t &table = GetTable();
+	size_t length;
+	size_t hash = FoldedHash(string, length);
+
+	// Most strings are already in the table
+	{
+		thread::shared_lock_guard<thread::adaptive_shared_mutex> locked(table.lock);
+		if (entry_t *entry = Lookup(table, string, length, hash, true))
+			return entry->data;
+	}
+
+	std::lock_guard<thread::adaptive_shared_mutex> locked(table.lock);
+	if (entry_t *entry = Lookup(table, string, length, hash, true))
+		return entry->data;
+
+	// Add a new entry, sharing the canonical version of any string which
+	// only differs by case
+	size_t size = offsetof(entry_t, data) + length + 1;
+	entry_t *entry = static_cast<entry_t *>(table.arena.Alloc(size, std::alignment_of<entry_t>::value));
+	entry_t *existing = Lookup(table, string, length, hash, false);
+	entry->canonical = existing ? existing->canonical : entry->data;
+	entry->hash = hash;
+	entry->length = length;
+	std::fill_n(entry->objects, StringTable::NUM_OBJECT_TYPES, nullptr);
+	memcpy(entry->data, string, length + 1);
+
+	entry_t *&bucket = table.buckets[hash & (table.buckets.size() - 1)];
+	entry->next = bucket;
+	bucket = entry;
+	table.bytes += size;
+	if (++table.count > static_cast<int>(table.buckets.size()))
+		Grow(table);
+	return entry->data;
+}
+
+const char *StringTable::FindNoCase(const char *string)
+{
+	table_t &table = GetTable();
+	size_t length;
+	size_t hash = FoldedHash(string, length);
+	thread::shared_lock_guard<thread::adaptive_shared_mutex> locked(table.lock);
+	entry_t *entry = Lookup(table, string, length, hash, false);
+	return entry ? entry->canonical : NULL;
+}
+
+void StringTable::SetObject(const char *interned, objectType_t type, void *object)
+{
+	table_t &table = GetTable();
+	std::lock_guard<thread::adaptive_shared_mutex> locked(table.lock);
+	const_cast<entry_t *>(GetEntry(Canonical(interned)))->objects[type] = object;
+}
+
+void *StringTable::FindObject(const char *string, objectType_t type)
+{
+	table_t &table = GetTable();
+	size_t length;
+	size_t hash = FoldedHash(string, length);
+	thread::shared_lock_guard<thread::adaptive_shared_mutex> locked(table.lock);
+	entry_t *entry = Lookup(table, string, length, hash, false);
+	return entry ? GetEntry(entry->canonical)->objects[type] : NULL;
+}
+
+int StringTable::GetCount()
+{
+	table_t &table = GetTable();
+	thread::shared_lock_guard<thread::adaptive_shared_mutex> locked(table.lock);
+	return table.count;
+}
+
+size_t StringTable::GetBytes()
+{
+	table_t &table = GetTable();
+	thread::shared_lock_guard<thread::adaptive_shared_mutex> locked(table.lock);
+	return table.bytes + table.buckets.size() * sizeof(entry_t *);
+}
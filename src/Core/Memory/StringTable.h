@@ -0,0 +1,82 @@
+//@@COPYRIGHT@@
+
+// Table of interned strings. Each distinct string is stored once and never
+// freed, so interned strings can be compared by pointer. They are stored with
+// their length and a case-folded hash, and strings which only differ by case
+// share a canonical version. Cvars and commands are registered with the
+// canonical version of their name, so that a case-insensitive lookup of a name
+// finds them directly.
+
+namespace StringTable {
+
+// Types of objects which can be registered under a name
+enum objectType_t {
+	OBJECT_CVAR,
+	OBJECT_COMMAND,
+
+	NUM_OBJECT_TYPES
+};
+
+// Header stored before the characters of each interned string. Registered
+// objects are only stored in the canonical entry.
+struct entry_t {
+	entry_t *next;
+	const char *canonical;
+	size_t hash;
+	size_t length;
+	void *objects[NUM_OBJECT_TYPES];
+	char data[0];
+};
+
+// Intern a string. The result is the same pointer for all equal strings.
+EXPORT const char *Intern(const char *string);
+
+// Find the canonical version of an interned string which is equal to string
+// ignoring case. Returns NULL if no such string has been interned, in which
+// case no name registered with an interned string can match it either.
+EXPORT const char *FindNoCase(const char *string);
+
+// Register an object of the given type under an interned name, or remove it
+// by passing NULL. It can then be found with any capitalization of the name.
+EXPORT void SetObject(const char *interned, objectType_t type, void *object);
+
+// Find the object of the given type registered under a name, ignoring case.
+// This only takes a single lookup in the table. Returns NULL if there is none.
+EXPORT void *FindObject(const char *string, objectType_t type);
+
+// Get the number of interned strings and the memory used by them
+EXPORT int GetCount();
+EXPORT size_t GetBytes();
+
+// Get the header of an interned string
+inline const entry_t *GetEntry(const char *interned)
+{
+	return reinterpret_cast<const entry_t *>(interned - offsetof(entry_t, data));
+}
+
+// Get the case-folded hash and length of an interned string
+inline size_t Hash(const char *interned)
+{
+	return GetEntry(interned)->hash;
+}
+inline size_t Length(const char *interned)
+{
+	return GetEntry(interned)->length;
+}
+
+// Get the canonical version of an interned string. Two interned strings are
+// equal ignoring case if and only if their canonical versions are the same.
+inline const char *Canonical(const char *interned)
+{
+	return GetEntry(interned)->canonical;
+}
+
+// Hash functor for interned strings, for use with hash tables
+struct hasher {
+	size_t operator()(const char *interned) const
+	{
+		return Hash(interned);
+	}
+};
+
+}
@@ -0,0 +1,168 @@
+//@@COPYRIGHT@@
+
+// Change in live bytes a thread can accumulate for a tag before adding it to
+// the shared total and checking the budget
+#define FLUSH_BYTES (64 * 1024)
+
+thread_local memTag_t MemTag::currentTag = MEMTAG_GENERAL;
+std::atomic<bool> MemTag::tagsUsed{false};
+
+static const char *const tagNames[NUM_MEMTAGS] = {
+	"general",
+	"filesystem",
+	"console",
+	"game",
+	"cvar"
+};
+
+// Live bytes for each tag, not including the pending changes of each thread
+static std::atomic<int64_t> sharedBytes[NUM_MEMTAGS];
+
+// Budgets for each tag, and whether the soft budget was exceeded the last
+// time it was checked, so that the warning is only printed once
+static std::atomic<int64_t> softBudget[NUM_MEMTAGS];
+static std::atomic<int64_t> hardBudget[NUM_MEMTAGS];
+static std::atomic<bool> overBudget[NUM_MEMTAGS];
+
+// Tags and charged sizes of tagged system allocations. The table doesn't use
+// the main heap, since with USE_MEMORY_OVERRIDE a rehash would free the old
+// buckets through SysFree, which calls ReleaseSys while sysLock is held.
+struct sysTag_t {
+	memTag_t tag;
+	size_t size;
+};
+static std::unordered_map<void *, sysTag_t, std::hash<void *>, std::equal_to<void *>, SysStlAllocator<std::pair<void *const, sysTag_t>>> sysTable;
+static thread::profiled_lock<thread::spinlock> sysLock{"sysTagLock"};
+
+memTag_t MemTag::SetCurrent(memTag_t tag)
+{
+	memTag_t prev = currentTag;
+	currentTag = tag;
+	return prev;
+}
+
+memTag_t MemTag::GetCurrent()
+{
+	return currentTag;
+}
+
+const char *MemTag::GetName(memTag_t tag)
+{
+	return tagNames[tag];
+}
+
+void MemTag::SetBudget(memTag_t tag, size_t soft, size_t hard)
+{
+	softBudget[tag] = soft;
+	hardBudget[tag] = hard;
+}
+
+int64_t MemTag::GetLiveBytes(memTag_t tag)
+{
+	return MemStats::GetHeapStats().tagLiveBytes[tag];
+}
+
+void MemTag::Charge(memTag_t tag, int64_t bytes)
+{
+	MemStats::threadStats_t &stats = MemStats::ThreadStats();
+	int64_t pending = stats.tagPending[tag] + bytes;
+	if (pending < FLUSH_BYTES && pending > -FLUSH_BYTES) {
+		stats.tagPending[tag] = pending;
+		MemStats::Add(bytes > 0 ? stats.tagAllocBytes[tag] : stats.tagFreeBytes[tag], std::abs(bytes));
+		return;
+	}
+
+	int64_t total = sharedBytes[tag].fetch_add(pending, std::memory_order_relaxed) + pending;
+	int64_t hard = hardBudget[tag].load(std::memory_order_relaxed);
+	if (bytes > 0 && hard && total > hard) {
+		// Back out the charge and fail. The error message is allocated
+		// without a tag so that it doesn't recurse into here.
+		sharedBytes[tag].fetch_sub(pending, std::memory_order_relaxed);
+		MemTagScope scope(MEMTAG_GENERAL);
+		Error("Memory budget for %s exceeded: tried to allocate %d bytes with %dKB in use, hard budget is %dKB", tagNames[tag], bytes, (total - bytes) / 1024, hard / 1024);
+	}
+	stats.tagPending[tag] = 0;
+	MemStats::Add(bytes > 0 ? stats.tagAllocBytes[tag] : stats.tagFreeBytes[tag], std::abs(bytes));
+
+	int64_t soft = softBudget[tag].load(std::memory_order_relaxed);
+	bool over = soft && total > soft;
+	if (over != overBudget[tag].load(std::memory_order_relaxed) && overBudget[tag].exchange(over) != over && over) {
+		MemTagScope scope(MEMTAG_GENERAL);
+		Warning("Memory budget for %s exceeded: %dKB in use, soft budget is %dKB", tagNames[tag], total / 1024, soft / 1024);
+	}
+}
+
+void MemTag::MarkPool(void *ptr, memTag_t tag)
+{
+	if (!tagsUsed.load(std::memory_order_relaxed))
+		tagsUsed = true;
+	*MemVirtual::GetTagSlot(ptr, true) = tag;
+}
+
+void MemTag::ReleasePool(void *ptr, size_t size)
+{
+	uint8_t *slot = MemVirtual::GetTagSlot(ptr, false);
+	if (!slot || !*slot)
+		return;
+	memTag_t tag = static_cast<memTag_t>(*slot);
+	*slot = MEMTAG_GENERAL;
+	Charge(tag, -static_cast<int64_t>(size));
+}
+
+void MemTag::MarkSys(void *ptr, memTag_t tag, size_t size)
+{
+	if (!tagsUsed.load(std::memory_order_relaxed))
+		tagsUsed = true;
+
+	std::lock_guard<decltype(sysLock)> locked(sysLock);
+	sysTable[ptr] = sysTag_t{tag, size};
+}
+
+void MemTag::ReleaseSys(void *ptr)
+{
+	sysTag_t info;
+	{
+		std::lock_guard<decltype(sysLock)> locked(sysLock);
+		auto i = sysTable.find(ptr);
+		if (i == sysTable.end())
+			return;
+		info = i->second;
+		sysTable.erase(i);
+	}
+	Charge(info.tag, -static_cast<int64_t>(info.size));
+}
+
+memTag_t MemTag::GetSysTag(void *ptr)
+{
+	if (!Used())
+		return MEMTAG_GENERAL;
+	std::lock_guard<decltype(sysLock)> locked(sysLock);
+	auto i = sysTable.find(ptr);
+	return i == sysTable.end() ? MEMTAG_GENERAL : i->second.tag;
+}
+
+// Cvars setting the budgets of each tag, in megabytes. The game tag has no
+// budget since there is no game module to set it yet.
+#ifndef BUILD_TEST
+
+static const memTag_t budgetTags[] = {MEMTAG_FILESYSTEM, MEMTAG_CONSOLE, MEMTAG_CVAR};
+static void BudgetHook(Cvar *var);
+static Cvar budgetCvars[sizeof(budgetTags) / sizeof(budgetTags[0])][2] = {
+	{{"mem_budgetFilesystem", CVAR_ARCHIVE, "0", "Soft memory budget for filesystem buffers in MB, 0 for none", 0, 65536, NULL, BudgetHook},
+	 {"mem_hardBudgetFilesystem", CVAR_ARCHIVE, "0", "Hard memory budget for filesystem buffers in MB, 0 for none", 0, 65536, NULL, BudgetHook}},
+	{{"mem_budgetConsole", CVAR_ARCHIVE, "0", "Soft memory budget for the console and logs in MB, 0 for none", 0, 65536, NULL, BudgetHook},
+	 {"mem_hardBudgetConsole", CVAR_ARCHIVE, "0", "Hard memory budget for the console and logs in MB, 0 for none", 0, 65536, NULL, BudgetHook}},
+	{{"mem_budgetCvar", CVAR_ARCHIVE, "0", "Soft memory budget for cvars and commands in MB, 0 for none", 0, 65536, NULL, BudgetHook},
+	 {"mem_hardBudgetCvar", CVAR_ARCHIVE, "0", "Hard memory budget for cvars and commands in MB, 0 for none", 0, 65536, NULL, BudgetHook}}
+};
+static void BudgetHook(Cvar *var)
+{
+	// This is called while the array is being constructed, so only look at
+	// the cvar which was set
+	int index = var - &budgetCvars[0][0];
+	memTag_t tag = budgetTags[index / 2];
+	std::atomic<int64_t> &budget = index % 2 ? hardBudget[tag] : softBudget[tag];
+	budget = var->GetInt() * int64_t(1 << 20);
+}
+
+#endif
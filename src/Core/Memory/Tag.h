@@ -0,0 +1,86 @@
+//@@COPYRIGHT@@
+
+// Memory tags, which attribute heap memory to the subsystem that allocated it
+// so that its usage can be reported and kept within a budget. Each thread has
+// a current tag which applies to all of its allocations, and which is set for
+// a scope with MemTagScope, so code which doesn't know about tags is charged
+// to the subsystem calling it.
+
+// Subsystems memory can be attributed to. Untagged memory is counted as
+// general, and is not tracked individually.
+enum memTag_t {
+	MEMTAG_GENERAL,
+	MEMTAG_FILESYSTEM, // Files, search paths and I/O requests
+	MEMTAG_CONSOLE, // Print handlers, logs and console input
+	MEMTAG_GAME, // Not set by the engine, for the game module
+	MEMTAG_CVAR, // Cvars and commands
+	NUM_MEMTAGS
+};
+
+namespace MemTag {
+
+// Set the current tag of this thread, returns the previous one
+EXPORT memTag_t SetCurrent(memTag_t tag);
+EXPORT memTag_t GetCurrent();
+
+// Get the name of a tag
+EXPORT const char *GetName(memTag_t tag);
+
+// Set the soft and hard budgets of a tag in bytes, 0 means no budget. A
+// warning is printed when a tag goes over its soft budget, and allocations
+// which would take it over its hard budget fail with an error. Usage is
+// counted per thread and only added to the shared totals every 64KB, so
+// budgets can be exceeded by that much per thread.
+EXPORT void SetBudget(memTag_t tag, size_t soft, size_t hard);
+
+// Get the number of live bytes allocated with a tag. This is approximate if
+// other threads are allocating at the same time.
+EXPORT int64_t GetLiveBytes(memTag_t tag);
+
+#ifndef BUILD_MODULE
+
+// Tag of the current thread
+extern thread_local memTag_t currentTag;
+
+// Set once any memory has been tagged. Until then frees don't need to look up
+// the tag of the pointer.
+extern std::atomic<bool> tagsUsed;
+
+// Charge an allocation to a tag, or refund it if bytes is negative. This is
+// called before allocating memory, and fails with an error if the hard budget
+// of the tag would be exceeded.
+void Charge(memTag_t tag, int64_t bytes);
+
+// Record the tag of a pool object, and refund it when it is freed
+void MarkPool(void *ptr, memTag_t tag);
+void ReleasePool(void *ptr, size_t size);
+
+// Record the tag of a system allocation, and refund it when it is freed.
+// GetSysTag returns MEMTAG_GENERAL for untagged allocations.
+void MarkSys(void *ptr, memTag_t tag, size_t size);
+void ReleaseSys(void *ptr);
+memTag_t GetSysTag(void *ptr);
+
+// Check if the tag of a freed pointer needs to be looked up
+inline bool Used()
+{
+	return __builtin_expect(tagsUsed.load(std::memory_order_relaxed), 0);
+}
+
+#endif
+
+}
+
+// Set the current tag of this thread until the end of the scope
+class MemTagScope: boost::noncopyable {
+public:
+	explicit MemTagScope(memTag_t tag)
+		: prev(MemTag::SetCurrent(tag)) {}
+	~MemTagScope()
+	{
+		MemTag::SetCurrent(prev);
+	}
+
+private:
+	memTag_t prev;
+};
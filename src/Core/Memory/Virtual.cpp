@@ -1,44 +1,33 @@
 //@@COPYRIGHT@@
 
 #ifndef _WIN32
-// Data structure representing a mmap allocation
-struct mmapInfo_t: public HashTable<mmapInfo_t>::Hook, UseMemPool<mmapInfo_t> {
-	void *address;
-	size_t size;
-
-	// Constructor
-	mmapInfo_t(void *address_, size_t size_)
-	{
-		address = address_;
-		size = size_;
-	}
-};
+// Table of mmap allocation sizes, indexed by address. This doesn't use the
+// main heap, since freeing the old buckets after a rehash could otherwise call
+// back into TryReleaseMmap while mmapLock is held.
+static std::unordered_map<void *, size_t, std::hash<void *>, std::equal_to<void *>, SysStlAllocator<std::pair<void *const, size_t>>> mmapTable;
+static thread::profiled_lock<std::mutex> mmapLock{"mmapLock"};
 
-// Hashtable operations
-static inline size_t hash_value(const mmapInfo_t &info)
-{
-	boost::hash<intptr_t> hasher;
-	return hasher(reinterpret_cast<intptr_t>(info.address) >> 12);
-}
-static inline bool operator==(const mmapInfo_t &a, const mmapInfo_t &b)
+void MemVirtual::RegisterMmap(void *addr, size_t size)
 {
-	return a.address == b.address;
+	std::lock_guard<decltype(mmapLock)> locked(mmapLock);
+	mmapTable.emplace(addr, size);
 }
 
-// Hash table to track allocations
-static HashTable<mmapInfo_t> mmapTable;
-
-void MemVirtual::RegisterMmap(void *addr, size_t size)
+size_t MemVirtual::ReleaseMmap(void *addr)
 {
-	mmapTable.insert_equal(*new mmapInfo_t(addr, size));
+	size_t size = TryReleaseMmap(addr);
+	Assert((size));
+	return size;
 }
 
-size_t MemVirtual::ReleaseMmap(void *addr)
+size_t MemVirtual::TryReleaseMmap(void *addr)
 {
-	HashTable<mmapInfo_t>::const_iterator i = mmapTable.find(mmapInfo_t(addr, 0));
-	Assert(i != mmapTable.end());
-	size_t size = i->size;
-	mmapTable.erase_and_dispose(i, DeleteFunctor<mmapInfo_t>());
+	std::lock_guard<decltype(mmapLock)> locked(mmapLock);
+	auto i = mmapTable.find(addr);
+	if (i == mmapTable.end())
+		return 0;
+	size_t size = i->second;
+	mmapTable.erase(i);
 	return size;
 }
 #endif
@@ -49,119 +38,566 @@ size_t MemVirtual::ReleaseMmap(void *addr)
 #define HAVE_MEM_OVERCOMMIT
 #endif
 
-// Size of the memory region used for block allocation
-#define ALLOC_SIZE (512 * 1024 * 1024)
+// Size of each memory region used for block allocation. More regions are
+// reserved as needed when the existing ones are full.
+#define REGION_SIZE (256 * 1024 * 1024)
+#define REGION_BLOCKS (REGION_SIZE / MemPoolImpl::BLOCK_SIZE)
+#define REGION_WORDS (REGION_BLOCKS / 32)
+
+// Maximum number of regions that can be reserved
+#define MAX_REGIONS 64
+
+// Blocks are grouped into 2MB superblocks, one for each word of the bitmap.
+// When huge pages are enabled, each superblock can be backed by a single huge
+// page, and allocations prefer superblocks which are already in use. Such a
+// superblock is committed and decommitted as a whole.
+#define SUPERBLOCK_SIZE (MemPoolImpl::BLOCK_SIZE * 32)
+
+// Alignment of block regions, so that all spans and superblocks are aligned
+// to their size
+#define REGION_ALIGN SUPERBLOCK_SIZE
+static_assert(REGION_ALIGN % (MemPoolImpl::BLOCK_SIZE * MemPoolImpl::MAX_SPAN_BLOCKS) == 0, "Regions must be aligned to the largest span size");
+
+// Whether block memory should be backed by transparent huge pages
+static std::atomic<bool> hugePages{false};
 
-// Bit set of all blocks in the allocation region
-#define BITSET_SIZE (ALLOC_SIZE / (MemPoolImpl::BLOCK_SIZE * 32))
-static uint32_t bitset[BITSET_SIZE];
+// A region of reserved memory divided into blocks. Allocated blocks are
+// tracked in a two-level bitmap: each bit in fullWords is set when the
+// matching word of the bitmap is full, which allows allocations to skip full
+// parts of the region without looking at them. Both levels are only modified
+// using atomic operations.
+struct region_t {
+	char *base;
+	std::atomic<uint32_t> fullWords[REGION_WORDS / 32];
+	std::atomic<uint32_t> bitmap[REGION_WORDS];
+
+	// Bit set for each superblock which is committed as a whole, which is
+	// decided when its first span is allocated. It only changes while the
+	// superblock is claimed by marking all of its blocks as allocated.
+	std::atomic<uint32_t> hugeWords[REGION_WORDS / 32];
+
+	// Number of blocks in the span containing each block, stored as a shift
+	uint8_t spanShift[REGION_BLOCKS];
+
+	// Memory tag of each object in the region, with one byte for every 8
+	// bytes since that is the smallest object size. This is only created
+	// once tags are used, and its pages are only committed when touched.
+	std::atomic<uint8_t *> tags;
+};
 
-// Pointer to the first word of the bitset containing at least one clear bit
-static uint32_t *bitsetStart = bitset;
+// All reserved regions. A region is fully initialized before numRegions is
+// incremented to include it, and regions are never released.
+static region_t regions[MAX_REGIONS];
+static std::atomic<int> numRegions{0};
 
-// Pointer to the memory region containing all blocks
-static void *blockMemory = NULL;
+// Mutex protecting the creation of new regions
+static thread::profiled_lock<std::mutex> regionLock{"regionLock"};
 
-// Mutex protecting the bitset
-static Mutex bitsetLock;
+// Number of bytes committed in the block regions
+static std::atomic<size_t> committedBytes{0};
 
-// Initialize the block allocator by reserving a large range of memory, but
-// without commiting any pages in it.
-static inline void InitBlock()
+// Freed spans are kept committed in a decay list for decayTime milliseconds,
+// so that they can be reused without any system calls. Spans which are not
+// reused in that time are decommitted in batches by the purger thread. There
+// is one list for each span size, ordered from oldest to newest.
+typedef intrusive::list_base_hook<intrusive::link_mode<intrusive::normal_link>> decayHook_t;
+struct decaySpan_t: public decayHook_t {
+	std::chrono::steady_clock::time_point freeTime;
+};
+typedef intrusive::list<decaySpan_t, intrusive::constant_time_size<false>> decayList_t;
+#define NUM_SPAN_SIZES 4
+static decayList_t decayList[NUM_SPAN_SIZES];
+static thread::profiled_lock<thread::spinlock> decayLock{"decayLock"};
+
+// Number of bytes in the decay lists
+static std::atomic<size_t> decayingBytes{0};
+
+// Delay before freed spans are decommitted, in milliseconds
+static std::atomic<int> decayTime{1000};
+
+// Maximum number of spans decommitted at once by Purge, and minimum interval
+// between two runs of the purger thread in milliseconds
+#define PURGE_BATCH 64
+#define MIN_PURGE_INTERVAL 10
+
+// Reserve a large range of memory for a region, but without commiting any
+// pages in it. Returns NULL on failure.
+static char *ReserveRegion()
 {
 #ifdef _WIN32
-	void *addr = VirtualAlloc(NULL, ALLOC_SIZE, MEM_RESERVE, PAGE_READWRITE);
+	// Reserve a larger range to find an aligned address, then reserve again
+	// at that address.
+	void *addr = VirtualAlloc(NULL, REGION_SIZE + REGION_ALIGN, MEM_RESERVE, PAGE_READWRITE);
 	if (!addr)
-		Error("Failed to reserve %d bytes of memory", ALLOC_SIZE);
-	blockMemory = addr;
+		return NULL;
+	void *aligned = reinterpret_cast<void *>(PAD(reinterpret_cast<intptr_t>(addr), REGION_ALIGN));
+	VirtualFree(addr, 0, MEM_RELEASE);
+	return static_cast<char *>(VirtualAlloc(aligned, REGION_SIZE, MEM_RESERVE, PAGE_READWRITE));
 #else
 	// We are only guaranteed an address aligned to page size, so we need to
-	// align it manually to MemPoolImpl::BLOCK_SIZE.
+	// align it manually to REGION_ALIGN.
 #ifdef HAVE_MEM_OVERCOMMIT
-	char *base = static_cast<char *>(anonymous_mmap(NULL, ALLOC_SIZE + MemPoolImpl::BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_NORESERVE));
+	char *base = static_cast<char *>(anonymous_mmap(NULL, REGION_SIZE + REGION_ALIGN, PROT_READ | PROT_WRITE, MAP_NORESERVE));
 #else
-	char *base = static_cast<char *>(anonymous_mmap(NULL, ALLOC_SIZE + MemPoolImpl::BLOCK_SIZE, PROT_READ, 0));
+	char *base = static_cast<char *>(anonymous_mmap(NULL, REGION_SIZE + REGION_ALIGN, PROT_READ, 0));
 #endif
 	if (base == MAP_FAILED)
-		Error("Failed to reserve %d bytes of memory", ALLOC_SIZE);
+		return NULL;
 
 	// Get aligned address
-	char *aligned = reinterpret_cast<char *>(PAD(reinterpret_cast<intptr_t>(base), MemPoolImpl::BLOCK_SIZE));
+	char *aligned = reinterpret_cast<char *>(PAD(reinterpret_cast<intptr_t>(base), REGION_ALIGN));
 
 	// Unmap prolog and epilog
 	if (base != aligned)
 		munmap(base, aligned - base);
-	munmap(aligned + ALLOC_SIZE, MemPoolImpl::BLOCK_SIZE + base - aligned);
+	munmap(aligned + REGION_SIZE, REGION_ALIGN + base - aligned);
+
+	return aligned;
+#endif
+}
+
+// Tell the kernel whether a region should be backed by transparent huge pages
+static void AdviseRegion(char *base, bool enable)
+{
+#ifdef MADV_HUGEPAGE
+	madvise(base, REGION_SIZE, enable ? MADV_HUGEPAGE : MADV_NOHUGEPAGE);
+#else
+	(void)base;
+	(void)enable;
+#endif
+}
+
+// Add a new region, unless another thread already did so since we saw that
+// there were only count regions.
+static void AddRegion(int count)
+{
+	std::lock_guard<decltype(regionLock)> locked(regionLock);
+	if (numRegions.load(std::memory_order_relaxed) != count)
+		return;
+
+	if (count == MAX_REGIONS)
+		Error("Block memory exhausted after reserving %d bytes", MAX_REGIONS * static_cast<size_t>(REGION_SIZE));
+	char *base = ReserveRegion();
+	if (!base)
+		Error("Failed to reserve %d bytes of memory", REGION_SIZE);
+
+	if (hugePages.load(std::memory_order_relaxed))
+		AdviseRegion(base, true);
+
+	regions[count].base = base;
+	numRegions.store(count + 1, std::memory_order_release);
+}
+
+// Find the region containing a pointer, or NULL if it is not in any region
+static inline region_t *FindRegion(void *ptr)
+{
+	int count = numRegions.load(std::memory_order_acquire);
+	for (int i = 0; i < count; i++) {
+		if (reinterpret_cast<uintptr_t>(ptr) - reinterpret_cast<uintptr_t>(regions[i].base) < REGION_SIZE)
+			return &regions[i];
+	}
+	return NULL;
+}
+
+// Reserve the tag map of a region
+#define TAG_MAP_SIZE (REGION_SIZE / 8)
+static uint8_t *CreateTagMap(region_t *region)
+{
+	std::lock_guard<decltype(regionLock)> locked(regionLock);
+	uint8_t *tags = region->tags.load(std::memory_order_relaxed);
+	if (tags)
+		return tags;
+
+#ifdef _WIN32
+	tags = static_cast<uint8_t *>(VirtualAlloc(NULL, TAG_MAP_SIZE, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));
+	if (!tags)
+		Error("Failed to reserve %d bytes of memory", TAG_MAP_SIZE);
+#else
+#ifdef HAVE_MEM_OVERCOMMIT
+	void *addr = anonymous_mmap(NULL, TAG_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_NORESERVE);
+#else
+	void *addr = anonymous_mmap(NULL, TAG_MAP_SIZE, PROT_READ | PROT_WRITE, 0);
+#endif
+	if (addr == MAP_FAILED)
+		Error("Failed to reserve %d bytes of memory", TAG_MAP_SIZE);
+	tags = static_cast<uint8_t *>(addr);
+#endif
+
+	region->tags.store(tags, std::memory_order_release);
+	return tags;
+}
+
+// Find a free run of numBlocks bits in a bitmap word, aligned to numBlocks.
+// Returns -1 if there is none.
+static inline int FindFreeRun(uint32_t value, int numBlocks)
+{
+	if (numBlocks == 1)
+		return ~value ? IntFFS(~value) : -1;
+
+	uint32_t mask = (1u << numBlocks) - 1;
+	for (int bit = 0; bit < 32; bit += numBlocks) {
+		if (!(value & (mask << bit)))
+			return bit;
+	}
+	return -1;
+}
+
+// Mark a word of the bitmap as full in the top level. A concurrent free may
+// have cleared a bit in the word before the top level bit was set, in which
+// case it would not have seen the bit to clear it, so check again.
+static inline void MarkWordFull(region_t &region, int word)
+{
+	uint32_t bit = 1u << (word % 32);
+	region.fullWords[word / 32].fetch_or(bit);
+	if (~region.bitmap[word].load() != 0)
+		region.fullWords[word / 32].fetch_and(~bit);
+}
+
+// Allocate a run of blocks in a region, and return the index of the first
+// block. Returns -1 if the region has no room for the span. Completely empty
+// superblocks are skipped unless allowEmpty is set.
+static inline int AllocInRegion(region_t &region, int numBlocks, bool allowEmpty)
+{
+	uint32_t mask = (1u << numBlocks) - 1;
+	for (int top = 0; top < REGION_WORDS / 32; top++) {
+		// Only skip words which are completely full, since a word may not
+		// have room for a span but still have free single blocks.
+		uint32_t full = region.fullWords[top].load(std::memory_order_relaxed);
+		while (~full != 0) {
+			int word = top * 32 + IntFFS(~full);
+			full |= 1u << (word % 32);
+
+			uint32_t value = region.bitmap[word].load(std::memory_order_relaxed);
+			if (!value && !allowEmpty)
+				continue;
+
+			// With huge pages, an empty superblock is claimed while it is
+			// marked as committed as a whole, so that spans allocated in it
+			// by other threads are accounted for correctly. The superblock
+			// may still be committed as a whole if its last span was just
+			// freed and ReleaseSpan has not claimed it yet, in which case it
+			// is already accounted for.
+			if (!value && hugePages.load(std::memory_order_relaxed)) {
+				if (!region.bitmap[word].compare_exchange_strong(value, ~0u))
+					continue;
+				uint32_t bit = 1u << (word % 32);
+				if (!(region.hugeWords[word / 32].fetch_or(bit) & bit))
+					committedBytes.fetch_add(SUPERBLOCK_SIZE, std::memory_order_relaxed);
+				region.bitmap[word].store(mask);
+				return word * 32;
+			}
+
+			int bit;
+			while ((bit = FindFreeRun(value, numBlocks)) != -1) {
+				uint32_t newValue = value | (mask << bit);
+				if (region.bitmap[word].compare_exchange_weak(value, newValue)) {
+					if (~newValue == 0)
+						MarkWordFull(region, word);
+					return word * 32 + bit;
+				}
+			}
+		}
+	}
+	return -1;
+}
+
+// Check whether a span is in a superblock which is committed as a whole
+static inline bool InHugeSuperblock(char *span)
+{
+	region_t *region = FindRegion(span);
+	Assert((region));
+	int word = (span - region->base) / SUPERBLOCK_SIZE;
+	return region->hugeWords[word / 32].load() & (1u << (word % 32));
+}
 
-	blockMemory = aligned;
+// Uncommit the pages in a range of block memory
+static void DecommitRange(char *addr, size_t size)
+{
+#ifdef _WIN32
+	if (!VirtualFree(addr, size, MEM_DECOMMIT))
+		Error("Failed to VirtualFree %d bytes of memory", size);
+#elif defined(HAVE_MEM_OVERCOMMIT)
+	// MADV_FREE lets the kernel reclaim the pages lazily, which is cheaper,
+	// but it is not supported by older kernels.
+#ifdef MADV_FREE
+	if (madvise(addr, size, MADV_FREE) == 0)
+		return;
 #endif
+	if (madvise(addr, size, MADV_DONTNEED) != 0)
+		Error("Failed to decommit %d bytes of memory", size);
+#else
+	void *ret = anonymous_mmap(addr, size, PROT_READ, MAP_FIXED);
+	if (ret == MAP_FAILED)
+		Error("Failed to decommit %d bytes of memory", size);
+#endif
+}
+
+// Mark the blocks of a span as free in the bitmap of its region. Unless its
+// superblock is committed as a whole, the span must already have been
+// decommitted.
+static void ReleaseSpan(char *span, int numBlocks)
+{
+	// Clear the bits for the span, and clear the full bit in the top level if
+	// it was set.
+	region_t *region = FindRegion(span);
+	Assert((region));
+	int index = (span - region->base) / MemPoolImpl::BLOCK_SIZE;
+	int word = index / 32;
+	uint32_t bit = 1u << (word % 32);
+	uint32_t mask = ((1u << numBlocks) - 1) << (index % 32);
+	uint32_t value = region->bitmap[word].fetch_and(~mask) & ~mask;
+	if (region->fullWords[word / 32].load() & bit)
+		region->fullWords[word / 32].fetch_and(~bit);
+
+	// Superblocks committed as a whole are only decommitted once all of
+	// their blocks are free, since decommitting part of a huge page would
+	// split it. The superblock is claimed by marking all of its blocks as
+	// allocated while it is being decommitted.
+	if (value == 0 && (region->hugeWords[word / 32].load() & bit)) {
+		uint32_t expected = 0;
+		if (region->bitmap[word].compare_exchange_strong(expected, ~0u)) {
+			DecommitRange(region->base + word * SUPERBLOCK_SIZE, SUPERBLOCK_SIZE);
+			region->hugeWords[word / 32].fetch_and(~bit);
+			committedBytes.fetch_sub(SUPERBLOCK_SIZE, std::memory_order_relaxed);
+			region->bitmap[word].store(0);
+		}
+	}
 }
 
-void *MemVirtual::AllocBlock()
+// Background thread which periodically decommits expired spans
+static void PurgeThread()
 {
-	// Make sure the block allocation system has been initialized
-	if (!blockMemory)
-		InitBlock();
+	while (true) {
+		int delay = std::max(decayTime.load(std::memory_order_relaxed) / 2, MIN_PURGE_INTERVAL);
+		std::this_thread::sleep_for(std::chrono::milliseconds(delay));
+		MemVirtual::Purge(false);
+	}
+}
+
+void MemVirtual::Init()
+{
+	// Pools may already have been used by global constructors
+	if (numRegions.load(std::memory_order_acquire) == 0)
+		AddRegion(0);
+
+	static bool purgerStarted = false;
+	if (!purgerStarted) {
+		std::thread(PurgeThread).detach();
+		purgerStarted = true;
+	}
+}
 
-	// Find a word in the bitset with an unset bit, and set it
-	int index = 0;
-	bitsetLock.Lock();
-	for (; bitsetStart != bitset + BITSET_SIZE; bitsetStart++) {
-		uint32_t &value = *bitsetStart;
-		if (~value == 0)
+void MemVirtual::Purge(bool all)
+{
+	auto expiry = std::chrono::steady_clock::now() - std::chrono::milliseconds(decayTime.load(std::memory_order_relaxed));
+	for (int i = 0; i < NUM_SPAN_SIZES; i++) {
+		int numBlocks = 1 << i;
+		size_t spanSize = numBlocks * MemPoolImpl::BLOCK_SIZE;
+		while (true) {
+			// Take a batch of expired spans off the list, so that the lock
+			// isn't held during the system calls.
+			char *batch[PURGE_BATCH];
+			int count = 0;
+			decayLock.lock();
+			while (count < PURGE_BATCH && !decayList[i].empty() && (all || decayList[i].front().freeTime <= expiry)) {
+				batch[count++] = reinterpret_cast<char *>(&decayList[i].front());
+				decayList[i].pop_front();
+			}
+			decayLock.unlock();
+			if (!count)
+				break;
+			decayingBytes.fetch_sub(count * spanSize, std::memory_order_relaxed);
+
+			// Sort the spans so that adjacent ones in the same region can be
+			// decommitted with a single call. Spans in superblocks committed
+			// as a whole are decommitted with the superblock by ReleaseSpan
+			// instead.
+			std::sort(batch, batch + count);
+			size_t decommitted = 0;
+			for (int j = 0; j < count;) {
+				if (InHugeSuperblock(batch[j])) {
+					j++;
+					continue;
+				}
+				int k = j + 1;
+				while (k < count && batch[k] == batch[k - 1] + spanSize && FindRegion(batch[k]) == FindRegion(batch[j]) && !InHugeSuperblock(batch[k]))
+					k++;
+				DecommitRange(batch[j], (k - j) * spanSize);
+				decommitted += (k - j) * spanSize;
+				j = k;
+			}
+			committedBytes.fetch_sub(decommitted, std::memory_order_relaxed);
+			for (int j = 0; j < count; j++)
+				ReleaseSpan(batch[j], numBlocks);
+		}
+	}
+}
+
+void MemVirtual::SetHugePages(bool enable)
+{
+	if (hugePages.exchange(enable) == enable)
+		return;
+	int count = numRegions.load(std::memory_order_acquire);
+	for (int i = 0; i < count; i++)
+		AdviseRegion(regions[i].base, enable);
+}
+
+void MemVirtual::SetDecayTime(int msec)
+{
+	decayTime.store(std::max(msec, 0), std::memory_order_relaxed);
+}
+
+void *MemVirtual::AllocSpan(int numBlocks)
+{
+	Assert((numBlocks >= 1 && numBlocks <= MemPoolImpl::MAX_SPAN_BLOCKS && (numBlocks & (numBlocks - 1)) == 0));
+	size_t spanSize = numBlocks * MemPoolImpl::BLOCK_SIZE;
+
+	// Reuse the most recently freed span of that size if there is one, since
+	// it is still committed and probably still in the cache.
+	decaySpan_t *item = NULL;
+	decayList_t &list = decayList[IntLog2(numBlocks)];
+	decayLock.lock();
+	if (!list.empty()) {
+		item = &list.back();
+		list.pop_back();
+	}
+	decayLock.unlock();
+	if (item) {
+		decayingBytes.fetch_sub(spanSize, std::memory_order_relaxed);
+		item->~decaySpan_t();
+		return item;
+	}
+
+	// Look for room in each region in turn, and reserve a new region if they
+	// are all full. This also takes care of allocations made by global
+	// constructors before Init is called. With huge pages, superblocks which
+	// are already in use are tried first in all regions.
+	region_t *region;
+	int index;
+	bool allowEmpty = !hugePages.load(std::memory_order_relaxed);
+	for (int i = 0;; i++) {
+		int count = numRegions.load(std::memory_order_acquire);
+		if (i == count) {
+			if (allowEmpty) {
+				AddRegion(count);
+				i--;
+			} else {
+				allowEmpty = true;
+				i = -1;
+			}
 			continue;
-		index = IntFFS(~value);
-		value |= 1 << index;
-		break;
+		}
+		region = &regions[i];
+		index = AllocInRegion(*region, numBlocks, allowEmpty);
+		if (index != -1)
+			break;
 	}
-	bitsetLock.Unlock();
 
-	// Check if block memory is full
-	if (bitsetStart == bitset + BITSET_SIZE)
-		Error("Failed to allocate %d bytes of memory", MemPoolImpl::BLOCK_SIZE);
+	// Record the span size for every block in it
+	memset(region->spanShift + index, IntLog2(numBlocks), numBlocks);
 
 	// Get a pointer to the memory block
-	void *block = static_cast<char *>(blockMemory) + ((bitsetStart - bitset) * 32 + index) * MemPoolImpl::BLOCK_SIZE;
+	void *span = region->base + index * MemPoolImpl::BLOCK_SIZE;
 
-	// Commit the memory pages for this block
+	// Commit the memory pages for this span
 #ifdef _WIN32
-	void *addr = VirtualAlloc(block, MemPoolImpl::BLOCK_SIZE, MEM_COMMIT, PAGE_READWRITE);
+	void *addr = VirtualAlloc(span, spanSize, MEM_COMMIT, PAGE_READWRITE);
 	if (!addr)
-		Error("Failed to allocate %d bytes of memory", MemPoolImpl::BLOCK_SIZE);
+		Error("Failed to allocate %d bytes of memory", spanSize);
 #elif !defined(HAVE_MEM_OVERCOMMIT)
-	void *ret = anonymous_mmap(block, MemPoolImpl::BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_FIXED);
+	void *ret = anonymous_mmap(span, spanSize, PROT_READ | PROT_WRITE, MAP_FIXED);
 	if (ret == MAP_FAILED)
-		Error("Failed to allocate %d bytes of memory", MemPoolImpl::BLOCK_SIZE);
+		Error("Failed to allocate %d bytes of memory", spanSize);
 #endif
 
+	// Superblocks committed as a whole were accounted for when claimed
+	if (!InHugeSuperblock(static_cast<char *>(span)))
+		committedBytes.fetch_add(spanSize, std::memory_order_relaxed);
+
 	// Return pointer
-	return block;
+	return span;
 }
 
-void MemVirtual::FreeBlock(void *block)
+void MemVirtual::FreeSpan(void *span, int numBlocks)
 {
-	int index = (static_cast<char *>(block) - static_cast<char *>(blockMemory)) / MemPoolImpl::BLOCK_SIZE;
-	bitsetLock.Lock();
-	bitsetStart = std::min(bitsetStart, bitset + index / 32);
-	bitset[index / 32] &= ~(1 << (index % 32));
-	bitsetLock.Unlock();
+	size_t spanSize = numBlocks * MemPoolImpl::BLOCK_SIZE;
 
-	// Uncommit pages for this block
-#ifdef _WIN32
-	if (!VirtualFree(block, MemPoolImpl::BLOCK_SIZE, MEM_DECOMMIT))
-		Error("Failed to VirtualFree %d bytes of memory", MemPoolImpl::BLOCK_SIZE);
-#else
-#ifdef HAVE_MEM_OVERCOMMIT
-	void *ret = anonymous_mmap(block, MemPoolImpl::BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_FIXED | MAP_NORESERVE);
-#else
-	void *ret = anonymous_mmap(block, MemPoolImpl::BLOCK_SIZE, PROT_READ, MAP_FIXED);
-#endif
-	if (ret == MAP_FAILED)
-		Error("Failed to decommit %d bytes of memory", MemPoolImpl::BLOCK_SIZE);
-#endif
+	// Decommit the span immediately if decay is disabled. This must be done
+	// before the blocks are marked as free, since another thread could
+	// allocate them immediately.
+	if (decayTime.load(std::memory_order_relaxed) == 0) {
+		if (!InHugeSuperblock(static_cast<char *>(span))) {
+			DecommitRange(static_cast<char *>(span), spanSize);
+			committedBytes.fetch_sub(spanSize, std::memory_order_relaxed);
+		}
+		ReleaseSpan(static_cast<char *>(span), numBlocks);
+		return;
+	}
+
+	// Otherwise add it to the decay list
+	decaySpan_t *item = new(span) decaySpan_t;
+	item->freeTime = std::chrono::steady_clock::now();
+	decayLock.lock();
+	decayList[IntLog2(numBlocks)].push_back(*item);
+	decayLock.unlock();
+	decayingBytes.fetch_add(spanSize, std::memory_order_relaxed);
+}
+
+int MemVirtual::GetSpanBlocks(void *ptr)
+{
+	region_t *region = FindRegion(ptr);
+	Assert((region));
+	int index = (static_cast<char *>(ptr) - region->base) / MemPoolImpl::BLOCK_SIZE;
+	return 1 << region->spanShift[index];
+}
+
+size_t MemVirtual::GetReservedBytes()
+{
+	return numRegions.load(std::memory_order_relaxed) * static_cast<size_t>(REGION_SIZE);
+}
+
+size_t MemVirtual::GetCommittedBytes()
+{
+	return committedBytes.load(std::memory_order_relaxed);
+}
+
+size_t MemVirtual::GetDecayingBytes()
+{
+	return decayingBytes.load(std::memory_order_relaxed);
 }
 
 bool MemVirtual::IsBlockPtr(void *ptr)
 {
-	return blockMemory && ptr >= blockMemory && ptr < static_cast<char *>(blockMemory) + ALLOC_SIZE;
+	return FindRegion(ptr) != NULL;
 }
+
+uint8_t *MemVirtual::GetTagSlot(void *ptr, bool create)
+{
+	region_t *region = FindRegion(ptr);
+	Assert((region));
+	uint8_t *tags = region->tags.load(std::memory_order_acquire);
+	if (!tags) {
+		if (!create)
+			return NULL;
+		tags = CreateTagMap(region);
+	}
+	return tags + (static_cast<char *>(ptr) - region->base) / 8;
+}
+
+#ifndef BUILD_TEST
+
+// Cvar controlling the decay time of freed spans
+static void DecayTimeHook(Cvar *var)
+{
+	MemVirtual::SetDecayTime(var->GetInt());
+}
+static Cvar mem_decayTime("mem_decayTime", CVAR_ARCHIVE, "1000", "Time in milliseconds before freed memory blocks are returned to the system", 0, 60000, NULL, DecayTimeHook);
+
+// Cvar enabling transparent huge pages for block memory
+static void HugePagesHook(Cvar *var)
+{
+	MemVirtual::SetHugePages(var->GetBool());
+}
+static Cvar mem_hugePages("mem_hugePages", CVAR_ARCHIVE, "0", "Back memory pools with 2MB transparent huge pages", 0, 1, NULL, HugePagesHook);
+
+#endif
@@ -4,25 +4,94 @@
 
 namespace MemVirtual {
 
+// Reserve the address space used for blocks
+void Init();
+
 #ifndef _WIN32
 // Store the size of a mmap allocation in a hash table. The allocation size can
 // then be retrieved using ReleaseMmap, which also removes it from the table.
 void RegisterMmap(void *addr, size_t size);
 size_t ReleaseMmap(void *addr);
+
+// Same as ReleaseMmap, but returns 0 if the address isn't in the table
+size_t TryReleaseMmap(void *addr);
 #endif
 
-// Allocate a 64KB block of memory. This is more efficient than allocating
-// another size.
-__malloc void *AllocBlock();
+// Allocate a span of 1, 2, 4 or 8 contiguous 64KB blocks of memory, aligned
+// to the size of the span.
+__malloc void *AllocSpan(int numBlocks);
+
+// Free a span of blocks allocated with AllocSpan. The span stays committed
+// for a while so that it can be reused, see SetDecayTime.
+void FreeSpan(void *span, int numBlocks);
+
+// Decommit freed spans which have been unused for longer than the decay time,
+// or all of them if all is set. This is called periodically by a background
+// thread started by Init.
+void Purge(bool all);
+
+// Enable or disable backing blocks with transparent huge pages. Blocks are
+// then packed into 2MB superblocks, which are only decommitted once all of
+// their blocks are free.
+void SetHugePages(bool enable);
+
+// Set the time in milliseconds after which freed spans are decommitted. A
+// time of 0 decommits spans as soon as they are freed.
+void SetDecayTime(int msec);
+
+// Get the number of blocks in the span containing a pointer
+int GetSpanBlocks(void *ptr);
 
-// Free a 64KB block of memory allocated with AllocBlock
-void FreeBlock(void *block);
+// Get the amount of address space reserved for blocks, and the amount of
+// memory committed in it
+size_t GetReservedBytes();
+size_t GetCommittedBytes();
+
+// Get the amount of committed memory in freed spans waiting to be decommitted
+size_t GetDecayingBytes();
 
 // Check if a pointer is inside a block
 bool IsBlockPtr(void *ptr);
 
+// Get the byte holding the memory tag of an object in a block. The tag map of
+// a region is only created when create is set, otherwise NULL is returned if
+// it doesn't exist yet.
+uint8_t *GetTagSlot(void *ptr, bool create);
+
 }
 
+// STL allocator which uses the C library heap directly. This is used for the
+// tables kept by the allocator itself, which are modified while holding a
+// lock that freeing memory from the main heap may need to take again.
+template<typename T> class SysStlAllocator {
+public:
+	typedef T value_type;
+
+	SysStlAllocator() {}
+	template<typename U> SysStlAllocator(const SysStlAllocator<U> &) {}
+
+	T *allocate(size_t n)
+	{
+		void *ptr = malloc(n * sizeof(T));
+		if (!ptr)
+			Error("Out of memory (Tried to allocate %d bytes)", static_cast<int>(n * sizeof(T)));
+		return static_cast<T *>(ptr);
+	}
+	void deallocate(T *ptr, size_t)
+	{
+		free(ptr);
+	}
+
+	template<typename U> bool operator==(const SysStlAllocator<U> &) const
+	{
+		return true;
+	}
+	template<typename U> bool operator!=(const SysStlAllocator<U> &) const
+	{
+		return false;
+	}
+};
+
 #ifndef _WIN32
 // mmap wrapper to allocate anonymous memory
 inline void *anonymous_mmap(void *addr, size_t size, int prot, int flags)
@@ -1,6 +1,6 @@
 //@@COPYRIGHT@@
 
-static std::mutex printLock;
+static thread::profiled_lock<std::mutex> printLock{"printLock"};
 static std::vector<printHandler_t> printHandlers;
 // FIXME: Cvar
 //static Cvar com_debug("com_debug", 0, "0", "Enables debug messages");
@@ -14,20 +14,24 @@ public:
 
 static void PrintDispatch(const std::string& msg)
 {
-	std::lock_guard<std::mutex> locked(printLock);
+	// Memory used by the console and logs to store messages is charged to
+	// the console
+	MemTagScope scope(MEMTAG_CONSOLE);
+	std::lock_guard<decltype(printLock)> locked(printLock);
 	for (printHandler_t i: printHandlers)
 		i(msg);
 }
 
 void RegisterPrintHandler(printHandler_t handler)
 {
-	std::lock_guard<std::mutex> locked(printLock);
+	MemTagScope scope(MEMTAG_CONSOLE);
+	std::lock_guard<decltype(printLock)> locked(printLock);
 	printHandlers.push_back(handler);
 }
 
 void RemovePrintHandler(printHandler_t handler)
 {
-	std::lock_guard<std::mutex> locked(printLock);
+	std::lock_guard<decltype(printLock)> locked(printLock);
 	printHandlers.erase(std::remove(printHandlers.begin(), printHandlers.end(), handler), printHandlers.end());
 }
 
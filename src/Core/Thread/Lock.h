@@ -17,6 +17,9 @@ inline void spin_pause()
 #endif
 }
 
+// Size of a cache line, used to avoid false sharing
+const size_t CACHE_LINE_SIZE = 64;
+
 // Spinlock with same interface as std::mutex
 class spinlock: boost::noncopyable {
 public:
@@ -46,6 +49,146 @@ private:
 	std::atomic<bool> locked{false};
 };
 
+// Ticket lock with same interface as std::mutex. Threads acquire the lock in
+// the order in which they arrive, unlike spinlock which is unfair.
+class ticket_lock: boost::noncopyable {
+public:
+	void lock()
+	{
+		unsigned int ticket = next_ticket.fetch_add(1, std::memory_order_relaxed);
+		while (true) {
+			unsigned int serving = now_serving.load(std::memory_order_acquire);
+			if (serving == ticket)
+				return;
+
+			// Back off in proportion to our position in the queue
+			for (unsigned int i = ticket - serving; i != 0; i--)
+				spin_pause();
+		}
+	}
+
+	bool try_lock()
+	{
+		unsigned int serving = now_serving.load(std::memory_order_relaxed);
+		return next_ticket.compare_exchange_strong(serving, serving + 1, std::memory_order_acquire, std::memory_order_relaxed);
+	}
+
+	void unlock()
+	{
+		// Only the owner writes to now_serving, so no atomic increment needed
+		now_serving.store(now_serving.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+private:
+	// Keep the counters on separate cache lines so that arriving threads
+	// don't disturb the waiting threads.
+	alignas(CACHE_LINE_SIZE) std::atomic<unsigned int> next_ticket{0};
+	alignas(CACHE_LINE_SIZE) std::atomic<unsigned int> now_serving{0};
+};
+
+// MCS queue lock with same interface as std::mutex. Waiters form a queue and
+// each one spins on a flag in its own cache line, which avoids cache line
+// storms under heavy contention. The lock is handed over in FIFO order.
+// Queue nodes come from a small per-thread pool, which limits the number of
+// MCS locks a thread can hold at once to MCS_MAX_LOCKS.
+const int MCS_MAX_LOCKS = 32;
+class mcs_lock: boost::noncopyable {
+public:
+	void lock()
+	{
+		node* self = alloc_node();
+
+		// Add ourselves to the end of the queue, and wait for our
+		// predecessor to hand over the lock.
+		node* prev = tail.exchange(self, std::memory_order_acq_rel);
+		if (prev) {
+			prev->next.store(self, std::memory_order_release);
+			while (self->locked.load(std::memory_order_acquire))
+				spin_pause();
+		}
+
+		owner = self;
+	}
+
+	bool try_lock()
+	{
+		node* self = alloc_node();
+		node* expected = nullptr;
+		if (tail.compare_exchange_strong(expected, self, std::memory_order_acquire, std::memory_order_relaxed)) {
+			owner = self;
+			return true;
+		}
+
+		free_node(self);
+		return false;
+	}
+
+	void unlock()
+	{
+		node* self = owner;
+		node* next = self->next.load(std::memory_order_acquire);
+		if (!next) {
+			// If we are the last in the queue, just clear the tail
+			node* expected = self;
+			if (tail.compare_exchange_strong(expected, nullptr, std::memory_order_release, std::memory_order_relaxed)) {
+				free_node(self);
+				return;
+			}
+
+			// Otherwise wait for the next thread to link itself in
+			while (!(next = self->next.load(std::memory_order_acquire)))
+				spin_pause();
+		}
+
+		next->locked.store(false, std::memory_order_release);
+		free_node(self);
+	}
+
+private:
+	// Queue node, each on its own cache line
+	struct alignas(CACHE_LINE_SIZE) node {
+		std::atomic<node*> next;
+		std::atomic<bool> locked;
+	};
+
+	// Per-thread node pool and bitmask of nodes in use
+	struct node_pool {
+		node nodes[MCS_MAX_LOCKS];
+		uint32_t used;
+	};
+	static node_pool& get_pool()
+	{
+		static thread_local node_pool pool;
+		return pool;
+	}
+
+	// Get a free node from the pool and initialize it
+	static node* alloc_node()
+	{
+		node_pool& pool = get_pool();
+		AssertMsg((~pool.used != 0), "Too many mcs_locks held by one thread");
+		int index = IntFFS(~pool.used);
+		pool.used |= 1u << index;
+		node* n = &pool.nodes[index];
+		n->next.store(nullptr, std::memory_order_relaxed);
+		n->locked.store(true, std::memory_order_relaxed);
+		return n;
+	}
+
+	// Return a node to the pool. Nodes may be released in any order.
+	static void free_node(node* n)
+	{
+		node_pool& pool = get_pool();
+		pool.used &= ~(1u << (n - pool.nodes));
+	}
+
+	// Last node in the queue, NULL if the lock is free
+	std::atomic<node*> tail{nullptr};
+
+	// Node of the thread holding the lock, only accessed by the owner
+	node* owner;
+};
+
 // Semaphore wrapper which avoids system calls when it can
 class semaphore: boost::noncopyable {
 public:
@@ -119,4 +262,273 @@ private:
 #endif
 };
 
+// Number of times the adaptive locks spin before putting the thread to sleep
+const int ADAPTIVE_SPIN_COUNT = 100;
+
+// Mutex which spins for a bounded amount of time and then puts the thread to
+// sleep. This avoids burning a whole timeslice when the thread holding the
+// lock has been preempted. Same interface as std::mutex.
+// Waiters sleep on a semaphore, which uses a futex on Linux.
+class adaptive_mutex: boost::noncopyable {
+public:
+	void lock()
+	{
+		// Spin only while there are no sleeping waiters, since the lock is
+		// handed directly to a waiter when it is released.
+		for (int i = 0; i < ADAPTIVE_SPIN_COUNT; i++) {
+			int value = count.load(std::memory_order_relaxed);
+			if (value == 0 && try_lock())
+				return;
+			if (value > 1)
+				break;
+			spin_pause();
+		}
+
+		// Register as a waiter and sleep until the lock is handed to us
+		if (count.fetch_add(1, std::memory_order_acquire) > 0)
+			sem.wait();
+	}
+
+	bool try_lock()
+	{
+		int expected = 0;
+		return count.compare_exchange_strong(expected, 1, std::memory_order_acquire, std::memory_order_relaxed);
+	}
+
+	void unlock()
+	{
+		// Wake up a waiter if there is one
+		if (count.fetch_sub(1, std::memory_order_release) > 1)
+			sem.post();
+	}
+
+private:
+	// Number of threads holding or waiting for the lock
+	std::atomic<int> count{0};
+	semaphore sem;
+};
+
+// Reader/writer lock for read-mostly data, with the same spin-then-sleep
+// behavior as adaptive_mutex. Writers have priority over new readers.
+// Has the same interface as std::shared_timed_mutex, without the timed
+// functions, so it can be used with std::lock_guard and shared_lock_guard.
+class adaptive_shared_mutex: boost::noncopyable {
+public:
+	void lock()
+	{
+		for (int i = 0; i < ADAPTIVE_SPIN_COUNT; i++) {
+			if (status.load(std::memory_order_relaxed) == 0 && try_lock())
+				return;
+			spin_pause();
+		}
+
+		// Register as a writer and wait for the current owners to finish
+		uint32_t old = status.fetch_add(WRITER, std::memory_order_acquire);
+		if (old != 0)
+			writeSem.wait();
+	}
+
+	bool try_lock()
+	{
+		uint32_t expected = 0;
+		return status.compare_exchange_strong(expected, WRITER, std::memory_order_acquire, std::memory_order_relaxed);
+	}
+
+	void unlock()
+	{
+		uint32_t old = status.load(std::memory_order_relaxed);
+		uint32_t newStatus, waitingReaders;
+		do {
+			// Let all readers which were waiting for us through, they
+			// have priority over the next writer.
+			waitingReaders = field(old, WAIT_TO_READ);
+			newStatus = old - WRITER;
+			if (waitingReaders != 0)
+				newStatus = newStatus - waitingReaders * WAIT_TO_READ + waitingReaders * READER;
+		} while (!status.compare_exchange_weak(old, newStatus, std::memory_order_release, std::memory_order_relaxed));
+
+		if (waitingReaders != 0)
+			readSem.post(waitingReaders);
+		else if (field(old, WRITER) > 1)
+			writeSem.post();
+	}
+
+	void lock_shared()
+	{
+		for (int i = 0; i < ADAPTIVE_SPIN_COUNT; i++) {
+			if (field(status.load(std::memory_order_relaxed), WRITER) == 0 && try_lock_shared())
+				return;
+			spin_pause();
+		}
+
+		// Become a reader, or a waiting reader if there is a writer
+		uint32_t old = status.load(std::memory_order_relaxed);
+		uint32_t newStatus;
+		do {
+			if (field(old, WRITER) != 0)
+				newStatus = old + WAIT_TO_READ;
+			else
+				newStatus = old + READER;
+		} while (!status.compare_exchange_weak(old, newStatus, std::memory_order_acquire, std::memory_order_relaxed));
+
+		if (field(old, WRITER) != 0)
+			readSem.wait();
+	}
+
+	bool try_lock_shared()
+	{
+		uint32_t old = status.load(std::memory_order_relaxed);
+		do {
+			if (field(old, WRITER) != 0)
+				return false;
+		} while (!status.compare_exchange_weak(old, old + READER, std::memory_order_acquire, std::memory_order_relaxed));
+		return true;
+	}
+
+	void unlock_shared()
+	{
+		// The last reader wakes up a waiting writer
+		uint32_t old = status.fetch_sub(READER, std::memory_order_release);
+		if (field(old, READER) == 1 && field(old, WRITER) != 0)
+			writeSem.post();
+	}
+
+private:
+	// The status word contains 3 10-bit counters, which limits the number
+	// of threads using the lock to 1023.
+	static const uint32_t READER = 1;
+	static const uint32_t WAIT_TO_READ = 1 << 10;
+	static const uint32_t WRITER = 1 << 20;
+
+	// Extract one of the counters from the status word
+	static uint32_t field(uint32_t value, uint32_t unit)
+	{
+		return (value / unit) & 1023;
+	}
+
+	std::atomic<uint32_t> status{0};
+	semaphore readSem, writeSem;
+};
+
+// Equivalent of std::lock_guard which locks a mutex in shared mode
+template<typename Mutex> class shared_lock_guard: boost::noncopyable {
+public:
+	explicit shared_lock_guard(Mutex& m)
+		: mutex(m)
+	{
+		mutex.lock_shared();
+	}
+
+	~shared_lock_guard()
+	{
+		mutex.unlock_shared();
+	}
+
+private:
+	Mutex& mutex;
+};
+
+// Sequence lock for small trivially copyable values which are written rarely
+// and read often. Readers never write to shared memory, they just copy the
+// value and retry if a writer modified it in the meantime. Writers are
+// serialized with a spinlock and never wait for readers.
+template<typename T> class seqlock: boost::noncopyable {
+	static_assert(std::is_trivially_copyable<T>::value, "seqlock requires a trivially copyable type");
+
+public:
+	seqlock()
+	{
+		store(T());
+	}
+
+	explicit seqlock(const T& value)
+	{
+		store(value);
+	}
+
+	// Get a consistent copy of the value
+	T load() const
+	{
+		word_t buffer[NUM_WORDS];
+		while (true) {
+			unsigned int before = sequence.load(std::memory_order_acquire);
+
+			// Wait for any writer to finish
+			if (before & 1) {
+				spin_pause();
+				continue;
+			}
+
+			for (size_t i = 0; i < NUM_WORDS; i++)
+				buffer[i] = data[i].load(std::memory_order_relaxed);
+
+			// Make sure the data reads happen before the second read
+			// of the sequence number
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (sequence.load(std::memory_order_relaxed) == before)
+				break;
+		}
+
+		T value;
+		memcpy(&value, buffer, sizeof(T));
+		return value;
+	}
+
+	// Replace the value
+	void store(const T& value)
+	{
+		word_t buffer[NUM_WORDS] = {};
+		memcpy(buffer, &value, sizeof(T));
+
+		std::lock_guard<spinlock> locked(writeLock);
+		begin_write();
+		for (size_t i = 0; i < NUM_WORDS; i++)
+			data[i].store(buffer[i], std::memory_order_relaxed);
+		end_write();
+	}
+
+	// Modify the value in place. Readers will retry until the function
+	// has returned, so it should be short.
+	template<typename Func> void update(Func func)
+	{
+		std::lock_guard<spinlock> locked(writeLock);
+		word_t buffer[NUM_WORDS];
+		for (size_t i = 0; i < NUM_WORDS; i++)
+			buffer[i] = data[i].load(std::memory_order_relaxed);
+		T value;
+		memcpy(&value, buffer, sizeof(T));
+
+		func(value);
+
+		memcpy(buffer, &value, sizeof(T));
+		begin_write();
+		for (size_t i = 0; i < NUM_WORDS; i++)
+			data[i].store(buffer[i], std::memory_order_relaxed);
+		end_write();
+	}
+
+private:
+	// The value is copied one word at a time using relaxed atomics, which
+	// compile to plain moves but avoid a data race with the writer.
+	typedef uintptr_t word_t;
+	static const size_t NUM_WORDS = (sizeof(T) + sizeof(word_t) - 1) / sizeof(word_t);
+
+	// An odd sequence number means a write is in progress
+	void begin_write()
+	{
+		unsigned int seq = sequence.load(std::memory_order_relaxed);
+		sequence.store(seq + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+	}
+	void end_write()
+	{
+		unsigned int seq = sequence.load(std::memory_order_relaxed);
+		sequence.store(seq + 1, std::memory_order_release);
+	}
+
+	std::atomic<unsigned int> sequence{0};
+	std::atomic<word_t> data[NUM_WORDS];
+	spinlock writeLock;
+};
+
 }
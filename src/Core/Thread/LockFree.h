@@ -440,10 +440,11 @@ public:
 
 		// Insert items into the private list in reverse order
 		while (node_traits::get_next(list) != nullptr) {
+			node_ptr next = node_traits::get_next(list);
 			if (use_safe_link)
 				node_algorithms::init(list);
-			private_list.push_front(*node_traits::to_value_ptr(list));
-			list = node_traits::get_next(list);
+			private_list.push_front(*value_traits::to_value_ptr(list));
+			list = next;
 		}
 
 		// Return the last item
@@ -451,6 +452,71 @@ public:
 			node_algorithms::init(list);
 		return value_traits::to_value_ptr(list);
 	}
+
+	// Dequeue all items in the queue and pass them to func in FIFO order.
+	// The public list is only flushed and reversed once, so items enqueued
+	// while this is running are left for the next call. If func throws, the
+	// items which were not processed yet stay in the queue. Returns the
+	// number of items processed.
+	// This function can only be called from one thread at a time.
+	template<typename Func> size_type dequeue_all(Func func)
+	{
+		size_type count = 0;
+
+		// Items in the private list are older than those in the public list
+		while (!private_list.empty()) {
+			reference item = private_list.front();
+			private_list.pop_front();
+			func(item);
+			count++;
+		}
+
+		// Flush the public list and reverse it in place, which gives us FIFO
+		// order, then walk the chain directly instead of going through the
+		// private list.
+		node_ptr list = public_list.flush();
+		node_ptr head = nullptr;
+		while (list != nullptr) {
+			node_ptr next = node_traits::get_next(list);
+			node_traits::set_next(list, head);
+			head = list;
+			list = next;
+		}
+		while (head != nullptr) {
+			node_ptr next = node_traits::get_next(head);
+			if (use_safe_link)
+				node_algorithms::init(head);
+			try {
+				func(*value_traits::to_value_ptr(head));
+			} catch (...) {
+				// Keep the rest of the chain in the private list, which
+				// is empty at this point
+				iterator pos = private_list.before_begin();
+				while (next != nullptr) {
+					node_ptr after = node_traits::get_next(next);
+					if (use_safe_link)
+						node_algorithms::init(next);
+					pos = private_list.insert_after(pos, *value_traits::to_value_ptr(next));
+					next = after;
+				}
+				throw;
+			}
+			count++;
+			head = next;
+		}
+		return count;
+	}
+
+	// Dequeue all items in the queue and write pointers to them to out.
+	// Returns the output iterator after the last item written.
+	// This function can only be called from one thread at a time.
+	template<typename OutputIterator> OutputIterator drain_into(OutputIterator out)
+	{
+		dequeue_all([&out](reference item) {
+			*out++ = &item;
+		});
+		return out;
+	}
 };
 
 // Lock-free FIFO single-consumer, multiple-producer queue
@@ -486,7 +552,7 @@ private:
 
 	// Queue containing data and the allocator
 	struct data_and_alloc_t: public node_allocator {
-		intrusive_queue_sc<node, hook> data;
+		intrusive_queue_sc<node, intrusive::base_hook<hook>> data;
 
 		// Initialize allocator
 		data_and_alloc_t(const Alloc& alloc)
@@ -553,6 +619,37 @@ public:
 
 		return ret;
 	}
+
+	// Dequeue all items in the queue and pass them to func in FIFO order.
+	// This avoids the overhead of boost::optional and only flushes the
+	// producer list once. Returns the number of items processed.
+	// This function can only be called from one thread at a time.
+	template<typename Func> size_type dequeue_all(Func func)
+	{
+		return data_and_alloc.data.dequeue_all([this, &func](node& item) {
+			// Free the node even if func throws
+			try {
+				func(std::move(item.obj));
+			} catch (...) {
+				data_and_alloc.destroy(&item);
+				data_and_alloc.deallocate(&item, 1);
+				throw;
+			}
+			data_and_alloc.destroy(&item);
+			data_and_alloc.deallocate(&item, 1);
+		});
+	}
+
+	// Dequeue all items in the queue and move them to out. Returns the
+	// output iterator after the last item written.
+	// This function can only be called from one thread at a time.
+	template<typename OutputIterator> OutputIterator drain_into(OutputIterator out)
+	{
+		dequeue_all([&out](T&& item) {
+			*out++ = std::move(item);
+		});
+		return out;
+	}
 };
 
 }
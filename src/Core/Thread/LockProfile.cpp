@@ -0,0 +1,117 @@
+//@@COPYRIGHT@@
+
+#ifdef USE_LOCK_PROFILE
+
+namespace thread {
+
+// All lock sites, indexed by name. This uses a plain std::mutex so that it
+// doesn't show up in the profile.
+static std::mutex& site_lock()
+{
+	static std::mutex lock;
+	return lock;
+}
+static std::map<std::string, lock_site*>& site_map()
+{
+	static std::map<std::string, lock_site*> sites;
+	return sites;
+}
+
+lock_site* lock_site::get(const char* name)
+{
+	std::lock_guard<std::mutex> locked(site_lock());
+	lock_site*& site = site_map()[name];
+	if (!site) {
+		site = new lock_site();
+		site->name = name;
+	}
+	return site;
+}
+
+void lock_site::record_wait(uint64_t usec)
+{
+	wait_time.fetch_add(usec, std::memory_order_relaxed);
+	int bucket = usec == 0 ? 0 : std::min(IntLog2(std::min<uint64_t>(usec, UINT32_MAX)) + 1, LOCK_PROFILE_BUCKETS - 1);
+	histogram[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+}
+
+// The unit tests don't have a console
+#ifndef BUILD_TEST
+
+// Lockprofile command
+static void LockProfile_f(CmdArgs *args)
+{
+	// Command help
+	if (!args) {
+		Printf("usage: lockprofile [reset]");
+		Printf("Shows contention statistics for all named locks, or clears them.");
+		return;
+	}
+
+	std::lock_guard<std::mutex> locked(thread::site_lock());
+	bool reset = args->Argc() >= 2 && !strcmp(args->Argv(1), "reset");
+
+	// Sort sites by total wait time, worst first
+	std::vector<thread::lock_site*> sites;
+	for (auto& i: thread::site_map())
+		sites.push_back(i.second);
+	std::sort(sites.begin(), sites.end(), [](thread::lock_site* a, thread::lock_site* b) {
+		return a->wait_time.load(std::memory_order_relaxed) > b->wait_time.load(std::memory_order_relaxed);
+	});
+
+	for (thread::lock_site* site: sites) {
+		if (reset) {
+			site->acquisitions.store(0, std::memory_order_relaxed);
+			site->contended.store(0, std::memory_order_relaxed);
+			site->wait_time.store(0, std::memory_order_relaxed);
+			for (auto& i: site->histogram)
+				i.store(0, std::memory_order_relaxed);
+			continue;
+		}
+
+		uint64_t acquisitions = site->acquisitions.load(std::memory_order_relaxed);
+		uint64_t contended = site->contended.load(std::memory_order_relaxed);
+		uint64_t waitTime = site->wait_time.load(std::memory_order_relaxed);
+		Printf("%s: %d acquisitions, %d contended (%.1f%%), %dus waited, %.1fus average wait",
+		       site->name, acquisitions, contended, acquisitions ? 100.0 * contended / acquisitions : 0.0,
+		       waitTime, contended ? static_cast<double>(waitTime) / contended : 0.0);
+
+		// Print the non-empty histogram buckets
+		std::string histogram;
+		for (int i = 0; i < thread::LOCK_PROFILE_BUCKETS; i++) {
+			uint64_t count = site->histogram[i].load(std::memory_order_relaxed);
+			if (count)
+				histogram += va(" <%dus:%d", 1 << i, count);
+		}
+		if (!histogram.empty())
+			Printf("   %s", histogram);
+	}
+
+	if (reset)
+		Printf("Lock profile cleared");
+	else
+		Printf("%d lock sites", sites.size());
+}
+
+void thread::lock_profile_init()
+{
+	Cmd::Register("lockprofile", LockProfile_f);
+}
+
+#else
+
+void thread::lock_profile_init()
+{
+}
+
+#endif
+
+#else
+
+void thread::lock_profile_init()
+{
+}
+
+#endif
@@ -0,0 +1,128 @@
+//@@COPYRIGHT@@
+
+// Lock contention profiler. Build with USE_LOCK_PROFILE=1 to enable it,
+// otherwise profiled_lock is just the underlying lock.
+
+namespace thread {
+
+// Register the lockprofile command
+void lock_profile_init();
+
+#ifdef USE_LOCK_PROFILE
+
+// Number of buckets in the wait time histogram. Bucket 0 counts waits of
+// less than 1us, and bucket i counts waits in the range [2^(i-1), 2^i) us.
+// The last bucket also counts all longer waits.
+const int LOCK_PROFILE_BUCKETS = 20;
+
+// Statistics for all locks sharing the same name. These are never freed.
+struct lock_site {
+	const char* name;
+	std::atomic<uint64_t> acquisitions;
+	std::atomic<uint64_t> contended;
+	std::atomic<uint64_t> wait_time; // In microseconds
+	std::atomic<uint64_t> histogram[LOCK_PROFILE_BUCKETS];
+
+	// Get the site for a lock name, creating it if necessary
+	EXPORT static lock_site* get(const char* name);
+
+	// Record a contended acquisition which waited for the given time
+	EXPORT void record_wait(uint64_t usec);
+};
+
+// Wrapper around a lock type which records statistics in a named lock site.
+// The uncontended path only adds one relaxed atomic increment.
+template<typename Lock> class profiled_lock: boost::noncopyable {
+public:
+	// The name must be a string literal. Locks with the same name share
+	// their statistics. The site is looked up on first use so that global
+	// locks can be used during static initialization.
+	constexpr explicit profiled_lock(const char* name_)
+		: name(name_), site_ptr(nullptr) {}
+
+	void lock()
+	{
+		if (inner.try_lock()) {
+			site()->acquisitions.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+
+		auto start = std::chrono::steady_clock::now();
+		inner.lock();
+		record_contended(start);
+	}
+
+	bool try_lock()
+	{
+		if (!inner.try_lock())
+			return false;
+		site()->acquisitions.fetch_add(1, std::memory_order_relaxed);
+		return true;
+	}
+
+	void unlock()
+	{
+		inner.unlock();
+	}
+
+	void lock_shared()
+	{
+		if (inner.try_lock_shared()) {
+			site()->acquisitions.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+
+		auto start = std::chrono::steady_clock::now();
+		inner.lock_shared();
+		record_contended(start);
+	}
+
+	bool try_lock_shared()
+	{
+		if (!inner.try_lock_shared())
+			return false;
+		site()->acquisitions.fetch_add(1, std::memory_order_relaxed);
+		return true;
+	}
+
+	void unlock_shared()
+	{
+		inner.unlock_shared();
+	}
+
+private:
+	Lock inner;
+	const char* name;
+	std::atomic<lock_site*> site_ptr;
+
+	lock_site* site()
+	{
+		lock_site* s = site_ptr.load(std::memory_order_acquire);
+		if (__builtin_expect(!s, 0)) {
+			s = lock_site::get(name);
+			site_ptr.store(s, std::memory_order_release);
+		}
+		return s;
+	}
+
+	void record_contended(std::chrono::steady_clock::time_point start)
+	{
+		auto wait = std::chrono::steady_clock::now() - start;
+		lock_site* s = site();
+		s->acquisitions.fetch_add(1, std::memory_order_relaxed);
+		s->contended.fetch_add(1, std::memory_order_relaxed);
+		s->record_wait(std::chrono::duration_cast<std::chrono::microseconds>(wait).count());
+	}
+};
+
+#else
+
+// Profiling disabled, the name is ignored
+template<typename Lock> class profiled_lock: public Lock {
+public:
+	constexpr explicit profiled_lock(const char*) {}
+};
+
+#endif
+
+}
@@ -22,11 +22,14 @@ struct task {
 // Initial size for work stealing queue and global queue
 static const int INITIAL_JOBQUEUE_SIZE = 32;
 
+// Lock used to protect job queues, named for the lock profiler
+typedef thread::profiled_lock<thread::spinlock> queue_lock;
+
 // Work-stealing queue
 template<typename T> class work_steal_queue {
 public:
 	work_steal_queue(int length_)
-		: length{length_}, head_index{0}, tail_index{0}
+		: length{length_}, lock{"work_steal_queue"}, head_index{0}, tail_index{0}
 	{
 		items = new T[length];
 	}
@@ -44,7 +47,7 @@ public:
 		// Check if we have space to insert an element
 		if (tail == length) {
 			// Lock the queue
-			std::lock_guard<thread::spinlock> locked(lock);
+			std::lock_guard<queue_lock> locked(lock);
 			int head = head_index.load(std::memory_order_relaxed);
 
 			// Resize the queue if it is more than 75% full
@@ -86,7 +89,7 @@ public:
 			return items[tail];
 
 		// There is a concurrent steal, lock the queue and try again
-		std::lock_guard<thread::spinlock> locked(lock);
+		std::lock_guard<queue_lock> locked(lock);
 
 		// Check if the item is still available
 		if (head_index.load(std::memory_order_relaxed) <= tail)
@@ -101,7 +104,7 @@ public:
 	T steal()
 	{
 		// Lock the queue to prevent concurrent steals
-		std::lock_guard<thread::spinlock> locked(lock);
+		std::lock_guard<queue_lock> locked(lock);
 
 		// Make sure head is stored before we read tail
 		int head = head_index.load(std::memory_order_relaxed);
@@ -123,7 +126,7 @@ public:
 private:
 	T* items;
 	int length;
-	thread::spinlock lock;
+	queue_lock lock;
 	std::atomic<int> head_index, tail_index;
 };
 
@@ -132,12 +135,12 @@ private:
 template<typename T> class locked_queue {
 public:
 	locked_queue(size_t length)
-		: queue{length} {}
+		: queue{length}, lock{"locked_queue"} {}
 
 	// Push a job to the end of the queue
 	void push(T job)
 	{
-		std::lock_guard<thread::spinlock> locked(lock);
+		std::lock_guard<queue_lock> locked(lock);
 
 		// Resize queue if it is full
 		if (queue.full())
@@ -150,7 +153,7 @@ public:
 	// Pop a job from the front of the queue
 	T pop()
 	{
-		std::lock_guard<thread::spinlock> locked(lock);
+		std::lock_guard<queue_lock> locked(lock);
 
 		// See if an item is available
 		if (queue.empty())
@@ -164,7 +167,7 @@ public:
 
 private:
 	boost::circular_buffer<T> queue;
-	thread::spinlock lock;
+	queue_lock lock;
 };
 
 // Currently active task for a thread.
@@ -55,8 +55,10 @@
 #include <functional>
 #include <iterator>
 #include <thread>
+#include <chrono>
 #include <atomic>
 #include <mutex>
+#include <condition_variable>
 #include <string>
 #include <array>
 #include <vector>
@@ -149,17 +151,25 @@ union floatInt_t {
 #include "Core/Math/Plane.h"
 
 #include "Core/Thread/Lock.h"
+#include "Core/Thread/LockProfile.h"
 #include "Core/Thread/ThreadPool.h"
 #include "Core/Thread/LockFree.h"
 
-#include "Core/Filesystem/Filesystem.h"
-
-/*
 #include "Core/Memory/Memory.h"
 #include "Core/Memory/Virtual.h"
 #include "Core/Memory/Pool.h"
+#include "Core/Memory/Tag.h"
+#include "Core/Memory/Stats.h"
+#include "Core/Memory/Profiler.h"
 #include "Core/Memory/Arena.h"
+#include "Core/Memory/Resource.h"
+#include "Core/Memory/StringTable.h"
 
+#include "Core/Filesystem/Filesystem.h"
+#include "Core/Filesystem/AsyncIO.h"
+#include "Core/Memory/MappedArena.h"
+
+/*
 #include "Core/Console.h"
 #include "Core/Command.h"
 #include "Core/Cvar.h"
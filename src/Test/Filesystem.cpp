@@ -0,0 +1,435 @@
+//@@COPYRIGHT@@
+
+// Unit tests and benchmarks for the filesystem
+
+TestSuite(FilesystemTest)
+
+#ifndef _WIN32
+// Create a temporary file for I/O tests, returns its path
+static std::string TestFilePath(const char* name)
+{
+	return std::string("/tmp/") + name + std::to_string(getpid());
+}
+
+// Run a function with each available asynchronous I/O backend
+template<typename Func> static void ForEachBackend(Func func)
+{
+	for (bool uring: {true, false}) {
+		bool used = Filesystem::AsyncIO::Init(uring);
+		if (uring && !used) {
+			TestMsg("io_uring is not available, only testing the thread backend");
+			Filesystem::AsyncIO::Shutdown();
+			continue;
+		}
+		func(used ? "io_uring" : "threads");
+		Filesystem::AsyncIO::Shutdown();
+	}
+}
+
+TestCase(AsyncIOReadWrite)
+{
+	static const int COUNT = 64;
+	static const size_t SIZE = 4096;
+	std::string path = TestFilePath("asyncIOTest");
+	int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	TestCheck(fd != -1);
+
+	ForEachBackend([&](const char* name) {
+		TestMsg("Testing " << name);
+
+		// Write blocks in reverse order, each filled with its index
+		std::vector<char> data(COUNT * SIZE);
+		std::atomic<int> written(0);
+		for (int i = COUNT - 1; i >= 0; i--) {
+			memset(&data[i * SIZE], i, SIZE);
+			Filesystem::AsyncIO::Write(fd, &data[i * SIZE], SIZE, i * SIZE, [&written](std::error_code err, size_t bytes) {
+				if (!err && bytes == SIZE)
+					written++;
+			});
+		}
+		threadpool::wait_for_all();
+		TestCheckEqual(written.load(), COUNT);
+
+		// Read them back, including a short read at the end of the file
+		std::vector<char> result(COUNT * SIZE);
+		std::atomic<int> matched(0);
+		for (int i = 0; i < COUNT; i++) {
+			Filesystem::AsyncIO::Read(fd, &result[i * SIZE], SIZE, i * SIZE, [&matched, &result, i](std::error_code err, size_t bytes) {
+				if (!err && bytes == SIZE && std::all_of(&result[i * SIZE], &result[(i + 1) * SIZE], [i](char c) {return c == static_cast<char>(i);}))
+					matched++;
+			});
+		}
+		size_t tail = 0;
+		std::vector<char> tailData(SIZE);
+		Filesystem::AsyncIO::Read(fd, tailData.data(), SIZE, COUNT * SIZE - 100, [&tail](std::error_code, size_t bytes) {
+			tail = bytes;
+		});
+		threadpool::wait_for_all();
+		TestCheckEqual(matched.load(), COUNT);
+		TestCheckEqual(tail, 100u);
+
+		// Errors are passed to the callback
+		std::error_code error;
+		Filesystem::AsyncIO::Read(-1, &result[0], SIZE, 0, [&error](std::error_code err, size_t) {
+			error = err;
+		});
+		threadpool::wait_for_all();
+		TestCheckEqual(error.value(), EBADF);
+	});
+
+	close(fd);
+	unlink(path.c_str());
+}
+
+// Byte stored at each offset of the batch test files
+static inline char TestPattern(Filesystem::fsOffset_t offset)
+{
+	return static_cast<char>(offset * 7 + (offset >> 8));
+}
+
+// Create a file filled with TestPattern, returns its descriptor
+static int CreatePatternFile(const std::string& path, size_t size)
+{
+	int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	std::vector<char> data(size);
+	for (size_t i = 0; i < size; i++)
+		data[i] = TestPattern(i);
+	if (pwrite(fd, data.data(), size, 0) != ssize_t(size)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+TestCase(AsyncIOReadBatch)
+{
+	const size_t FILE_SIZE = 256 << 10;
+	std::string path = TestFilePath("asyncIOBatch");
+	int fd = CreatePatternFile(path, FILE_SIZE);
+	TestCheck(fd != -1);
+
+	// Unsorted ranges which are adjacent, overlapping, disjoint, and past the
+	// end of the file
+	struct {
+		size_t length;
+		Filesystem::fsOffset_t offset;
+	} layout[] = {
+		{1024, 8192}, {256, 0}, {512, 256}, {4096, 768}, {100, 4000},
+		{2048, 7000}, {0, 50000}, {65536, 100000}, {1000, FILE_SIZE - 300}, {10, FILE_SIZE + 10}
+	};
+	const size_t COUNT = sizeof(layout) / sizeof(layout[0]);
+	size_t expected = 0;
+	for (auto& i: layout)
+		expected += std::min<size_t>(i.length, std::max<Filesystem::fsOffset_t>(FILE_SIZE - i.offset, 0));
+
+	ForEachBackend([&](const char* name) {
+		TestMsg("Testing " << name);
+		std::vector<std::vector<char>> buffers(COUNT);
+		std::vector<Filesystem::readRange_t> ranges;
+		for (size_t i = 0; i < COUNT; i++) {
+			buffers[i].assign(layout[i].length + 1, 0);
+			ranges.push_back(Filesystem::readRange_t{buffers[i].data(), layout[i].length, layout[i].offset});
+		}
+		std::error_code error;
+		size_t total = 0;
+		int calls = 0;
+		Filesystem::AsyncIO::ReadBatch(fd, ranges.data(), ranges.size(), [&](std::error_code err, size_t bytes) {
+			error = err;
+			total = bytes;
+			calls++;
+		});
+		threadpool::wait_for_all();
+		TestCheckEqual(calls, 1);
+		TestCheck(!error);
+		TestCheckEqual(total, expected);
+
+		// Each buffer holds its part of the file, and nothing is written past
+		// the end of the range
+		for (size_t i = 0; i < COUNT; i++) {
+			size_t valid = std::min<size_t>(layout[i].length, std::max<Filesystem::fsOffset_t>(FILE_SIZE - layout[i].offset, 0));
+			bool matches = true;
+			for (size_t j = 0; j < valid; j++)
+				matches &= buffers[i][j] == TestPattern(layout[i].offset + j);
+			TestCheck(matches);
+			TestCheckEqual(buffers[i][layout[i].length], 0);
+		}
+
+		// Overlapping ranges are read through a bounce buffer, which also
+		// works with O_DIRECT when the ranges are aligned. It is too large
+		// for the pools, which would happen to align it.
+		int directFd = open(path.c_str(), O_RDONLY | O_DIRECT);
+		if (directFd != -1) {
+			std::vector<char> first(65536), second(65536);
+			Filesystem::readRange_t overlapping[] = {{first.data(), 65536, 0}, {second.data(), 65536, 512}};
+			Filesystem::AsyncIO::ReadBatch(directFd, overlapping, 2, [&](std::error_code err, size_t bytes) {
+				error = err;
+				total = bytes;
+			});
+			threadpool::wait_for_all();
+			TestCheck(!error);
+			TestCheckEqual(total, 131072u);
+			TestCheckEqual(second[0], TestPattern(512));
+			close(directFd);
+		}
+
+		// Empty batches still complete
+		calls = 0;
+		Filesystem::AsyncIO::ReadBatch(fd, NULL, 0, [&calls](std::error_code, size_t) {
+			calls++;
+		});
+		threadpool::wait_for_all();
+		TestCheckEqual(calls, 1);
+	});
+
+	close(fd);
+	unlink(path.c_str());
+}
+
+TestCase(AsyncIOReadBatchBenchmark)
+{
+	// Each asset is read as a header, a table and several chunks, which are
+	// mostly next to each other in the file
+	static const int ASSETS = 500;
+	static const int CHUNKS = 16;
+	static const size_t ASSET_SIZE = 64 << 10;
+	std::string path = TestFilePath("asyncIOBatchBench");
+	int fd = CreatePatternFile(path, ASSETS * ASSET_SIZE);
+	TestCheck(fd != -1);
+
+	std::vector<Filesystem::readRange_t> ranges;
+	std::vector<char> buffer(ASSETS * ASSET_SIZE);
+	for (int i = 0; i < ASSETS; i++) {
+		Filesystem::fsOffset_t base = i * ASSET_SIZE;
+		char* dest = &buffer[base];
+		ranges.push_back(Filesystem::readRange_t{dest, 64, base});
+		ranges.push_back(Filesystem::readRange_t{dest + 64, 960, base + 64});
+		for (int j = 0; j < CHUNKS; j++)
+			ranges.push_back(Filesystem::readRange_t{dest + 1024 + j * 2048, 2048, base + 1024 + j * 2048});
+	}
+	const size_t PER_ASSET = CHUNKS + 2;
+
+	ForEachBackend([&](const char* name) {
+		std::atomic<size_t> bytes(0);
+		double single = TestTime([&] {
+			for (const Filesystem::readRange_t& i: ranges) {
+				Filesystem::AsyncIO::Read(fd, i.buffer, i.length, i.offset, [&bytes](std::error_code, size_t result) {
+					bytes += result;
+				});
+			}
+			threadpool::wait_for_all();
+		});
+		size_t singleBytes = bytes;
+		bytes = 0;
+		double batch = TestTime([&] {
+			for (int i = 0; i < ASSETS; i++) {
+				Filesystem::AsyncIO::ReadBatch(fd, &ranges[i * PER_ASSET], PER_ASSET, [&bytes](std::error_code, size_t result) {
+					bytes += result;
+				});
+			}
+			threadpool::wait_for_all();
+		});
+		TestCheckEqual(singleBytes, bytes.load());
+		TestMsg(name << ", " << ASSETS << " assets of " << PER_ASSET << " ranges: separate reads " << single / ASSETS << "us, batched " << batch / ASSETS << "us per asset");
+	});
+
+	close(fd);
+	unlink(path.c_str());
+}
+
+// Create a file for read benchmarks and open it for reading, returns its
+// descriptor. O_DIRECT is used if the filesystem supports it, so that the
+// reads go to the device instead of the page cache.
+static int CreateReadBenchFile(const std::string& path, size_t size, bool& direct)
+{
+	int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+		return -1;
+	std::vector<char> block(1 << 20, 1);
+	for (size_t i = 0; i < size; i += block.size()) {
+		if (pwrite(fd, block.data(), block.size(), i) != ssize_t(block.size())) {
+			close(fd);
+			return -1;
+		}
+	}
+	close(fd);
+	direct = true;
+	fd = open(path.c_str(), O_RDONLY | O_DIRECT);
+	if (fd == -1) {
+		direct = false;
+		fd = open(path.c_str(), O_RDONLY);
+	}
+	return fd;
+}
+
+TestCase(AsyncIOQueueDepthBenchmark)
+{
+	// Random 64KB reads from a 64MB file, with a fixed number of reads in
+	// flight, as when streaming assets
+	static const size_t FILE_SIZE = 64 << 20;
+	static const size_t READ_SIZE = 64 << 10;
+	static const int READS = 1024;
+	std::string path = TestFilePath("asyncIOBench");
+	bool direct;
+	int fd = CreateReadBenchFile(path, FILE_SIZE, direct);
+	TestCheck(fd != -1);
+
+	// Each slot issues its next read from its completion callback
+	struct reader_t {
+		int fd;
+		char* buffers;
+		std::atomic<int> issued;
+		std::atomic<int> completed;
+		void Next(int slot)
+		{
+			int i = issued++;
+			if (i >= READS)
+				return;
+			uint64_t offset = (i * 2654435761u) % (FILE_SIZE / READ_SIZE) * READ_SIZE;
+			Filesystem::AsyncIO::Read(fd, buffers + slot * READ_SIZE, READ_SIZE, offset, [this, slot](std::error_code err, size_t bytes) {
+				if (!err && bytes == READ_SIZE)
+					completed++;
+				Next(slot);
+			});
+		}
+	};
+	char* buffers = static_cast<char*>(MemAllocAligned(64 * READ_SIZE, 4096));
+	ForEachBackend([&](const char* name) {
+		for (int depth: {1, 4, 16, 64}) {
+			reader_t reader;
+			reader.fd = fd;
+			reader.buffers = buffers;
+			reader.issued = 0;
+			reader.completed = 0;
+			double elapsed = TestTime([&reader, depth] {
+				for (int i = 0; i < depth; i++)
+					reader.Next(i);
+				threadpool::wait_for_all();
+			});
+			TestCheckEqual(reader.completed.load(), READS);
+			TestMsg(name << ", queue depth " << depth << (direct ? " (direct)" : " (page cache)") << ": " << READS * double(READ_SIZE) / elapsed << "MB/s, " << elapsed / READS << "us per read");
+		}
+	});
+	MemFree(buffers);
+	close(fd);
+	unlink(path.c_str());
+}
+
+TestCase(AsyncIOPriority)
+{
+	// The current class of the thread is set for a scope
+	Filesystem::ioDeadline_t deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+	TestCheckEqual(Filesystem::GetIOClass().priority, Filesystem::IO_PRIORITY_NORMAL);
+	{
+		Filesystem::IOClassScope scope(Filesystem::ioClass_t(Filesystem::IO_PRIORITY_PREFETCH, deadline));
+		TestCheckEqual(Filesystem::GetIOClass().priority, Filesystem::IO_PRIORITY_PREFETCH);
+		TestCheck(Filesystem::GetIOClass().deadline == deadline);
+	}
+	TestCheckEqual(Filesystem::GetIOClass().priority, Filesystem::IO_PRIORITY_NORMAL);
+	TestCheck(Filesystem::GetIOClass().deadline == Filesystem::ioDeadline_t::max());
+
+	// A flood of 64KB prefetch reads is submitted, then a chain of urgent
+	// reads, each issued when the previous one completes, as when the game
+	// stalls on an asset while the level is streaming in
+	static const size_t FILE_SIZE = 64 << 20;
+	static const size_t READ_SIZE = 64 << 10;
+	static const int FLOOD = 1024;
+	static const int URGENT = 16;
+	std::string path = TestFilePath("asyncIOPriority");
+	bool direct;
+	int fd = CreateReadBenchFile(path, FILE_SIZE, direct);
+	TestCheck(fd != -1);
+	char* buffers = static_cast<char*>(MemAllocAligned(2 * READ_SIZE, 4096));
+
+	struct urgent_t {
+		int fd;
+		char* buffer;
+		Filesystem::ioClass_t cls;
+		int remaining;
+		std::chrono::steady_clock::time_point start;
+		double total;
+		double worst;
+		void Next()
+		{
+			start = std::chrono::steady_clock::now();
+			uint64_t offset = (remaining * 40503u) % (FILE_SIZE / READ_SIZE) * READ_SIZE;
+			Filesystem::AsyncIO::Read(fd, buffer, READ_SIZE, offset, [this](std::error_code, size_t) {
+				double latency = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+				total += latency;
+				worst = std::max(worst, latency);
+				if (--remaining)
+					Next();
+			}, cls);
+		}
+	};
+
+	// Print the average and worst latency of the urgent reads
+	auto measure = [&](const char* name, const char* test, Filesystem::ioClass_t floodClass, Filesystem::ioClass_t urgentClass) {
+		std::atomic<int> flooded(0);
+		for (int i = 0; i < FLOOD; i++) {
+			uint64_t offset = (i * 2654435761u) % (FILE_SIZE / READ_SIZE) * READ_SIZE;
+			Filesystem::AsyncIO::Read(fd, buffers, READ_SIZE, offset, [&flooded](std::error_code err, size_t bytes) {
+				if (!err && bytes == READ_SIZE)
+					flooded++;
+			}, floodClass);
+		}
+		urgent_t urgent;
+		urgent.fd = fd;
+		urgent.buffer = buffers + READ_SIZE;
+		urgent.cls = urgentClass;
+		urgent.remaining = URGENT;
+		urgent.total = 0;
+		urgent.worst = 0;
+		urgent.Next();
+		threadpool::wait_for_all();
+		TestCheckEqual(flooded.load(), FLOOD);
+		TestMsg(name << ", " << test << (direct ? " (direct)" : " (page cache)") << ": average " << urgent.total / URGENT << "us, worst " << urgent.worst << "us");
+	};
+
+	// Prefetches submitted as a single batch are all queued before the other
+	// requests are submitted. Every other block is read so that the ranges
+	// aren't merged. A critical request and a prefetch whose deadline has
+	// passed are then dispatched before the rest of the queued prefetches,
+	// so they complete before the batch does.
+	std::vector<Filesystem::readRange_t> prefetches;
+	for (int i = 0; i < FLOOD / 2; i++) {
+		uint64_t offset = (i * 2654435761u) % (FILE_SIZE / READ_SIZE / 2) * 2 * READ_SIZE;
+		prefetches.push_back(Filesystem::readRange_t{buffers, READ_SIZE, static_cast<Filesystem::fsOffset_t>(offset)});
+	}
+	auto order = [&](const char* name) {
+		using namespace Filesystem;
+		std::atomic<int> completed(0);
+		int batchPos = -1, criticalPos = -1, expiredPos = -1;
+		size_t batchBytes = 0;
+		AsyncIO::ReadBatch(fd, prefetches.data(), prefetches.size(), [&](std::error_code, size_t bytes) {
+			batchBytes = bytes;
+			batchPos = completed++;
+		}, IO_PRIORITY_PREFETCH);
+		AsyncIO::Read(fd, buffers + READ_SIZE, READ_SIZE, 0, [&](std::error_code, size_t) {
+			criticalPos = completed++;
+		}, IO_PRIORITY_CRITICAL);
+		AsyncIO::Read(fd, buffers + READ_SIZE, READ_SIZE, READ_SIZE, [&](std::error_code, size_t) {
+			expiredPos = completed++;
+		}, ioClass_t(IO_PRIORITY_PREFETCH, std::chrono::steady_clock::now()));
+		threadpool::wait_for_all();
+		TestCheckEqual(completed.load(), 3);
+		TestCheckEqual(batchBytes, prefetches.size() * READ_SIZE);
+		TestCheck(criticalPos < batchPos);
+		TestCheck(expiredPos < batchPos);
+		TestMsg(name << ": completion order batch " << batchPos << ", critical " << criticalPos << ", expired prefetch " << expiredPos);
+	};
+
+	ForEachBackend([&](const char* name) {
+		using namespace Filesystem;
+		order(name);
+		measure(name, "all normal", IO_PRIORITY_NORMAL, IO_PRIORITY_NORMAL);
+		measure(name, "critical under prefetch", IO_PRIORITY_PREFETCH, IO_PRIORITY_CRITICAL);
+		measure(name, "expired prefetch under prefetch", IO_PRIORITY_PREFETCH, ioClass_t(IO_PRIORITY_PREFETCH, std::chrono::steady_clock::now()));
+	});
+
+	MemFree(buffers);
+	close(fd);
+	unlink(path.c_str());
+}
+#endif
+
+EndTestSuite()
@@ -0,0 +1,1387 @@
+//@@COPYRIGHT@@
+
+// Unit tests and benchmarks for the memory allocators
+
+TestSuite(MemoryTest)
+
+TestCase(MemAllocSizes)
+{
+	// Allocate sizes up to the largest pool size and beyond
+	std::vector<std::pair<char*, size_t>> ptrs;
+	for (size_t size = 1; size <= 40000; size += size / 16 + 1) {
+		char *ptr = static_cast<char*>(MemAlloc(size));
+		TestCheckEqual(reinterpret_cast<uintptr_t>(ptr) % 8, 0u);
+		memset(ptr, size & 0xff, size);
+		ptrs.emplace_back(ptr, size);
+	}
+
+	// Check that no allocations overlap
+	for (auto& i: ptrs)
+		TestCheck(std::all_of(i.first, i.first + i.second, [&i](char c) {return c == static_cast<char>(i.second & 0xff);}));
+
+	// Free half with the sized version
+	for (size_t i = 0; i < ptrs.size(); i++) {
+		if (i % 2)
+			MemFree(ptrs[i].first, ptrs[i].second);
+		else
+			MemFree(ptrs[i].first);
+	}
+	MemFree(nullptr);
+}
+
+TestCase(MemReallocSizes)
+{
+	// Growing within a size class stays in place
+	char* ptr = static_cast<char*>(MemAlloc(100));
+	memset(ptr, 1, 100);
+	TestCheckEqual(MemRealloc(ptr, 110), ptr);
+
+	// Growing through the pools, then to the system allocator and large
+	// mappings, keeps the contents
+	size_t size = 110;
+	for (size_t newSize: {1000, 20000, 100000, 1 << 20, 4 << 20, 300000, 500, 50}) {
+		ptr = static_cast<char*>(MemRealloc(ptr, newSize));
+		TestCheck(std::all_of(ptr, ptr + std::min<size_t>(newSize, 100), [](char c) {return c == 1;}));
+		TestCheckEqual(reinterpret_cast<uintptr_t>(ptr) % 16, 0u);
+		if (newSize > size)
+			memset(ptr + size, 2, newSize - size);
+		size = newSize;
+	}
+	TestCheck(MemRealloc(ptr, 0) == nullptr);
+	ptr = static_cast<char*>(MemRealloc(nullptr, 10));
+	MemFree(ptr);
+}
+
+TestCase(MemAllocAlignedSizes)
+{
+	std::vector<void*> ptrs;
+	for (size_t align: {32, 64, 4096}) {
+		for (size_t size = 1; size <= 100000; size = size * 3 + 1) {
+			char* ptr = static_cast<char*>(MemAllocAligned(size, align));
+			TestCheckEqual(reinterpret_cast<uintptr_t>(ptr) % align, 0u);
+			memset(ptr, 0, size);
+			ptrs.push_back(ptr);
+		}
+	}
+	for (void* i: ptrs)
+		MemFree(i);
+
+	// Containers of over-aligned types
+	struct alignas(64) cacheLine_t {
+		int value;
+	};
+	std::vector<cacheLine_t, StlAllocator<cacheLine_t>> lines;
+	for (int i = 0; i < 1000; i++) {
+		lines.push_back(cacheLine_t{i});
+		TestCheckEqual(reinterpret_cast<uintptr_t>(&lines.front()) % 64, 0u);
+	}
+	TestCheckEqual(lines[999].value, 999);
+
+	// Scalar types with an explicit alignment, as used for SIMD arrays
+	std::vector<float, StlAllocator<float, 32>> floats;
+	for (int i = 0; i < 1000; i++) {
+		floats.push_back(i);
+		TestCheckEqual(reinterpret_cast<uintptr_t>(floats.data()) % 32, 0u);
+	}
+	TestCheckEqual(floats[999], 999.0f);
+}
+
+TestCase(MemReallocBenchmark)
+{
+	// Grow buffers in small steps, as done when appending to a buffer
+	const int COUNT = 10;
+	const size_t STEP = 4096;
+	const size_t MAX_SIZE = 1 << 20;
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < COUNT; i++) {
+		void* ptr = nullptr;
+		for (size_t size = STEP; size <= MAX_SIZE; size += STEP)
+			ptr = MemRealloc(ptr, size);
+		MemFree(ptr);
+	}
+	double realloc = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+	start = std::chrono::steady_clock::now();
+	for (int i = 0; i < COUNT; i++) {
+		void* ptr = nullptr;
+		for (size_t size = STEP; size <= MAX_SIZE; size += STEP) {
+			void* newPtr = MemAlloc(size);
+			if (ptr)
+				memcpy(newPtr, ptr, size - STEP);
+			MemFree(ptr);
+			ptr = newPtr;
+		}
+		MemFree(ptr);
+	}
+	double copy = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+	TestMsg("Growing to " << MAX_SIZE / 1024 << "KB in " << STEP << " byte steps: MemRealloc " << realloc / COUNT << "us, copy " << copy / COUNT << "us");
+}
+
+// Object using a memory pool
+struct TestPoolObject: public UseMemPool<TestPoolObject> {
+	virtual ~TestPoolObject() {}
+	long data[5];
+};
+struct TestPoolDerived: public TestPoolObject {
+	long extra[7];
+};
+
+TestCase(MemPoolObjects)
+{
+	std::vector<TestPoolObject*> objects;
+	for (int i = 0; i < 10000; i++) {
+		if (i % 3)
+			objects.push_back(new TestPoolObject);
+		else
+			objects.push_back(new TestPoolDerived);
+		objects.back()->data[0] = i;
+	}
+	for (int i = 0; i < 10000; i++)
+		TestCheckEqual(objects[i]->data[0], i);
+	for (TestPoolObject* i: objects)
+		delete i;
+}
+
+TestCase(MemPoolCrossThreadFree)
+{
+	// Allocate in one thread and free in another, enough to fill several
+	// blocks so that they go through the partial list.
+	const int COUNT = 20000;
+	std::vector<void*> ptrs(COUNT);
+	std::thread producer([&] {
+		for (int i = 0; i < COUNT; i++) {
+			ptrs[i] = MemPool<64>::Alloc();
+			memset(ptrs[i], 0, 64);
+		}
+	});
+	producer.join();
+	std::thread consumer([&] {
+		for (void* i: ptrs)
+			MemPool<64>::Free(i);
+	});
+	consumer.join();
+
+	// Reuse the freed memory
+	for (int i = 0; i < COUNT; i++)
+		ptrs[i] = MemPool<64>::Alloc();
+	for (void* i: ptrs)
+		MemPool<64>::Free(i);
+}
+
+// Small entity-style object, allocated in large numbers every tick
+struct TestEntity: public UseMemPool<TestEntity> {
+	float origin[3];
+	float velocity[3];
+	int id;
+};
+
+TestCase(ObjectPoolBulk)
+{
+	typedef ObjectPool<TestEntity> pool;
+	const int COUNT = 10000;
+	std::vector<TestEntity*> objects(COUNT);
+	MemStats::heapStats_t before = MemStats::GetHeapStats();
+	pool::AllocateBulk(COUNT, objects.data());
+	for (int i = 0; i < COUNT; i++) {
+		TestCheck(reinterpret_cast<uintptr_t>(objects[i]) % 8 == 0);
+		objects[i]->id = i;
+	}
+	std::set<TestEntity*> unique(objects.begin(), objects.end());
+	TestCheckEqual(unique.size(), size_t(COUNT));
+	for (int i = 0; i < COUNT; i++)
+		TestCheckEqual(objects[i]->id, i);
+
+	// Handles stay valid while the object is alive
+	pool::handle_t handle = pool::GetHandle(objects[0]);
+	TestCheck(pool::IsValid(handle));
+	TestCheckEqual(pool::Get(handle), objects[0]);
+
+	// Free half of the objects on another thread, so that whole runs are
+	// pushed onto remote free lists, and the rest on this thread
+	std::thread other([&objects] {
+		pool::FreeBulk(objects.data(), COUNT / 2);
+	});
+	other.join();
+	pool::FreeBulk(objects.data() + COUNT / 2, COUNT - COUNT / 2);
+#ifdef DEBUG
+	TestCheck(!pool::IsValid(handle));
+#endif
+
+	// Allocate again to reuse the freed memory, and compare the statistics
+	pool::AllocateBulk(COUNT, objects.data());
+	for (TestEntity* i: objects)
+		i->id = 0;
+	MemStats::heapStats_t during = MemStats::GetHeapStats();
+	pool::FreeBulk(objects);
+	MemStats::heapStats_t after = MemStats::GetHeapStats();
+	uint64_t allocs = 0, frees = 0, allocsBefore = 0, freesBefore = 0;
+	for (size_t i = 0; i < during.pools.size(); i++) {
+		allocs += during.pools[i].allocs;
+		frees += after.pools[i].frees;
+	}
+	for (const MemStats::poolStats_t& i: before.pools) {
+		allocsBefore += i.allocs;
+		freesBefore += i.frees;
+	}
+	TestCheck(allocs - allocsBefore >= 2u * COUNT);
+	TestCheck(frees - freesBefore >= 2u * COUNT);
+
+	pool::Delete(pool::New());
+}
+
+TestCase(ObjectPoolBenchmark)
+{
+	// Allocate and free 10k objects per tick, one at a time through
+	// UseMemPool and all at once through ObjectPool
+	const int COUNT = 10000;
+	const int TICKS = 100;
+	std::vector<TestEntity*> objects(COUNT);
+	double single = TestTime([&objects] {
+		for (int tick = 0; tick < TICKS; tick++) {
+			for (int i = 0; i < COUNT; i++)
+				objects[i] = new TestEntity;
+			for (TestEntity* i: objects)
+				delete i;
+		}
+	});
+	double bulk = TestTime([&objects] {
+		for (int tick = 0; tick < TICKS; tick++) {
+			ObjectPool<TestEntity>::AllocateBulk(COUNT, objects.data());
+			for (TestEntity* i: objects)
+				::new(i) TestEntity;
+			ObjectPool<TestEntity>::FreeBulk(objects);
+		}
+	});
+	TestMsg(COUNT << " objects per tick: new/delete " << single / TICKS << "us, ObjectPool bulk " << bulk / TICKS << "us");
+}
+
+TestCase(SpanAllocation)
+{
+	// Allocate spans from several threads at once, using more blocks than
+	// are currently reserved so that new regions need to be added.
+	const int NUM_THREADS = 4;
+	size_t reserved = MemVirtual::GetReservedBytes();
+
+	// Each thread cycles through spans of 1, 2, 4 and 8 blocks
+	int count = (reserved / MemPoolImpl::BLOCK_SIZE / NUM_THREADS / 15 + 1) * 4;
+	std::vector<std::vector<void*>> spans(NUM_THREADS);
+	std::vector<std::thread> threads;
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < NUM_THREADS; i++) {
+		threads.emplace_back([&, i] {
+			for (int j = 0; j < count; j++) {
+				int numBlocks = 1 << (j % 4);
+				void* span = MemVirtual::AllocSpan(numBlocks);
+				*static_cast<int*>(span) = i;
+				spans[i].push_back(span);
+			}
+		});
+	}
+	for (std::thread& i: threads)
+		i.join();
+	double elapsed = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+	TestCheck(MemVirtual::GetReservedBytes() > reserved);
+
+	// Check that all spans are aligned, have the right size and that no span
+	// was handed out twice
+	std::set<void*> seen;
+	for (int i = 0; i < NUM_THREADS; i++) {
+		for (int j = 0; j < count; j++) {
+			void* span = spans[i][j];
+			int numBlocks = 1 << (j % 4);
+			TestCheckEqual(*static_cast<int*>(span), i);
+			TestCheckEqual(MemVirtual::GetSpanBlocks(span), numBlocks);
+			TestCheckEqual(reinterpret_cast<uintptr_t>(span) % (numBlocks * MemPoolImpl::BLOCK_SIZE), 0u);
+			TestCheck(MemVirtual::IsBlockPtr(span));
+			TestCheck(seen.insert(span).second);
+		}
+	}
+	TestMsg("Allocated " << NUM_THREADS * count << " spans on " << NUM_THREADS << " threads in " << elapsed / 1000 << "ms");
+
+	for (int i = 0; i < NUM_THREADS; i++) {
+		for (int j = 0; j < count; j++)
+			MemVirtual::FreeSpan(spans[i][j], 1 << (j % 4));
+	}
+}
+
+TestCase(SpanDecay)
+{
+	// Freed spans stay committed and are reused first
+	MemVirtual::Purge(true);
+	size_t committed = MemVirtual::GetCommittedBytes();
+	void* span = MemVirtual::AllocSpan(2);
+	memset(span, 1, 2 * MemPoolImpl::BLOCK_SIZE);
+	MemVirtual::FreeSpan(span, 2);
+	TestCheckEqual(MemVirtual::GetDecayingBytes(), 2u * MemPoolImpl::BLOCK_SIZE);
+	TestCheckEqual(MemVirtual::GetCommittedBytes(), committed + 2 * MemPoolImpl::BLOCK_SIZE);
+	TestCheckEqual(MemVirtual::AllocSpan(2), span);
+	TestCheckEqual(MemVirtual::GetDecayingBytes(), 0u);
+
+	// Purging decommits them
+	MemVirtual::FreeSpan(span, 2);
+	MemVirtual::Purge(true);
+	TestCheckEqual(MemVirtual::GetDecayingBytes(), 0u);
+	TestCheckEqual(MemVirtual::GetCommittedBytes(), committed);
+}
+
+TestCase(HugePageAccounting)
+{
+	// Superblocks backed by huge pages are counted as committed until all of
+	// their spans are freed, even if huge pages are disabled in the meantime
+	const int COUNT = 64;
+	MemVirtual::Purge(true);
+	std::vector<void*> spans(COUNT);
+	size_t committed = MemVirtual::GetCommittedBytes();
+	for (bool disable: {false, true}) {
+		MemVirtual::SetHugePages(true);
+		for (void*& i: spans)
+			i = MemVirtual::AllocSpan(8);
+		TestCheck(MemVirtual::GetCommittedBytes() >= committed + COUNT * 8 * MemPoolImpl::BLOCK_SIZE);
+		if (disable)
+			MemVirtual::SetHugePages(false);
+
+		// Freeing half of the spans leaves their superblocks in use
+		for (int i = 0; i < COUNT; i += 2)
+			MemVirtual::FreeSpan(spans[i], 8);
+		MemVirtual::Purge(true);
+		TestCheck(MemVirtual::GetCommittedBytes() >= committed + COUNT / 2 * 8 * MemPoolImpl::BLOCK_SIZE);
+
+		for (int i = 1; i < COUNT; i += 2)
+			MemVirtual::FreeSpan(spans[i], 8);
+		MemVirtual::Purge(true);
+		TestCheckEqual(MemVirtual::GetCommittedBytes(), committed);
+	}
+	MemVirtual::SetHugePages(false);
+}
+
+TestCase(HugePageReuseRace)
+{
+	// Threads repeatedly fill a whole superblock and free it again, so that
+	// an emptied superblock is often claimed again by another thread before
+	// it is decommitted. It must only be counted once.
+	const int ITERATIONS = 500000;
+	const int SPANS = 32 / MemPoolImpl::MAX_SPAN_BLOCKS;
+	int numThreads = std::max(std::thread::hardware_concurrency(), 4u);
+	MemVirtual::Purge(true);
+	MemVirtual::SetDecayTime(0);
+	MemVirtual::SetHugePages(true);
+	size_t committed = MemVirtual::GetCommittedBytes();
+	std::vector<std::thread> threads;
+	for (int i = 0; i < numThreads; i++) {
+		threads.emplace_back([] {
+			void* spans[SPANS];
+			for (int j = 0; j < ITERATIONS; j++) {
+				for (void*& k: spans)
+					k = MemVirtual::AllocSpan(MemPoolImpl::MAX_SPAN_BLOCKS);
+				for (void* k: spans)
+					MemVirtual::FreeSpan(k, MemPoolImpl::MAX_SPAN_BLOCKS);
+			}
+		});
+	}
+	for (std::thread& i: threads)
+		i.join();
+	MemVirtual::SetHugePages(false);
+	MemVirtual::SetDecayTime(1000);
+	TestCheckEqual(MemVirtual::GetCommittedBytes(), committed);
+}
+
+// Allocate and free bursts of buffers large enough to release whole blocks
+static double AllocBurst(int bursts, int count, size_t size)
+{
+	std::vector<void*> ptrs(count);
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < bursts; i++) {
+		for (void*& j: ptrs) {
+			j = MemAlloc(size);
+			memset(j, 0, size);
+		}
+		for (void* j: ptrs)
+			MemFree(j, size);
+	}
+	return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+}
+
+TestCase(AllocBurstBenchmark)
+{
+	const int BURSTS = 50;
+	const int COUNT = 2000;
+	for (size_t size: {256, 16384}) {
+		MemVirtual::SetDecayTime(0);
+		double immediate = AllocBurst(BURSTS, COUNT, size);
+		MemVirtual::SetDecayTime(1000);
+		double decay = AllocBurst(BURSTS, COUNT, size);
+		TestMsg("Bursts of " << COUNT << " x " << size << " bytes: " << immediate / BURSTS << "us with immediate decommit, " << decay / BURSTS << "us with decay");
+	}
+	MemVirtual::Purge(true);
+}
+
+// Find the statistics for a pool by object size
+static MemStats::poolStats_t FindPoolStats(size_t objSize)
+{
+	MemStats::heapStats_t stats = MemStats::GetHeapStats();
+	for (auto& i: stats.pools) {
+		if (i.objSize == objSize)
+			return i;
+	}
+	return MemStats::poolStats_t();
+}
+
+TestCase(HeapStatistics)
+{
+	const int COUNT = 5000;
+	MemStats::poolStats_t before = FindPoolStats(384);
+	std::vector<void*> ptrs;
+	for (int i = 0; i < COUNT; i++)
+		ptrs.push_back(MemAlloc(300));
+
+	// Allocations made on another thread are counted too
+	std::thread other([&ptrs] {
+		for (int i = 0; i < COUNT; i++)
+			ptrs.push_back(MemAlloc(300));
+	});
+	other.join();
+
+	MemStats::poolStats_t during = FindPoolStats(384);
+	TestCheckEqual(during.liveObjects - before.liveObjects, 2 * COUNT);
+	TestCheckEqual(during.allocs - before.allocs, 2u * COUNT);
+	TestCheck(during.blocks >= 2 * COUNT * 384 / MemPoolImpl::BLOCK_SIZE);
+	TestCheck(during.blocks >= during.partialBlocks + during.threadBlocks);
+	for (void* i: ptrs)
+		MemFree(i);
+	TestCheckEqual(FindPoolStats(384).liveObjects, before.liveObjects);
+
+	// Large allocations go to the system allocator
+	MemStats::heapStats_t heap = MemStats::GetHeapStats();
+	void* large = MemAlloc(1 << 20);
+	MemStats::heapStats_t heapLarge = MemStats::GetHeapStats();
+	TestCheckEqual(heapLarge.sysAllocs - heap.sysAllocs, 1u);
+	TestCheck(heapLarge.sysLiveBytes - heap.sysLiveBytes >= 1 << 20);
+	TestCheck(heapLarge.committedBytes > 0);
+	MemFree(large);
+	TestCheckEqual(MemStats::GetHeapStats().sysLiveBytes, heap.sysLiveBytes);
+
+	std::string json = MemStats::FormatJSON(heapLarge);
+	TestCheck(json.find("\"pools\":[{\"objSize\":") != std::string::npos);
+}
+
+TestCase(ArenaMarks)
+{
+	MemArena<4096> arena;
+	void* first = arena.Alloc(100);
+	void* scratch;
+	{
+		ArenaMark<MemArena<4096>> mark(arena);
+		scratch = arena.Alloc(100);
+
+		// Nested marks can allocate past the end of the first block
+		{
+			ArenaMark<MemArena<4096>> inner(arena);
+			for (int i = 0; i < 100; i++)
+				memset(arena.Alloc(1000), 0, 1000);
+		}
+		TestCheckEqual(arena.Alloc(100), static_cast<void*>(static_cast<char*>(scratch) + 112));
+	}
+
+	// Blocks are kept after a rewind, so the same memory is handed out again
+	TestCheckEqual(arena.Alloc(100), scratch);
+	uint64_t blockAllocs = FindPoolStats(4096).allocs;
+	for (int i = 0; i < 100; i++)
+		memset(arena.Alloc(1000), 0, 1000);
+	TestCheckEqual(FindPoolStats(4096).allocs, blockAllocs);
+	arena.Reset();
+	TestCheckEqual(arena.Alloc(100), first);
+
+	// Large allocations get their own block
+	char* large = static_cast<char*>(arena.Alloc(10000));
+	memset(large, 1, 10000);
+	TestCheck(arena.Alloc(100) != nullptr);
+	TestCheckEqual(large[9999], 1);
+	arena.FreeAll();
+
+	MemArenaFixed<256> fixed;
+	void* start = fixed.Alloc(16);
+	{
+		ArenaMark<MemArenaFixed<256>> mark(fixed);
+		TestCheck(fixed.Alloc(200) != nullptr);
+		TestCheck(fixed.Alloc(200) == nullptr);
+	}
+	TestCheckEqual(fixed.Alloc(16), static_cast<void*>(static_cast<char*>(start) + 16));
+}
+
+TestCase(FrameArenas)
+{
+	// Memory stays valid for numFrames frames
+	MemFrameArena<4096, 3> frames;
+	std::vector<int*> history;
+	for (int frame = 0; frame < 10; frame++) {
+		frames.BeginFrame();
+		int* data = new(frames) int[1000];
+		std::fill(data, data + 1000, frame);
+		history.push_back(data);
+		for (int age = 0; age < 3 && age <= frame; age++)
+			TestCheckEqual(history[frame - age][999], frame - age);
+	}
+
+	// The oldest arena is reused
+	TestCheckEqual(history[9], history[6]);
+}
+
+TestCase(ArenaBenchmark)
+{
+	// Build temporary arrays of varying sizes, as done for scratch data in a
+	// frame, either with std::vector or in an arena.
+	const int ITERATIONS = 200000;
+	auto start = std::chrono::steady_clock::now();
+	int total = 0;
+	for (int i = 0; i < ITERATIONS; i++) {
+		std::vector<int> temp;
+		for (int j = 0; j < 16 + i % 64; j++)
+			temp.push_back(j);
+		std::vector<int> temp2(temp.size() / 2);
+		total += temp.back() + temp2.size();
+	}
+	double vector = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+
+	MemArena<65536> arena;
+	start = std::chrono::steady_clock::now();
+	int arenaTotal = 0;
+	for (int i = 0; i < ITERATIONS; i++) {
+		ArenaMark<MemArena<65536>> mark(arena);
+		int count = 16 + i % 64;
+		int* temp = static_cast<int*>(arena.Alloc(count * sizeof(int)));
+		for (int j = 0; j < count; j++)
+			temp[j] = j;
+		int* temp2 = new(arena) int[count / 2]();
+		arenaTotal += temp[count - 1] + count / 2 + (temp2[0] & 0);
+	}
+	double arenaTime = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+	TestCheckEqual(total, arenaTotal);
+	TestMsg("Scratch arrays: std::vector " << vector * 1000 / ITERATIONS << "ns, arena " << arenaTime * 1000 / ITERATIONS << "ns");
+}
+
+// Allocate objects from an arena on several threads, and check that they
+// don't overlap. Returns the time taken.
+template<typename Arena> static double ParallelArenaAlloc(Arena& arena, int numThreads, int count)
+{
+	std::vector<std::vector<int*>> ptrs(numThreads);
+	std::vector<std::thread> threads;
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < numThreads; i++) {
+		threads.emplace_back([&, i] {
+			ptrs[i].reserve(count);
+			for (int j = 0; j < count; j++) {
+				int size = 1 + j % 7;
+				int* ptr = new(arena) int[size];
+				std::fill(ptr, ptr + size, i);
+				ptrs[i].push_back(ptr);
+			}
+		});
+	}
+	for (std::thread& i: threads)
+		i.join();
+	double elapsed = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+	for (int i = 0; i < numThreads; i++) {
+		for (int j = 0; j < count; j++) {
+			int* ptr = ptrs[i][j];
+			TestCheckEqual(reinterpret_cast<uintptr_t>(ptr) % DEFAULT_MEMORY_ALIGNMENT, 0u);
+			TestCheck(std::all_of(ptr, ptr + 1 + j % 7, [i](int x) {return x == i;}));
+		}
+	}
+	return elapsed;
+}
+
+TestCase(ConcurrentArena)
+{
+	MemArenaConcurrent<4096> arena;
+	ParallelArenaAlloc(arena, 4, 10000);
+
+	// Large and over-aligned allocations
+	char* large = static_cast<char*>(arena.Alloc(100000));
+	memset(large, 0, 100000);
+	TestCheckEqual(reinterpret_cast<uintptr_t>(arena.Alloc(10, 256)) % 256, 0u);
+	arena.FreeAll();
+	TestCheck(arena.Alloc(10) != nullptr);
+}
+
+TestCase(ConcurrentArenaBenchmark)
+{
+	const int COUNT = 200000;
+	int maxThreads = std::max(std::thread::hardware_concurrency(), 2u);
+	for (int numThreads = 1; numThreads <= maxThreads; numThreads *= 2) {
+		double concurrent, locked;
+		{
+			MemArenaConcurrent<65536> arena;
+			concurrent = ParallelArenaAlloc(arena, numThreads, COUNT);
+		}
+		{
+			MemArenaThreadWrapper<MemArena<65536>> arena;
+			locked = ParallelArenaAlloc(arena, numThreads, COUNT);
+		}
+		double ops = static_cast<double>(numThreads) * COUNT;
+		TestMsg("Arena, " << numThreads << " threads: concurrent " << ops / concurrent << " allocs/us, locked " << ops / locked << " allocs/us");
+	}
+}
+
+TestCase(PmrContainers)
+{
+	MemArena<4096> arena;
+	pmr::arena_resource<MemArena<4096>> resource(arena);
+	MemArena<4096>::mark_t start = arena.GetMark();
+
+	// Nested containers allocate from the same arena
+	pmr::vector<pmr::string> strings(&resource);
+	for (int i = 0; i < 100; i++)
+		strings.emplace_back(va("a string long enough to need an allocation %d", i).c_str());
+	TestCheck(strings[99].get_allocator().get_resource() == &resource);
+	TestCheck(arena.GetMark().offset != start.offset);
+
+	pmr::unordered_map<pmr::string, int> map(16, std::hash<pmr::string>(), std::equal_to<pmr::string>(), &resource);
+	for (int i = 0; i < 100; i++)
+		map[strings[i]] = i;
+	TestCheckEqual(map[strings[42]], 42);
+
+	// Copies go back to the default resource
+	pmr::vector<pmr::string> copy(strings);
+	TestCheck(copy.get_allocator().get_resource() == pmr::get_default_resource());
+	TestCheck(copy == strings);
+
+	// Over-aligned types through the pool resource
+	struct alignas(64) cacheLine_t {
+		int value;
+	};
+	pmr::vector<cacheLine_t> lines;
+	lines.resize(100);
+	TestCheckEqual(reinterpret_cast<uintptr_t>(lines.data()) % 64, 0u);
+}
+
+// Allocate objects from a function which can be found in the profile
+static __attribute__((noinline)) void ProfiledAllocations(std::vector<void*>& ptrs, int count, size_t size)
+{
+	for (int i = 0; i < count; i++)
+		ptrs.push_back(MemAlloc(size));
+}
+
+TestCase(HeapProfiler)
+{
+	const int COUNT = 16384;
+	const size_t SIZE = 256;
+	std::vector<void*> ptrs;
+	ptrs.reserve(COUNT);
+	MemProfiler::Start(4096);
+	TestCheck(MemProfiler::IsRunning());
+	ProfiledAllocations(ptrs, COUNT, SIZE);
+
+	// About a thousand samples are taken, so the estimate should be close
+	size_t live = MemProfiler::GetLiveBytes();
+	TestMsg("Estimated " << live << " live bytes, actual " << COUNT * SIZE);
+	TestCheck(live > COUNT * SIZE * 3 / 4 && live < COUNT * SIZE * 5 / 4);
+	std::string profile = MemProfiler::FormatCollapsed();
+	TestCheck(!profile.empty() && profile.back() == '\n');
+	TestCheck(profile.find(';') != std::string::npos);
+
+	// Freed samples are no longer counted, even after stopping
+	MemProfiler::Stop();
+	TestCheck(!MemProfiler::IsRunning());
+	for (void* i: ptrs)
+		MemFree(i, SIZE);
+	TestCheck(MemProfiler::GetLiveBytes() < COUNT * SIZE / 16);
+	MemProfiler::Reset();
+	TestCheckEqual(MemProfiler::GetLiveBytes(), 0u);
+	TestCheck(MemProfiler::FormatCollapsed().empty());
+}
+
+TestCase(MemoryTags)
+{
+	const int COUNT = 100;
+	std::vector<void*> ptrs;
+	// Reserve outside of the scope, since with USE_MEMORY_OVERRIDE the
+	// vector would otherwise be charged to the tag
+	ptrs.reserve(COUNT + 1);
+	int64_t before = MemStats::GetHeapStats().tagLiveBytes[MEMTAG_FILESYSTEM];
+	{
+		MemTagScope scope(MEMTAG_FILESYSTEM);
+		TestCheckEqual(MemTag::GetCurrent(), MEMTAG_FILESYSTEM);
+		{
+			MemTagScope inner(MEMTAG_CONSOLE);
+			TestCheckEqual(MemTag::GetCurrent(), MEMTAG_CONSOLE);
+		}
+		TestCheckEqual(MemTag::GetCurrent(), MEMTAG_FILESYSTEM);
+		for (int i = 0; i < COUNT; i++)
+			ptrs.push_back(MemAlloc(1000));
+		ptrs.push_back(MemAlloc(1 << 20));
+	}
+	TestCheckEqual(MemTag::GetCurrent(), MEMTAG_GENERAL);
+
+	// Objects are charged for their size class
+	int64_t during = MemStats::GetHeapStats().tagLiveBytes[MEMTAG_FILESYSTEM] - before;
+	TestCheck(during >= COUNT * 1000 + (1 << 20) && during <= COUNT * 2048 + (1 << 20));
+	TestCheck(MemStats::FormatJSON(MemStats::GetHeapStats()).find("\"filesystem\":") != std::string::npos);
+
+	// Memory is refunded to its own tag, whichever tag is current when it is
+	// freed
+	{
+		MemTagScope scope(MEMTAG_GAME);
+		for (int i = 0; i < COUNT; i++)
+			MemFree(ptrs[i], 1000);
+		MemFree(ptrs[COUNT]);
+	}
+	TestCheckEqual(MemStats::GetHeapStats().tagLiveBytes[MEMTAG_FILESYSTEM], before);
+
+	// Arenas allocate their blocks with their own tag
+	int64_t gameBefore = MemTag::GetLiveBytes(MEMTAG_GAME);
+	{
+		MemArena<1024> arena(MEMTAG_GAME);
+		for (int i = 0; i < 100; i++)
+			arena.Alloc(100);
+		TestCheck(MemTag::GetLiveBytes(MEMTAG_GAME) - gameBefore >= 9000);
+	}
+	TestCheckEqual(MemTag::GetLiveBytes(MEMTAG_GAME), gameBefore);
+
+	// Allocations over the hard budget fail, and aren't charged
+	MemTag::SetBudget(MEMTAG_CVAR, 256 * 1024, 1 << 20);
+	int64_t cvarBefore = MemTag::GetLiveBytes(MEMTAG_CVAR);
+	bool failed = false;
+	void* small;
+	{
+		MemTagScope scope(MEMTAG_CVAR);
+		small = MemAlloc(512 * 1024);
+		try {
+			MemAlloc(2 << 20);
+		} catch (std::runtime_error&) {
+			failed = true;
+		}
+	}
+	TestCheck(failed);
+	TestCheckEqual(MemTag::GetLiveBytes(MEMTAG_CVAR) - cvarBefore, 512 * 1024);
+	MemFree(small);
+	MemTag::SetBudget(MEMTAG_CVAR, 0, 0);
+}
+
+TestCase(StringInterning)
+{
+	// Equal strings are interned once, and strings which only differ by case
+	// share a canonical version and hash
+	char buffer[] = "test_stringTable";
+	const char* a = StringTable::Intern("test_stringTable");
+	const char* b = StringTable::Intern(buffer);
+	const char* upper = StringTable::Intern("TEST_STRINGTABLE");
+	TestCheckEqual(static_cast<const void*>(a), static_cast<const void*>(b));
+	TestCheck(static_cast<const void*>(a) != static_cast<const void*>(buffer));
+	TestCheck(static_cast<const void*>(a) != static_cast<const void*>(upper));
+	TestCheckEqual(strcmp(upper, "TEST_STRINGTABLE"), 0);
+	TestCheckEqual(StringTable::Length(a), strlen(buffer));
+	TestCheckEqual(StringTable::Hash(a), StringTable::Hash(upper));
+	TestCheckEqual(static_cast<const void*>(StringTable::Canonical(a)), static_cast<const void*>(a));
+	TestCheckEqual(static_cast<const void*>(StringTable::Canonical(upper)), static_cast<const void*>(a));
+	TestCheckEqual(static_cast<const void*>(StringTable::FindNoCase("Test_StringTable")), static_cast<const void*>(a));
+	TestCheck(!StringTable::FindNoCase("test_stringTableUnknown"));
+
+	// Objects registered under a name are found with any capitalization, and
+	// each type is kept separately
+	int cvar, command;
+	StringTable::SetObject(upper, StringTable::OBJECT_CVAR, &cvar);
+	StringTable::SetObject(a, StringTable::OBJECT_COMMAND, &command);
+	TestCheckEqual(StringTable::FindObject("Test_StringTable", StringTable::OBJECT_CVAR), static_cast<void*>(&cvar));
+	TestCheckEqual(StringTable::FindObject("test_stringtable", StringTable::OBJECT_COMMAND), static_cast<void*>(&command));
+	TestCheck(!StringTable::FindObject("test_stringTableUnknown", StringTable::OBJECT_CVAR));
+	StringTable::SetObject(a, StringTable::OBJECT_CVAR, NULL);
+	StringTable::SetObject(a, StringTable::OBJECT_COMMAND, NULL);
+	TestCheck(!StringTable::FindObject(upper, StringTable::OBJECT_CVAR));
+
+	// Threads interning the same strings all get the same pointers
+	const int NUM_STRINGS = 5000;
+	int numThreads = std::max(std::thread::hardware_concurrency(), 4u);
+	std::vector<std::vector<const char*>> results(numThreads);
+	std::vector<std::thread> threads;
+	int countBefore = StringTable::GetCount();
+	for (int i = 0; i < numThreads; i++) {
+		threads.emplace_back([&results, i] {
+			for (int j = 0; j < NUM_STRINGS; j++) {
+				char name[32];
+				snprintf(name, sizeof(name), "test_thread%d", j);
+				results[i].push_back(StringTable::Intern(name));
+			}
+		});
+	}
+	for (std::thread& i: threads)
+		i.join();
+	TestCheckEqual(StringTable::GetCount() - countBefore, NUM_STRINGS);
+	TestCheck(StringTable::GetBytes() > NUM_STRINGS * strlen("test_thread0"));
+	for (int i = 1; i < numThreads; i++)
+		TestCheck(results[i] == results[0]);
+}
+
+#ifdef __linux__
+// List files recursively, building the same kind of result as
+// Filesystem::ListFilesRecursive in any type of string vector
+template<typename List> static void ListFilesRecursive(const std::string& path, const std::string& prefix, List& files)
+{
+	DIR* dir = opendir(path.c_str());
+	if (!dir)
+		return;
+	while (dirent* entry = readdir(dir)) {
+		if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+			continue;
+		std::string name = prefix + entry->d_name;
+		if (entry->d_type == DT_DIR)
+			ListFilesRecursive(path + "/" + entry->d_name, name + "/", files);
+		else
+			files.emplace_back(name.data(), name.size());
+	}
+	closedir(dir);
+}
+
+TestCase(ListFilesArenaBenchmark)
+{
+	// The listing is done once per iteration, as when scanning for assets
+	// during a load, and the result is discarded afterwards.
+	const int ITERATIONS = 50;
+	size_t count = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < ITERATIONS; i++) {
+		std::vector<std::string> files;
+		ListFilesRecursive("src", "", files);
+		count += files.size();
+	}
+	double heap = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+
+	MemArena<65536> arena;
+	pmr::arena_resource<MemArena<65536>> resource(arena);
+	size_t arenaCount = 0;
+	start = std::chrono::steady_clock::now();
+	for (int i = 0; i < ITERATIONS; i++) {
+		ArenaMark<MemArena<65536>> mark(arena);
+		pmr::vector<pmr::string> files(&resource);
+		ListFilesRecursive("src", "", files);
+		arenaCount += files.size();
+	}
+	double arenaTime = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+	TestCheckEqual(count, arenaCount);
+	TestMsg("Listing " << count / ITERATIONS << " files: std::vector " << heap / ITERATIONS << "us, arena " << arenaTime / ITERATIONS << "us");
+
+	// Building the result without the directory reads, which dominate the
+	// time above
+	std::vector<std::string> names;
+	ListFilesRecursive("src", "", names);
+	const int BUILD_ITERATIONS = 2000;
+	start = std::chrono::steady_clock::now();
+	for (int i = 0; i < BUILD_ITERATIONS; i++) {
+		std::vector<std::string> files;
+		for (const std::string& j: names)
+			files.emplace_back(j.data(), j.size());
+	}
+	heap = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+	start = std::chrono::steady_clock::now();
+	for (int i = 0; i < BUILD_ITERATIONS; i++) {
+		ArenaMark<MemArena<65536>> mark(arena);
+		pmr::vector<pmr::string> files(&resource);
+		for (const std::string& j: names)
+			files.emplace_back(j.data(), j.size());
+	}
+	arenaTime = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+	TestMsg("Building a list of " << names.size() << " files: std::vector " << heap / BUILD_ITERATIONS << "us, arena " << arenaTime / BUILD_ITERATIONS << "us");
+}
+
+// Minimal file implementation for testing mapped arenas without the rest of
+// the filesystem
+class TestFile: public Filesystem::File {
+public:
+	explicit TestFile(const char* path, bool write)
+	{
+		fd = open(path, write ? O_RDWR | O_CREAT | O_TRUNC : O_RDONLY, 0644);
+	}
+	~TestFile()
+	{
+		if (fd != -1)
+			close(fd);
+	}
+	bool IsOpen() const
+	{
+		return fd != -1;
+	}
+
+	using Filesystem::File::Read;
+	using Filesystem::File::Write;
+	size_t Read(void* buffer, size_t length, Filesystem::fsOffset_t pos, std::error_code& err)
+	{
+		ssize_t result = pread(fd, buffer, length, pos);
+		if (result == -1) {
+			err = std::error_code(errno, std::system_category());
+			return 0;
+		}
+		return result;
+	}
+	size_t Write(const void* data, size_t length, Filesystem::fsOffset_t pos, std::error_code& err)
+	{
+		ssize_t result = pwrite(fd, data, length, pos);
+		if (result == -1) {
+			err = std::error_code(errno, std::system_category());
+			return 0;
+		}
+		return result;
+	}
+	void AsyncRead(void* buffer, size_t length, Filesystem::fsOffset_t pos, std::function<void(std::error_code, size_t)>&& callback)
+	{
+		std::error_code err;
+		size_t result = Read(buffer, length, pos, err);
+		callback(err, result);
+	}
+	void AsyncWrite(const void* data, size_t length, Filesystem::fsOffset_t pos, std::function<void(std::error_code, size_t)>&& callback)
+	{
+		std::error_code err;
+		size_t result = Write(data, length, pos, err);
+		callback(err, result);
+	}
+	void* MemMapRead(Filesystem::fsOffset_t offset, size_t length)
+	{
+		return Map(offset, length, PROT_READ, MAP_PRIVATE);
+	}
+	void* MemMapCopy(Filesystem::fsOffset_t offset, size_t length)
+	{
+		return Map(offset, length, PROT_READ | PROT_WRITE, MAP_PRIVATE);
+	}
+	void* MemMapEdit(Filesystem::fsOffset_t offset, size_t length)
+	{
+		return Map(offset, length, PROT_READ | PROT_WRITE, MAP_SHARED);
+	}
+	void MemUnmap(void* ptr)
+	{
+		munmap(ptr, mappings[ptr]);
+		mappings.erase(ptr);
+	}
+	Filesystem::fsOffset_t Length()
+	{
+		struct stat st;
+		return fstat(fd, &st) ? 0 : st.st_size;
+	}
+	time_t Timestamp()
+	{
+		struct stat st;
+		return fstat(fd, &st) ? 0 : st.st_mtime;
+	}
+
+private:
+	int fd;
+	std::map<void*, size_t> mappings;
+
+	void* Map(Filesystem::fsOffset_t offset, size_t length, int prot, int flags)
+	{
+		void* ptr = mmap(NULL, length, prot, flags, fd, offset);
+		if (ptr == MAP_FAILED)
+			return NULL;
+		mappings[ptr] = length;
+		return ptr;
+	}
+};
+
+// Hash table of names stored in a mapped arena
+struct mappedEntry_t {
+	RelativePtr<const char> name;
+	RelativePtr<mappedEntry_t> next;
+	int value;
+};
+struct mappedTable_t {
+	size_t numBuckets;
+	RelativePtr<RelativePtr<mappedEntry_t>> buckets;
+
+	const mappedEntry_t* Find(const char* name) const
+	{
+		for (const mappedEntry_t* i = buckets[std::hash<std::string>()(name) % numBuckets]; i; i = i->next) {
+			if (!strcmp(i->name, name))
+				return i;
+		}
+		return NULL;
+	}
+};
+
+static mappedTable_t* BuildMappedTable(MemArenaMapped& arena, int count)
+{
+	mappedTable_t* table = new(arena) mappedTable_t;
+	table->numBuckets = count;
+	table->buckets = new(arena) RelativePtr<mappedEntry_t>[count];
+	for (int i = 0; i < count; i++) {
+		char name[32];
+		snprintf(name, sizeof(name), "entity%d", i);
+		mappedEntry_t* entry = new(arena) mappedEntry_t;
+		entry->name = arena.CopyString(name);
+		entry->value = i;
+		RelativePtr<mappedEntry_t>& bucket = table->buckets[std::hash<std::string>()(name) % count];
+		entry->next = bucket;
+		bucket = entry;
+	}
+	arena.SetRoot(table);
+	return table;
+}
+
+TestCase(MappedArena)
+{
+	const int COUNT = 1000;
+	std::string path = "/tmp/mappedArenaTest" + std::to_string(getpid());
+	{
+		TestFile file(path.c_str(), true);
+		TestCheck(file.IsOpen());
+		MemArenaMapped arena;
+		arena.Create(file, 1 << 20);
+		TestCheckEqual(arena.GetCapacity(), size_t(1 << 20));
+		BuildMappedTable(arena, COUNT);
+		TestCheckEqual(arena.GetRoot<mappedTable_t>()->Find("entity10")->value, 10);
+
+		// Allocations fail once the arena is full, and can be rewound
+		MemArenaMapped::mark_t mark = arena.GetMark();
+		TestCheck(!arena.Alloc(2 << 20));
+		TestCheck(arena.Alloc(1000));
+		arena.Rewind(mark);
+		TestCheckEqual(arena.GetUsed(), mark);
+	}
+
+	// Map the file twice, at different addresses, and check that the data set
+	// is usable from both without any fixups
+	TestFile file(path.c_str(), false);
+	MemArenaMapped a, b;
+	a.Open(file);
+	b.Open(file);
+	const mappedTable_t* tableA = a.GetRoot<mappedTable_t>();
+	const mappedTable_t* tableB = b.GetRoot<mappedTable_t>();
+	TestCheck(static_cast<const void*>(tableA) != static_cast<const void*>(tableB));
+	for (int i = 0; i < COUNT; i++) {
+		std::string name = "entity" + std::to_string(i);
+		TestCheckEqual(tableA->Find(name.c_str())->value, i);
+		TestCheckEqual(tableB->Find(name.c_str())->value, i);
+	}
+	TestCheck(!tableA->Find("entity-1"));
+	a.Close();
+	b.Close();
+
+	// Headers whose used size or root are outside of the data are rejected.
+	// The used size and root offset follow the magic, version and capacity.
+	std::error_code err;
+	const std::array<uint64_t, 2> corruptHeaders[] = {{{8, 0}}, {{4096, 8192}}};
+	for (const std::array<uint64_t, 2>& corrupt: corruptHeaders) {
+		TestFile corrupted(path.c_str(), true);
+		a.Create(corrupted, 65536);
+		a.SetRoot(a.Alloc(16));
+		a.Close();
+		corrupted.Write(corrupt.data(), sizeof(corrupt), 16);
+		a.Open(corrupted, false, err);
+		TestCheck(err);
+		TestCheck(!a.IsOpen());
+		err.clear();
+	}
+
+	// Files which don't contain an arena are rejected
+	const char garbage[64] = "not an arena";
+	TestFile(path.c_str(), true).Write(garbage, sizeof(garbage), 0);
+	TestFile reopened(path.c_str(), false);
+	a.Open(reopened, false, err);
+	TestCheck(err);
+	TestCheck(!a.IsOpen());
+	unlink(path.c_str());
+}
+
+TestCase(MappedArenaColdStartBenchmark)
+{
+	// Compare rebuilding a derived data set from scratch, as on a map change,
+	// with mapping in a copy of it which was saved earlier
+	const int COUNT = 200000;
+	std::string path = "/tmp/mappedArenaBench" + std::to_string(getpid());
+	{
+		TestFile file(path.c_str(), true);
+		MemArenaMapped arena;
+		arena.Create(file, 32 << 20);
+		BuildMappedTable(arena, COUNT);
+	}
+
+	int found = 0;
+	double rebuild = TestTime([&found] {
+		std::unordered_map<std::string, int> table(COUNT);
+		for (int i = 0; i < COUNT; i++) {
+			char name[32];
+			snprintf(name, sizeof(name), "entity%d", i);
+			table.emplace(name, i);
+		}
+		found += table.find("entity1234")->second == 1234;
+	});
+	double mapped = TestTime([&path, &found] {
+		TestFile file(path.c_str(), false);
+		MemArenaMapped arena;
+		arena.Open(file);
+		found += arena.GetRoot<mappedTable_t>()->Find("entity1234")->value == 1234;
+	});
+	TestCheckEqual(found, 2);
+	TestMsg("Cold start with " << COUNT << " entries: rebuild " << rebuild << "us, mapped " << mapped << "us");
+	unlink(path.c_str());
+}
+#endif
+
+// Run a mixed allocation workload on a number of threads. Each thread keeps a
+// ring of live allocations and replaces one of them at every iteration.
+template<typename Alloc, typename Free> static double AllocBenchmark(int numThreads, int iterations, const std::vector<size_t>& sizes, Alloc alloc, Free free)
+{
+	const int LIVE_OBJECTS = 256;
+
+	std::vector<std::thread> threads;
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < numThreads; i++) {
+		threads.emplace_back([&, i] {
+			std::pair<void*, size_t> live[LIVE_OBJECTS] = {};
+			for (int j = 0; j < iterations; j++) {
+				auto& slot = live[j % LIVE_OBJECTS];
+				if (slot.first)
+					free(slot.first, slot.second);
+				slot.second = sizes[(j * 7 + i) % sizes.size()];
+				slot.first = alloc(slot.second);
+				*static_cast<char*>(slot.first) = 0;
+			}
+			for (auto& slot: live) {
+				if (slot.first)
+					free(slot.first, slot.second);
+			}
+		});
+	}
+	for (std::thread& i: threads)
+		i.join();
+	return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Compare MemAlloc with the system malloc for a set of allocation sizes
+static void CompareWithMalloc(const char* name, int iterations, const std::vector<size_t>& sizes)
+{
+	int maxThreads = std::max(std::thread::hardware_concurrency(), 1u);
+	for (int numThreads = 1; numThreads <= maxThreads; numThreads *= 2) {
+		double mem = AllocBenchmark(numThreads, iterations, sizes, [](size_t size) {
+			return MemAlloc(size);
+		}, [](void* ptr, size_t) {
+			MemFree(ptr);
+		});
+		double memSized = AllocBenchmark(numThreads, iterations, sizes, [](size_t size) {
+			return MemAlloc(size);
+		}, [](void* ptr, size_t size) {
+			MemFree(ptr, size);
+		});
+		double sys = AllocBenchmark(numThreads, iterations, sizes, [](size_t size) {
+			return malloc(size);
+		}, [](void* ptr, size_t) {
+			free(ptr);
+		});
+		double ops = static_cast<double>(numThreads) * iterations;
+		TestMsg(name << ", " << numThreads << " threads: MemAlloc " << ops / mem << " ops/us, sized MemFree " << ops / memSized << " ops/us, malloc " << ops / sys << " ops/us");
+	}
+}
+
+TestCase(MemAllocBenchmark)
+{
+	CompareWithMalloc("Small objects", 500000, {8, 16, 24, 32, 48, 64, 96, 128, 256, 512});
+}
+
+TestCase(MemAllocBufferBenchmark)
+{
+	// Buffers between 1KB and 16KB used to go to the system allocator
+	CompareWithMalloc("Buffers", 200000, {1100, 2000, 3000, 4096, 5000, 8192, 10000, 16000});
+}
+
+TestCase(HeapProfilerBenchmark)
+{
+	// The profiler should cost nothing measurable when stopped, and little at
+	// the default interval
+	const int ITERATIONS = 1000000;
+	std::vector<size_t> sizes = {8, 16, 24, 32, 48, 64, 96, 128, 256, 512};
+	auto alloc = [](size_t size) {
+		return MemAlloc(size);
+	};
+	auto free = [](void* ptr, size_t size) {
+		MemFree(ptr, size);
+	};
+	double off = AllocBenchmark(1, ITERATIONS, sizes, alloc, free);
+	MemProfiler::Start(512 * 1024);
+	double on = AllocBenchmark(1, ITERATIONS, sizes, alloc, free);
+	MemProfiler::Stop();
+	MemProfiler::Reset();
+	TestMsg("Profiler stopped: " << ITERATIONS / off << " ops/us, sampling every 512KB: " << ITERATIONS / on << " ops/us");
+}
+
+// Allocate objects on one thread and free them on another, passing them
+// through a single-producer single-consumer ring buffer.
+template<typename Alloc, typename Free> static double ProducerConsumerBenchmark(int count, size_t size, Alloc alloc, Free free)
+{
+	const int RING_SIZE = 4096;
+	std::unique_ptr<std::atomic<void*>[]> ring(new std::atomic<void*>[RING_SIZE]);
+	for (int i = 0; i < RING_SIZE; i++)
+		ring[i] = nullptr;
+
+	auto start = std::chrono::steady_clock::now();
+	std::thread consumer([&] {
+		for (int i = 0; i < count; i++) {
+			std::atomic<void*>& slot = ring[i % RING_SIZE];
+			void* ptr;
+			while (!(ptr = slot.load(std::memory_order_acquire)))
+				std::this_thread::yield();
+			slot.store(nullptr, std::memory_order_relaxed);
+			free(ptr, size);
+		}
+	});
+	for (int i = 0; i < count; i++) {
+		std::atomic<void*>& slot = ring[i % RING_SIZE];
+		while (slot.load(std::memory_order_relaxed))
+			std::this_thread::yield();
+		void* ptr = alloc(size);
+		*static_cast<char*>(ptr) = 0;
+		slot.store(ptr, std::memory_order_release);
+	}
+	consumer.join();
+	return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+}
+
+TestCase(CrossThreadFreeBenchmark)
+{
+	const int COUNT = 500000;
+	for (size_t size: {16, 64, 256, 2048}) {
+		double mem = ProducerConsumerBenchmark(COUNT, size, [](size_t size) {
+			return MemAlloc(size);
+		}, [](void* ptr, size_t size) {
+			MemFree(ptr, size);
+		});
+		double sys = ProducerConsumerBenchmark(COUNT, size, [](size_t size) {
+			return malloc(size);
+		}, [](void* ptr, size_t) {
+			free(ptr);
+		});
+		TestMsg("Producer/consumer, " << size << " bytes: MemAlloc " << COUNT / mem << " ops/us, malloc " << COUNT / sys << " ops/us");
+	}
+}
+
+TestCase(ChurnFragmentation)
+{
+	// Simple xorshift generator so that runs are reproducible
+	uint32_t seed = 2463534242u;
+	auto random = [&seed]() {
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		return seed;
+	};
+
+	// Fill the heap with small objects, free most of them in random order
+	// and then churn with a small live set for a while. The live objects are
+	// spread over all of the blocks at first, so blocks can only be released
+	// if allocations are steered towards the fullest blocks. Freed spans are
+	// decommitted immediately and the committed block memory is measured,
+	// since pages released with MADV_FREE still count as resident.
+	MemVirtual::SetDecayTime(0);
+	auto committed = [] {
+		MemVirtual::Purge(true);
+		return MemVirtual::GetCommittedBytes();
+	};
+	const int NUM_OBJECTS = 400000;
+	const int LIVE_OBJECTS = NUM_OBJECTS / 10;
+	const int CHURN = 4000000;
+	const size_t SIZE = 96;
+	size_t memStart = committed();
+	std::vector<void*> objects(NUM_OBJECTS);
+	for (void*& i: objects) {
+		i = MemAlloc(SIZE);
+		memset(i, 0, SIZE);
+	}
+	size_t memPeak = committed();
+	for (int i = NUM_OBJECTS - 1; i > 0; i--)
+		std::swap(objects[i], objects[random() % (i + 1)]);
+	for (int i = LIVE_OBJECTS; i < NUM_OBJECTS; i++)
+		MemFree(objects[i], SIZE);
+	objects.resize(LIVE_OBJECTS);
+	size_t memFreed = committed();
+	for (int i = 0; i < CHURN; i++) {
+		void*& slot = objects[random() % LIVE_OBJECTS];
+		MemFree(slot, SIZE);
+		slot = MemAlloc(SIZE);
+		memset(slot, 0, SIZE);
+	}
+	size_t memChurn = committed();
+	for (void* i: objects)
+		MemFree(i, SIZE);
+
+	MemVirtual::SetDecayTime(1000);
+
+	double live = LIVE_OBJECTS * SIZE;
+	int64_t freed = static_cast<int64_t>(memFreed) - memStart;
+	int64_t churn = static_cast<int64_t>(memChurn) - memStart;
+	TestMsg("Churn: committed peak " << (memPeak - memStart) / 1024 << "KB, after free " << freed / 1024 << "KB, after churn " << churn / 1024 << "KB for " << live / 1024 << "KB live (" << std::max<double>(churn, 0) / live << "x)");
+
+	// Churning releases most of the blocks which were left sparse by the
+	// random frees. With a single partial list this is almost 6x.
+	TestCheck(churn < 4 * live);
+	TestCheck(churn < freed / 2);
+}
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+// Open a counter for the data TLB misses of the calling thread. Returns -1 if
+// performance counters are not available.
+static int OpenTLBMissCounter()
+{
+	perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HW_CACHE;
+	attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+TestCase(HugePageTLBBenchmark)
+{
+	// Link small objects into a cycle in random order and follow it, which
+	// touches a different page at almost every step.
+	const int COUNT = 1 << 20;
+	const int STEPS = 1 << 23;
+	const size_t SIZE = 64;
+	uint32_t seed = 2463534242u;
+	for (bool huge: {false, true}) {
+		MemVirtual::SetHugePages(huge);
+		std::vector<void**> objects(COUNT);
+		for (void**& i: objects)
+			i = static_cast<void**>(MemAlloc(SIZE));
+		for (int i = COUNT - 1; i > 0; i--) {
+			seed ^= seed << 13;
+			seed ^= seed >> 17;
+			seed ^= seed << 5;
+			std::swap(objects[i], objects[seed % (i + 1)]);
+		}
+		for (int i = 0; i < COUNT; i++)
+			*objects[i] = objects[(i + 1) % COUNT];
+
+		int fd = OpenTLBMissCounter();
+		if (fd != -1) {
+			ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+			ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+		}
+		auto start = std::chrono::steady_clock::now();
+		void** ptr = objects[0];
+		for (int i = 0; i < STEPS; i++)
+			ptr = static_cast<void**>(*ptr);
+		double elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+		uint64_t misses = 0;
+		if (fd != -1) {
+			ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+			if (read(fd, &misses, sizeof(misses)) != sizeof(misses))
+				misses = 0;
+			close(fd);
+		}
+		TestCheck(ptr != nullptr);
+
+		if (fd != -1)
+			TestMsg("Pointer chase with huge pages " << (huge ? "on" : "off") << ": " << elapsed / STEPS << "ns per step, " << static_cast<double>(misses) / STEPS << " dTLB misses per step");
+		else
+			TestMsg("Pointer chase with huge pages " << (huge ? "on" : "off") << ": " << elapsed / STEPS << "ns per step, TLB counters unavailable");
+
+		for (void** i: objects)
+			MemFree(i, SIZE);
+		MemVirtual::Purge(true);
+	}
+	MemVirtual::SetHugePages(false);
+}
+#endif
+
+EndTestSuite()
@@ -4,6 +4,8 @@
 
 boost::unit_test::test_suite *init_unit_test_suite(int, char **)
 {
+	Memory::Init();
 	Math::Init();
+	threadpool::init(1);
 	return NULL;
 }
@@ -4,6 +4,7 @@
 
 #include <boost/test/unit_test.hpp>
 #include <iostream>
+#include <chrono>
 
 // Tolerance percentage for floating point comparaisons
 // 6 significant figures ~= 20 bits of precision
@@ -19,6 +20,15 @@
 #define TestCheckClose2(a, b) BOOST_CHECK_PREDICATE(TestClosePredicate(), (a)(b))
 #define TestMsg BOOST_MESSAGE
 
+// Time a benchmark function, returns the elapsed time in microseconds
+template<typename Func> inline double TestTime(Func func)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+	func();
+	auto end = std::chrono::high_resolution_clock::now();
+	return std::chrono::duration<double, std::micro>(end - start).count();
+}
+
 // Custom predicate for comparing vector types
 class TestClosePredicate {
 public:
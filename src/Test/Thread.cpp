@@ -0,0 +1,419 @@
+//@@COPYRIGHT@@
+
+// Unit tests and benchmarks for threading primitives
+
+TestSuite(ThreadTest)
+
+// Intrusive item for queue tests
+typedef intrusive::slist_base_hook<intrusive::link_mode<intrusive::normal_link>> TestHook;
+struct TestItem: public TestHook {
+	int value;
+};
+typedef lockfree::intrusive_queue_sc<TestItem, intrusive::base_hook<TestHook>> TestQueue;
+
+TestCase(IntrusiveQueueDequeueAll)
+{
+	TestItem items[10];
+	TestQueue queue;
+
+	// Leave some items in the private list to check ordering
+	for (int i = 0; i < 5; i++) {
+		items[i].value = i;
+		queue.enqueue(items[i]);
+	}
+	TestCheckEqual(queue.dequeue()->value, 0);
+	for (int i = 5; i < 10; i++) {
+		items[i].value = i;
+		queue.enqueue(items[i]);
+	}
+
+	std::vector<int> values;
+	size_t count = queue.dequeue_all([&values](TestItem& item) {
+		values.push_back(item.value);
+	});
+	TestCheckEqual(count, 9u);
+	TestCheckEqual(values.size(), 9u);
+	for (int i = 0; i < 9; i++)
+		TestCheckEqual(values[i], i + 1);
+	TestCheck(queue.empty());
+
+	for (int i = 0; i < 3; i++)
+		queue.enqueue(items[i]);
+	std::vector<TestItem*> ptrs;
+	queue.drain_into(std::back_inserter(ptrs));
+	TestCheckEqual(ptrs.size(), 3u);
+	for (int i = 0; i < 3; i++)
+		TestCheckEqual(ptrs[i], &items[i]);
+	TestCheck(queue.dequeue() == nullptr);
+}
+
+TestCase(QueueDequeueAll)
+{
+	lockfree::queue_sc<std::string> queue;
+	for (int i = 0; i < 4; i++)
+		queue.enqueue(std::to_string(i));
+	TestCheckEqual(*queue.dequeue(), "0");
+
+	std::vector<std::string> values;
+	queue.drain_into(std::back_inserter(values));
+	TestCheckEqual(values.size(), 3u);
+	TestCheckEqual(values[0], "1");
+	TestCheckEqual(values[2], "3");
+	TestCheck(queue.empty());
+
+	// Items not processed when the callback throws stay in the queue
+	for (int i = 0; i < 4; i++)
+		queue.enqueue(std::to_string(i));
+	int processed = 0;
+	try {
+		queue.dequeue_all([&processed](std::string&& str) {
+			if (str == "2")
+				throw std::runtime_error(str);
+			processed++;
+		});
+	} catch (std::runtime_error&) {}
+	TestCheckEqual(processed, 2);
+	TestCheckEqual(*queue.dequeue(), "3");
+	TestCheck(queue.empty());
+}
+
+TestCase(QueueDrainBenchmark)
+{
+	const int NUM_MESSAGES = 1000;
+	const int NUM_ROUNDS = 100;
+	lockfree::queue_sc<int> queue;
+	long sum1 = 0, sum2 = 0;
+
+	double single = 0, batch = 0;
+	for (int round = 0; round < NUM_ROUNDS; round++) {
+		for (int i = 0; i < NUM_MESSAGES; i++)
+			queue.enqueue(i);
+		single += TestTime([&] {
+			while (boost::optional<int> value = queue.dequeue())
+				sum1 += *value;
+		});
+
+		for (int i = 0; i < NUM_MESSAGES; i++)
+			queue.enqueue(i);
+		batch += TestTime([&] {
+			queue.dequeue_all([&sum2](int value) {
+				sum2 += value;
+			});
+		});
+	}
+
+	TestCheckEqual(sum1, sum2);
+	TestMsg("Draining " << NUM_MESSAGES << " messages: dequeue() " << single / NUM_ROUNDS << "us, dequeue_all() " << batch / NUM_ROUNDS << "us");
+
+	// The intrusive queue has no node to free for each item, so this only
+	// measures the overhead of going through the queue
+	std::vector<TestItem> items(NUM_MESSAGES);
+	for (int i = 0; i < NUM_MESSAGES; i++)
+		items[i].value = i;
+	TestQueue intrusiveQueue;
+	single = batch = 0;
+	for (int round = 0; round < NUM_ROUNDS; round++) {
+		for (TestItem& i: items)
+			intrusiveQueue.enqueue(i);
+		single += TestTime([&] {
+			while (TestItem* item = intrusiveQueue.dequeue())
+				sum1 += item->value;
+		});
+
+		for (TestItem& i: items)
+			intrusiveQueue.enqueue(i);
+		batch += TestTime([&] {
+			intrusiveQueue.dequeue_all([&sum2](TestItem& item) {
+				sum2 += item.value;
+			});
+		});
+	}
+
+	TestCheckEqual(sum1, sum2);
+	TestMsg("Draining " << NUM_MESSAGES << " intrusive items: dequeue() " << single / NUM_ROUNDS << "us, dequeue_all() " << batch / NUM_ROUNDS << "us");
+}
+
+// Run func on numThreads threads at once and return the elapsed time in
+// microseconds
+template<typename Func> static double RunThreads(int numThreads, Func func)
+{
+	return TestTime([&] {
+		std::vector<std::thread> threads;
+		for (int i = 0; i < numThreads; i++)
+			threads.emplace_back(func, i);
+		for (std::thread& t: threads)
+			t.join();
+	});
+}
+
+// Number of threads used to oversubscribe the CPU
+static int OversubscribedThreads()
+{
+	return std::max(std::thread::hardware_concurrency(), 1u) * 4;
+}
+
+// Increment a counter under a lock from multiple threads
+template<typename Lock> static double LockBenchmark(int numThreads, int iterations)
+{
+	Lock lock;
+	long counter = 0;
+	double time = RunThreads(numThreads, [&](int) {
+		for (int i = 0; i < iterations; i++) {
+			std::lock_guard<Lock> locked(lock);
+			counter++;
+		}
+	});
+	TestCheckEqual(counter, static_cast<long>(numThreads) * iterations);
+	return time;
+}
+
+TestCase(SharedMutex)
+{
+	thread::adaptive_shared_mutex lock;
+
+	// Multiple readers, but not a writer at the same time
+	TestCheck(lock.try_lock_shared());
+	TestCheck(lock.try_lock_shared());
+	TestCheck(!lock.try_lock());
+	lock.unlock_shared();
+	lock.unlock_shared();
+	TestCheck(lock.try_lock());
+	TestCheck(!lock.try_lock_shared());
+	lock.unlock();
+
+	// Writers must see a consistent pair of values
+	int a = 0, b = 0;
+	bool mismatch = false;
+	RunThreads(OversubscribedThreads(), [&](int id) {
+		for (int i = 0; i < 2000; i++) {
+			if (id % 4 == 0) {
+				std::lock_guard<thread::adaptive_shared_mutex> locked(lock);
+				a++;
+				b++;
+			} else {
+				thread::shared_lock_guard<thread::adaptive_shared_mutex> locked(lock);
+				if (a != b)
+					mismatch = true;
+			}
+		}
+	});
+	TestCheck(!mismatch);
+	TestCheckEqual(a, b);
+}
+
+TestCase(ProfiledLock)
+{
+	static const int ITERATIONS = 10000;
+	thread::profiled_lock<std::mutex> lock{"ProfiledLockTest"};
+
+	// Profiled locks still provide mutual exclusion
+	long counter = 0;
+	RunThreads(2, [&](int) {
+		for (int i = 0; i < ITERATIONS; i++) {
+			std::lock_guard<thread::profiled_lock<std::mutex>> locked(lock);
+			counter++;
+		}
+	});
+	TestCheckEqual(counter, 2 * ITERATIONS);
+
+#ifdef USE_LOCK_PROFILE
+	thread::lock_site* site = thread::lock_site::get("ProfiledLockTest");
+	TestCheckEqual(site->acquisitions.load(), 2u * ITERATIONS);
+	uint64_t contended = site->contended.load();
+
+	// Hold the lock while another thread waits for it, which must be recorded
+	// as a contended acquisition
+	std::atomic<bool> waiting(false);
+	lock.lock();
+	std::thread waiter([&] {
+		waiting = true;
+		lock.lock();
+		lock.unlock();
+	});
+	while (!waiting)
+		std::this_thread::yield();
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	lock.unlock();
+	waiter.join();
+
+	TestCheckEqual(site->acquisitions.load(), 2u * ITERATIONS + 2);
+	TestCheckEqual(site->contended.load(), contended + 1);
+	TestCheck(site->wait_time.load() > 0);
+	uint64_t histogram = 0;
+	for (auto& i: site->histogram)
+		histogram += i.load();
+	TestCheckEqual(histogram, site->contended.load());
+#else
+	// Without profiling the lock is just the underlying lock
+	TestCheckEqual(sizeof(lock), sizeof(std::mutex));
+#endif
+}
+
+TestCase(AdaptiveMutexBenchmark)
+{
+	const int ITERATIONS = 20000;
+	int numThreads = OversubscribedThreads();
+
+	double spin = LockBenchmark<thread::spinlock>(numThreads, ITERATIONS);
+	double mutex = LockBenchmark<std::mutex>(numThreads, ITERATIONS);
+	double adaptive = LockBenchmark<thread::adaptive_mutex>(numThreads, ITERATIONS);
+	double shared = LockBenchmark<thread::adaptive_shared_mutex>(numThreads, ITERATIONS);
+	TestMsg(numThreads << " threads x " << ITERATIONS << " locks: spinlock " << spin << "us, std::mutex " << mutex << "us, adaptive_mutex " << adaptive << "us, adaptive_shared_mutex " << shared << "us");
+
+	// Read-mostly workload: 1 write for every 16 reads
+	thread::adaptive_shared_mutex rwlock;
+	std::mutex plainLock;
+	long value = 0;
+	double readShared = RunThreads(numThreads, [&](int) {
+		for (int i = 0; i < ITERATIONS; i++) {
+			if (i % 16 == 0) {
+				std::lock_guard<thread::adaptive_shared_mutex> locked(rwlock);
+				value++;
+			} else {
+				thread::shared_lock_guard<thread::adaptive_shared_mutex> locked(rwlock);
+				(void)*static_cast<volatile long*>(&value);
+			}
+		}
+	});
+	double readMutex = RunThreads(numThreads, [&](int) {
+		for (int i = 0; i < ITERATIONS; i++) {
+			std::lock_guard<std::mutex> locked(plainLock);
+			if (i % 16 == 0)
+				value++;
+			else
+				(void)*static_cast<volatile long*>(&value);
+		}
+	});
+	TestMsg("Read-mostly workload: adaptive_shared_mutex " << readShared << "us, std::mutex " << readMutex << "us");
+}
+
+// Measure throughput and the longest time a thread had to wait for the lock
+template<typename Lock> static void FairnessBenchmark(const char* name, int numThreads, int iterations)
+{
+	Lock lock;
+	long counter = 0;
+	std::vector<double> maxWait(numThreads);
+	double time = RunThreads(numThreads, [&](int id) {
+		for (int i = 0; i < iterations; i++) {
+			auto start = std::chrono::steady_clock::now();
+			std::lock_guard<Lock> locked(lock);
+			double wait = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+			maxWait[id] = std::max(maxWait[id], wait);
+			counter++;
+		}
+	});
+	TestCheckEqual(counter, static_cast<long>(numThreads) * iterations);
+	TestMsg(name << ": " << numThreads * iterations / time << " locks/us, max wait " << *std::max_element(maxWait.begin(), maxWait.end()) << "us");
+}
+
+TestCase(QueueLocks)
+{
+	thread::ticket_lock ticket;
+	TestCheck(ticket.try_lock());
+	TestCheck(!ticket.try_lock());
+	ticket.unlock();
+	TestCheck(ticket.try_lock());
+	ticket.unlock();
+
+	// MCS locks can be released in any order
+	thread::mcs_lock a, b, c;
+	a.lock();
+	b.lock();
+	TestCheck(!a.try_lock());
+	a.unlock();
+	c.lock();
+	TestCheck(a.try_lock());
+	b.unlock();
+	c.unlock();
+	a.unlock();
+
+	// Check mutual exclusion under contention
+	LockBenchmark<thread::mcs_lock>(2, 1000);
+	LockBenchmark<thread::ticket_lock>(2, 1000);
+}
+
+TestCase(QueueLockBenchmark)
+{
+	// Queue locks hand the lock to a specific thread, which is very slow
+	// if that thread isn't running, so don't oversubscribe here.
+	const int ITERATIONS = 20000;
+	int numThreads = std::max(std::thread::hardware_concurrency(), 1u);
+
+	FairnessBenchmark<thread::spinlock>("spinlock", numThreads, ITERATIONS);
+	FairnessBenchmark<thread::ticket_lock>("ticket_lock", numThreads, ITERATIONS);
+	FairnessBenchmark<thread::mcs_lock>("mcs_lock", numThreads, ITERATIONS);
+}
+
+// Payload for seqlock tests, all fields must always be equal
+struct TestSnapshot {
+	long a, b, c;
+	int d;
+};
+
+TestCase(Seqlock)
+{
+	thread::seqlock<TestSnapshot> snapshot;
+	TestCheckEqual(snapshot.load().a, 0);
+	snapshot.store(TestSnapshot{1, 1, 1, 1});
+	snapshot.update([](TestSnapshot& value) {
+		value.a = value.b = value.c = value.d = value.d + 1;
+	});
+	TestCheckEqual(snapshot.load().c, 2);
+
+	// Readers must never see a torn value
+	std::atomic<bool> done{false};
+	std::atomic<int> torn{0};
+	std::thread writer([&] {
+		for (int i = 3; i < 20000; i++)
+			snapshot.store(TestSnapshot{i, i, i, i});
+		done = true;
+	});
+	RunThreads(2, [&](int) {
+		while (!done) {
+			TestSnapshot value = snapshot.load();
+			if (value.a != value.b || value.b != value.c || value.c != value.d)
+				torn++;
+		}
+	});
+	writer.join();
+	TestCheckEqual(torn.load(), 0);
+}
+
+TestCase(SeqlockBenchmark)
+{
+	const int ITERATIONS = 200000;
+	int maxThreads = std::max(std::thread::hardware_concurrency(), 1u);
+
+	// Read a snapshot which is updated once every 1000 reads
+	for (int numThreads = 1; numThreads <= maxThreads; numThreads *= 2) {
+		thread::seqlock<TestSnapshot> seq;
+		double seqTime = RunThreads(numThreads, [&](int id) {
+			long sum = 0;
+			for (int i = 0; i < ITERATIONS; i++) {
+				if (id == 0 && i % 1000 == 0)
+					seq.store(TestSnapshot{i, i, i, i});
+				else
+					sum += seq.load().a;
+			}
+			(void)*static_cast<volatile long*>(&sum);
+		});
+
+		thread::spinlock lock;
+		TestSnapshot value = {0, 0, 0, 0};
+		double spinTime = RunThreads(numThreads, [&](int id) {
+			long sum = 0;
+			for (int i = 0; i < ITERATIONS; i++) {
+				std::lock_guard<thread::spinlock> locked(lock);
+				if (id == 0 && i % 1000 == 0)
+					value = TestSnapshot{i, i, i, i};
+				else
+					sum += value.a;
+			}
+			(void)*static_cast<volatile long*>(&sum);
+		});
+
+		TestMsg(numThreads << " readers: seqlock " << numThreads * ITERATIONS / seqTime << " reads/us, spinlock " << numThreads * ITERATIONS / spinTime << " reads/us");
+	}
+}
+
+EndTestSuite()